@@ -41,6 +41,21 @@
 // negativ elojellel szamoljak el es ezzel parhuzamosan eljaras is indul velem szemben.
 //=============================================================================================
 #include "framework.h"
+#include "bench.h"
+#include "gputimer.h"
+#include "options.h"
+#include "alloc.h"
+#include "softraster.h"
+#include "raytracer.h"
+#include "rendertarget.h"
+#include "lightgrid.h"
+#include "streambuffer.h"
+#include "meshpool.h"
+#include "indirect.h"
+#include "gpucull.h"
+#include <random>
+#include <algorithm>
+#include <string.h>
 
 //---------------------------
 template<class T> struct Dnum { // Dual numbers for automatic derivation
@@ -73,7 +88,7 @@ template<class T> Dnum<T> Pow(Dnum<T> g, float n) {
 
 typedef Dnum<vec2> Dnum2;
 
-const int tessellationLevel = 20;
+const int maxShaderLights = 8;  // size of the light array of the forward shaders
 
 //---------------------------
 struct Camera { // 3D camera
@@ -102,6 +117,26 @@ public:
                     0,                      0,                -(fp + bp) / (bp - fp), -1,
                     0,                      0,                -2 * fp*bp / (bp - fp),  0);
     }
+
+    void FrustumPlanes(vec4 planes[6]) { // normalized planes, inside points give non-negative dot(plane, point)
+        mat4 VP = V() * P();
+        vec4 col[4];
+        for (int j = 0; j < 4; j++) col[j] = vec4(VP[0][j], VP[1][j], VP[2][j], VP[3][j]);
+        for (int i = 0; i < 3; i++) {
+            planes[2 * i] = col[3] + col[i];
+            planes[2 * i + 1] = col[3] - col[i];
+        }
+        for (int i = 0; i < 6; i++) planes[i] = planes[i] / length(vec3(planes[i].x, planes[i].y, planes[i].z));
+    }
+
+    void RayBasis(vec3& forward, vec3& right, vec3& up) { // the image plane at unit distance spans forward +- right +- up
+        vec3 w = normalize(wEye - wLookat);
+        vec3 u = normalize(cross(wVup, w));
+        vec3 v = cross(w, u);
+        forward = -w;
+        right = u * (tan(fov / 2) * asp);
+        up = v * tan(fov / 2);
+    }
 };
 
 //---------------------------
@@ -116,49 +151,162 @@ struct Light {
 //---------------------------
     vec3 La, Le;
     vec4 wLightPos; // homogeneous coordinates, can be at ideal point
+    float range = 0; // of point lights, Le fades to zero there; 0 reaches everywhere
 };
 
 //---------------------------
 class CheckerBoardTexture : public Texture {
 //---------------------------
 public:
-    CheckerBoardTexture(const int width, const int height) : Texture() {
+    // A transparent board derives alpha from the color like Texture::load, yellow is more opaque than blue
+    CheckerBoardTexture(const int width, const int height, bool _transparent = false) : Texture() {
+        AllocScope allocScope(ALLOC_TEXTURES);
         std::vector<vec4> image(width * height);
-        const vec4 yellow(1, 1, 0, 1), blue(0, 0, 1, 1);
+        vec4 yellow(1, 1, 0, 1), blue(0, 0, 1, 1);
+        if (_transparent) {
+            yellow.w = 2.0f / 3;
+            blue.w = 1.0f / 3;
+        }
         for (int x = 0; x < width; x++) for (int y = 0; y < height; y++) {
                 image[y * width + x] = (x & 1) ^ (y & 1) ? yellow : blue;
             }
         create(width, height, image, GL_NEAREST);
+        seeThrough = _transparent;
     }
 };
 
+enum RenderPass {
+    PASS_FORWARD,   // every object is shaded completely
+    PASS_LIGHTING,  // objects of reduced rate lighting write their lights into the lighting buffer
+    PASS_RESOLVE,   // objects of reduced rate lighting upsample the lighting buffer, the others are shaded completely
+};
+
+//---------------------------
+struct ShadowMaps { // cube depth maps of the first point lights, read by the Phong programs
+//---------------------------
+    static const int maxLights = 4;
+    int count = 0;                          // lights 0 .. count - 1 are shadowed
+    unsigned int maps[maxLights] = {};      // cube textures comparing the distance over far
+    float far[maxLights] = {};              // distance stored as 1
+    int size = 0;                           // of a face in texels
+};
+
 //---------------------------
 struct RenderState {
 //---------------------------
     mat4	           MVP, M, Minv, V, P;
     Material *         material;
-    std::vector<Light> lights;
+    const std::vector<Light> * lights;  // of the scene, not copied per object
     Texture *          texture;
     vec3	           wEye;
+    RenderPass         pass = PASS_FORWARD;
+    const RenderTarget * lighting = nullptr;  // read in the resolve pass
+    const LightGrid *  lightGrid = nullptr; // lights of the clusters, the Phong objects shade only those
+    const ShadowMaps * shadows = nullptr;
+    StreamBuffer *     objectData = nullptr; // per-draw blocks of the streamed Phong program
 };
 
+// Range fall-off of the point lights
+static const char * const attenuationGLSL = R"(
+		float attenuation(float range, float dist) {	// 1 without a range, fades to 0 at the range
+			if (range <= 0) return 1.0;
+			float x = max(1 - dist * dist / (range * range), 0);
+			return x * x;
+		}
+)";
+
+// Lookup of the cube shadow maps of the first lights, the samplers are set by setShadowSamplers and setUniformShadows
+static const char * const shadowGLSL = R"(
+		uniform samplerCubeShadow shadowMaps[4];	// of the first lights, distance over far is compared
+		uniform float shadowFar[4];
+		uniform int   nShadows;
+		uniform float shadowTexel;	// size of a map texel at unit distance
+
+		float shadow(samplerCubeShadow map, vec3 fromLight, float far, vec3 N) {	// 4 taps of 2x2 PCF, 1 is lit
+			vec3 dir = fromLight + N * (1.5 * shadowTexel * length(fromLight));	// normal offset against acne
+			float ref = min(length(dir) / far, 1.0);	// the cleared maps of directional lights are lit
+			vec3 t = normalize(cross(dir, abs(dir.y) < 0.9 * length(dir) ? vec3(0, 1, 0) : vec3(1, 0, 0)));
+			vec3 b = normalize(cross(dir, t));
+			float r = shadowTexel * length(dir);
+			return 0.25 * (texture(map, vec4(dir + (t + b) * r, ref)) + texture(map, vec4(dir + (t - b) * r, ref)) +
+			               texture(map, vec4(dir - (t + b) * r, ref)) + texture(map, vec4(dir - (t - b) * r, ref)));
+		}
+)";
+
 //---------------------------
 class Shader : public GPUProgram {
 //---------------------------
 public:
-    virtual void Bind(RenderState state) = 0;
+    virtual void Bind(const RenderState& state) = 0;
+    virtual const char * Name() = 0;    // names the batch of the shader in GPU timings
+    virtual SoftShading SoftwareShading() = 0;  // the equivalent of the program in the software rasterizer
+    virtual bool ReducedRateLighting() { return false; } // drawn in the lighting pass before the resolve pass
+    virtual bool Deferred() { return false; }   // drawn into the G-buffer, the lights are accumulated over the screen
+    // The program drawing the batch of the shader from indirect draws with the per-draw data in a storage buffer
+    virtual Shader * IndirectProgram(const RenderState&) { return nullptr; }
+
+    // Uniform names are composed in stack buffers, the render loop must not allocate
+    static const char * member(char * buffer, size_t size, const char * name, const char * field) {
+        snprintf(buffer, size, "%s.%s", name, field);
+        return buffer;
+    }
+
+    // The shared GLSL is inserted after the #version and #extension lines of the source
+    static std::string withGLSL(const char * source, const std::string& shared) {
+        std::string text(source);
+        size_t at = 0;
+        for (size_t line = text.find_first_not_of(" \t\r\n"); line != std::string::npos && text[line] == '#';
+             line = text.find_first_not_of(" \t\r\n", at)) {
+            size_t end = text.find('\n', line);
+            at = end == std::string::npos ? text.size() : end + 1;
+        }
+        return text.insert(at, shared);
+    }
+
+    static const char * lightName(int i) {
+        static char names[maxShaderLights][16];
+        if (!names[i][0]) snprintf(names[i], sizeof(names[i]), "lights[%d]", i);
+        return names[i];
+    }
+
+    void setUniformMaterial(const Material& material, const char * name) {
+        char buffer[64];
+        setUniform(material.kd, member(buffer, sizeof(buffer), name, "kd"));
+        setUniform(material.ks, member(buffer, sizeof(buffer), name, "ks"));
+        setUniform(material.ka, member(buffer, sizeof(buffer), name, "ka"));
+        setUniform(material.shininess, member(buffer, sizeof(buffer), name, "shininess"));
+    }
+
+    void setUniformLight(const Light& light, const char * name) {
+        char buffer[64];
+        setUniform(light.La, member(buffer, sizeof(buffer), name, "La"));
+        setUniform(light.Le, member(buffer, sizeof(buffer), name, "Le"));
+        setUniform(light.wLightPos, member(buffer, sizeof(buffer), name, "wLightPos"));
+        setUniform(light.range, member(buffer, sizeof(buffer), name, "range"));
+    }
+
+    // Samplers of the shadow maps are on fixed units, set once after the program is created. The units stay
+    // unbound without shadows, so they never share a unit with a sampler of another type.
+    static const int shadowUnit = 4;
 
-    void setUniformMaterial(const Material& material, const std::string& name) {
-        setUniform(material.kd, name + ".kd");
-        setUniform(material.ks, name + ".ks");
-        setUniform(material.ka, name + ".ka");
-        setUniform(material.shininess, name + ".shininess");
+    void setShadowSamplers() {
+        static const char * names[ShadowMaps::maxLights] = { "shadowMaps[0]", "shadowMaps[1]", "shadowMaps[2]", "shadowMaps[3]" };
+        Use();
+        for (int i = 0; i < ShadowMaps::maxLights; i++) setUniform(shadowUnit + i, names[i]);
     }
 
-    void setUniformLight(const Light& light, const std::string& name) {
-        setUniform(light.La, name + ".La");
-        setUniform(light.Le, name + ".Le");
-        setUniform(light.wLightPos, name + ".wLightPos");
+    // Units of the missing maps get the first one, every sampler of the program must see a cube map
+    void setUniformShadows(const ShadowMaps& shadows) {
+        static const char * farNames[ShadowMaps::maxLights] = { "shadowFar[0]", "shadowFar[1]", "shadowFar[2]", "shadowFar[3]" };
+        for (int i = 0; i < ShadowMaps::maxLights; i++) {
+            int map = i < shadows.count ? i : 0;
+            glActiveTexture(GL_TEXTURE0 + shadowUnit + i);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, shadows.maps[map]);
+            glStats.BindTexture();
+            setUniform(shadows.far[map], farNames[i]);
+        }
+        setUniform(shadows.count, "nShadows");
+        setUniform(2.0f / shadows.size, "shadowTexel");
     }
 };
 
@@ -172,6 +320,7 @@ class GouraudShader : public Shader {
 		struct Light {
 			vec3 La, Le;
 			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
 		};
 
 		struct Material {
@@ -185,6 +334,7 @@ class GouraudShader : public Shader {
 		uniform vec3  wEye;          // pos of eye
 		uniform Material  material;  // diffuse, specular, ambient ref
 
+		invariant gl_Position;      // the same depth as in the depth pre-pass
 		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
 		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
 
@@ -200,10 +350,11 @@ class GouraudShader : public Shader {
 
 			radiance = vec3(0, 0, 0);
 			for(int i = 0; i < nLights; i++) {
-				vec3 L = normalize(lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w);
+				vec3 toLight = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
+				vec3 L = normalize(toLight);
 				vec3 H = normalize(L + V);
 				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
-				radiance += material.ka * lights[i].La + (material.kd * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le;
+				radiance += material.ka * lights[i].La + (material.kd * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le * attenuation(lights[i].range, length(toLight));
 			}
 		}
 	)";
@@ -221,9 +372,14 @@ class GouraudShader : public Shader {
 		}
 	)";
 public:
-    GouraudShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+    GouraudShader() { create(withGLSL(vertexSource, attenuationGLSL).c_str(), fragmentSource, "fragmentColor"); }
+
+    const char * Name() { return "Gouraud"; }
+    SoftShading SoftwareShading() { return SOFT_GOURAUD; }
+    bool Deferred() { return options.deferred; }    // lit per pixel then
 
-    void Bind(RenderState state) {
+    void Bind(const RenderState& state) {
+        PROFILE_ZONE("GouraudShader::Bind");
         Use(); 		// make this program run
         setUniform(state.MVP, "MVP");
         setUniform(state.M, "M");
@@ -231,15 +387,16 @@ public:
         setUniform(state.wEye, "wEye");
         setUniformMaterial(*state.material, "material");
 
-        setUniform((int)state.lights.size(), "nLights");
-        for (unsigned int i = 0; i < state.lights.size(); i++) {
-            setUniformLight(state.lights[i], std::string("lights[") + std::to_string(i) + std::string("]"));
+        int nLights = state.lights->size() < maxShaderLights ? (int)state.lights->size() : maxShaderLights;
+        setUniform(nLights, "nLights");
+        for (int i = 0; i < nLights; i++) {
+            setUniformLight((*state.lights)[i], lightName(i));
         }
     }
 };
 
 //---------------------------
-class PhongShader : public Shader {
+class PhongLightingShader : public Shader { // lights of the Phong model at the reduced shading rate
 //---------------------------
     const char * vertexSource = R"(
 		#version 330
@@ -248,6 +405,7 @@ class PhongShader : public Shader {
 		struct Light {
 			vec3 La, Le;
 			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
 		};
 
 		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
@@ -257,27 +415,23 @@ class PhongShader : public Shader {
 
 		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
 		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
-		layout(location = 2) in vec2  vtxUV;
 
 		out vec3 wNormal;		    // normal in world space
 		out vec3 wView;             // view in world space
 		out vec3 wLight[8];		    // light dir in world space
-		out vec2 texcoord;
 
 		void main() {
 			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
-			// vectors for radiance computation
 			vec4 wPos = vec4(vtxPos, 1) * M;
 			for(int i = 0; i < nLights; i++) {
 				wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
 			}
 		    wView  = wEye * wPos.w - wPos.xyz;
 		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
-		    texcoord = vtxUV;
 		}
 	)";
 
-    // fragment shader in GLSL
+    // The texture and kd only modulate the diffuse sum, the resolve pass applies them at full resolution
     const char * fragmentSource = R"(
 		#version 330
 		precision highp float;
@@ -285,24 +439,245 @@ class PhongShader : public Shader {
 		struct Light {
 			vec3 La, Le;
 			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
 		};
 
+		uniform Light[8] lights;    // light sources
+		uniform int   nLights;
+		uniform vec3  ks;
+		uniform float shininess;
+
+		in  vec3 wNormal;       // interpolated world sp normal
+		in  vec3 wView;         // interpolated world sp view
+		in  vec3 wLight[8];     // interpolated world sp illum dir
+
+		layout(location = 0) out vec4 diffuseLight;   // sum of Le * cos
+		layout(location = 1) out vec4 specularLight;  // sum of ks * Le * cos^shininess
+		layout(location = 2) out vec2 surface;        // eye distance, cosine of the normal and the view
+
+		void main() {
+			vec3 N = normalize(wNormal);
+			vec3 V = normalize(wView);
+			if (dot(N, V) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
+
+			vec3 diffuse = vec3(0, 0, 0), specular = vec3(0, 0, 0);
+			for(int i = 0; i < nLights; i++) {
+				vec3 L = normalize(wLight[i]);
+				vec3 H = normalize(L + V);
+				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
+				vec3 Le = lights[i].Le * attenuation(lights[i].range, length(wLight[i]));
+				diffuse += cost * Le;
+				specular += pow(cosd, shininess) * Le;
+			}
+			diffuseLight = vec4(diffuse, 1);
+			specularLight = vec4(ks * specular, 1);
+			surface = vec2(length(wView), dot(N, V));
+		}
+	)";
+public:
+    PhongLightingShader() { create(vertexSource, withGLSL(fragmentSource, attenuationGLSL).c_str(), "diffuseLight"); }
+
+    const char * Name() { return "Phong lighting"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+
+    void Bind(const RenderState& state) {
+        PROFILE_ZONE("PhongLightingShader::Bind");
+        Use(); 		// make this program run
+        setUniform(state.MVP, "MVP");
+        setUniform(state.M, "M");
+        setUniform(state.Minv, "Minv");
+        setUniform(state.wEye, "wEye");
+        setUniform(state.material->ks, "ks");
+        setUniform(state.material->shininess, "shininess");
+
+        // the ambient term needs no lighting buffer, La is summed by the resolve pass
+        char buffer[32];
+        int nLights = state.lights->size() < maxShaderLights ? (int)state.lights->size() : maxShaderLights;
+        setUniform(nLights, "nLights");
+        for (int i = 0; i < nLights; i++) {
+            snprintf(buffer, sizeof(buffer), "lights[%d].Le", i);
+            setUniform((*state.lights)[i].Le, buffer);
+            snprintf(buffer, sizeof(buffer), "lights[%d].wLightPos", i);
+            setUniform((*state.lights)[i].wLightPos, buffer);
+            snprintf(buffer, sizeof(buffer), "lights[%d].range", i);
+            setUniform((*state.lights)[i].range, buffer);
+        }
+    }
+};
+
+//---------------------------
+class PhongResolveShader : public Shader { // full resolution Phong of the bilaterally upsampled lighting buffer
+//---------------------------
+    const char * vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
+		uniform vec3  wEye;         // pos of eye
+
+		invariant gl_Position;      // the same depth as in the depth pre-pass
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
+		layout(location = 2) in vec2  vtxUV;
+
+		out vec3 wNormal;		    // normal in world space
+		out vec3 wView;             // view in world space
+		out vec2 texcoord;
+
+		void main() {
+			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+			vec4 wPos = vec4(vtxPos, 1) * M;
+		    wView  = wEye * wPos.w - wPos.xyz;
+		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+		    texcoord = vtxUV;
+		}
+	)";
+
+    // Depth and normal aware upsampling: where the four texels around the pixel belong to its surface, the lights
+    // are filtered bilinearly, across silhouettes and creases the texel of the closest distance and normal cosine
+    // is taken. Either way it is a single filtered fetch, the choice is made in straight-line code.
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform vec3  kd, ka;
+		uniform vec3  La;           // sum of the ambient light of the sources
+		uniform sampler2D diffuseTexture;
+		uniform sampler2D diffuseLight, specularLight, surface;	// the lighting buffer
+		uniform vec2  lightingScale;	// size of the lighting buffer over the size of the frame
+
+		in  vec3 wNormal;       // interpolated world sp normal
+		in  vec3 wView;         // interpolated world sp view
+		in  vec2 texcoord;
+
+        out vec4 fragmentColor; // output goes to frame buffer
+
+		void main() {
+			vec3 N = normalize(wNormal);
+			vec3 V = normalize(wView);
+			if (dot(N, V) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
+			vec2 pixelSurface = vec2(length(wView), dot(N, V));
+			vec3 texColor = texture(diffuseTexture, texcoord).rgb;
+
+			vec2 size = vec2(textureSize(surface, 0));
+			vec2 q = gl_FragCoord.xy * lightingScale - 0.5;	// in the texel centers of the lighting buffer
+			ivec2 base = clamp(ivec2(floor(q)), ivec2(0, 0), ivec2(size) - 2);
+			// relative distance and cosine differences, cleared texels have zero distance
+			vec2 s00 = texelFetch(surface, base, 0).xy, s10 = texelFetch(surface, base + ivec2(1, 0), 0).xy;
+			vec2 s01 = texelFetch(surface, base + ivec2(0, 1), 0).xy, s11 = texelFetch(surface, base + ivec2(1, 1), 0).xy;
+			vec4 error = abs(vec4(s00.x, s10.x, s01.x, s11.x) - pixelSurface.x) / pixelSurface.x +
+			             abs(vec4(s00.y, s10.y, s01.y, s11.y) - pixelSurface.y);
+			vec2 nearest = vec2(0, 0);
+			float nearestError = error.x;
+			if (error.y < nearestError) { nearestError = error.y; nearest = vec2(1, 0); }
+			if (error.z < nearestError) { nearestError = error.z; nearest = vec2(0, 1); }
+			if (error.w < nearestError) { nearestError = error.w; nearest = vec2(1, 1); }
+			bool agrees = max(max(error.x, error.y), max(error.z, error.w)) < 0.05;
+			vec2 uv = (agrees ? q + 0.5 : vec2(base) + nearest + 0.5) / size;
+			vec3 diffuse = texture(diffuseLight, uv).rgb;
+			vec3 specular = texture(specularLight, uv).rgb;
+
+			// kd and ka are modulated by the texture, like in the Phong shader
+			fragmentColor = vec4(ka * texColor * La + kd * texColor * texColor * diffuse + specular, 1);
+		}
+	)";
+public:
+    PhongResolveShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+
+    const char * Name() { return "Phong resolve"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+
+    void Bind(const RenderState& state) {
+        PROFILE_ZONE("PhongResolveShader::Bind");
+        Use(); 		// make this program run
+        setUniform(state.MVP, "MVP");
+        setUniform(state.M, "M");
+        setUniform(state.Minv, "Minv");
+        setUniform(state.wEye, "wEye");
+        setUniform(*state.texture, "diffuseTexture");
+        setUniform(state.lighting->colors[0], "diffuseLight", 1);
+        setUniform(state.lighting->colors[1], "specularLight", 2);
+        setUniform(state.lighting->colors[2], "surface", 3);
+        setUniform(vec2((float)state.lighting->Width() / windowWidth, (float)state.lighting->Height() / windowHeight), "lightingScale");
+        setUniform(state.material->kd, "kd");
+        setUniform(state.material->ka, "ka");
+
+        vec3 La;
+        for (size_t i = 0; i < state.lights->size() && i < maxShaderLights; i++) La = La + (*state.lights)[i].La;
+        setUniform(La, "La");
+    }
+};
+
+//---------------------------
+class PhongClusteredShader : public Shader { // Phong of the lights of the cluster of the fragment, without a light limit
+//---------------------------
+    const char * vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
+		uniform vec3  wEye;         // pos of eye
+
+		invariant gl_Position;      // the same depth as in the depth pre-pass
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
+		layout(location = 2) in vec2  vtxUV;
+
+		out vec3 wPos;              // pos in world space
+		out vec3 wNormal;		    // normal in world space
+		out vec3 wView;             // view in world space
+		out vec2 texcoord;
+
+		void main() {
+			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+			vec4 wPos4 = vec4(vtxPos, 1) * M;
+			wPos = wPos4.xyz / wPos4.w;
+		    wView  = wEye - wPos;
+		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+		    texcoord = vtxUV;
+		}
+	)";
+
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
 		struct Material {
 			vec3 kd, ks, ka;
 			float shininess;
 		};
 
 		uniform Material material;
-		uniform Light[8] lights;    // light sources
-		uniform int   nLights;
 		uniform sampler2D diffuseTexture;
+		uniform vec3  La;               // sum of the ambient light of the sources
+
+		uniform samplerBuffer  lightData;       // two texels per light: wLightPos; Le and range
+		uniform usamplerBuffer clusters;        // offset and count of the light indices of each cluster
+		uniform usamplerBuffer lightIndices;    // the unbounded lights first, then the lists of the clusters
+		uniform int   nGlobalLights;
+		uniform vec2  tileScale;                // tiles per pixel
+		uniform int   tilesX, tilesY, slices;
+		uniform float fp, bp, sliceScale;       // slice of view depth z is log(z / fp) * sliceScale
 
+		in  vec3 wPos;          // interpolated world sp position
 		in  vec3 wNormal;       // interpolated world sp normal
 		in  vec3 wView;         // interpolated world sp view
-		in  vec3 wLight[8];     // interpolated world sp illum dir
 		in  vec2 texcoord;
 
-        out vec4 fragmentColor; // output goes to frame buffer
+		out vec4 fragmentColor; // output goes to frame buffer
+
+		float visibility[4];	// of the shadowed lights, the first ones
+
+		vec3 shade(int light, vec3 N, vec3 V, vec3 kd) {
+			vec4 wLightPos = texelFetch(lightData, 2 * light);
+			vec4 LeRange = texelFetch(lightData, 2 * light + 1);
+			vec3 toLight = wLightPos.xyz - wPos * wLightPos.w;
+			vec3 L = normalize(toLight);
+			vec3 H = normalize(L + V);
+			float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
+			return (kd * cost + material.ks * pow(cosd, material.shininess)) * LeRange.rgb * attenuation(LeRange.a, length(toLight)) *
+			       (light < 4 ? visibility[light] : 1.0);
+		}
 
 		void main() {
 			vec3 N = normalize(wNormal);
@@ -310,97 +685,1187 @@ class PhongShader : public Shader {
 			if (dot(N, V) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
 			vec3 texColor = texture(diffuseTexture, texcoord).rgb;
 			vec3 ka = material.ka * texColor;
-			vec3 kd = material.kd * texColor;
-
-			vec3 radiance = vec3(0, 0, 0);
-			for(int i = 0; i < nLights; i++) {
-				vec3 L = normalize(wLight[i]);
-				vec3 H = normalize(L + V);
-				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
-				// kd and ka are modulated by the texture
-				radiance += ka * lights[i].La +
-                           (kd * texColor * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le;
-			}
+			vec3 kd = material.kd * texColor * texColor;	// kd is modulated by the texture twice, like in the Phong shader
+
+			float z = 2 * fp * bp / (bp + fp - (2 * gl_FragCoord.z - 1) * (bp - fp));	// view depth
+			ivec2 tile = min(ivec2(gl_FragCoord.xy * tileScale), ivec2(tilesX - 1, tilesY - 1));
+			int slice = clamp(int(log(z / fp) * sliceScale), 0, slices - 1);
+			uvec2 cluster = texelFetch(clusters, (slice * tilesY + tile.y) * tilesX + tile.x).rg;
+
+			for (int i = 0; i < 4; i++) visibility[i] = 1.0;
+			if (nShadows > 0) visibility[0] = shadow(shadowMaps[0], wPos - texelFetch(lightData, 0).xyz, shadowFar[0], N);
+			if (nShadows > 1) visibility[1] = shadow(shadowMaps[1], wPos - texelFetch(lightData, 2).xyz, shadowFar[1], N);
+			if (nShadows > 2) visibility[2] = shadow(shadowMaps[2], wPos - texelFetch(lightData, 4).xyz, shadowFar[2], N);
+			if (nShadows > 3) visibility[3] = shadow(shadowMaps[3], wPos - texelFetch(lightData, 6).xyz, shadowFar[3], N);
+
+			vec3 radiance = ka * La;
+			for (int i = 0; i < nGlobalLights; i++) radiance += shade(int(texelFetch(lightIndices, i).r), N, V, kd);
+			for (int i = 0; i < int(cluster.y); i++) radiance += shade(int(texelFetch(lightIndices, int(cluster.x) + i).r), N, V, kd);
 			fragmentColor = vec4(radiance, 1);
 		}
 	)";
 public:
-    PhongShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+    PhongClusteredShader() {
+        create(vertexSource, withGLSL(fragmentSource, std::string(attenuationGLSL) + shadowGLSL).c_str(), "fragmentColor");
+        setShadowSamplers();
+    }
 
-    void Bind(RenderState state) {
+    const char * Name() { return "Phong clustered"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+
+    void Bind(const RenderState& state) {
+        PROFILE_ZONE("PhongClusteredShader::Bind");
         Use(); 		// make this program run
         setUniform(state.MVP, "MVP");
         setUniform(state.M, "M");
         setUniform(state.Minv, "Minv");
         setUniform(state.wEye, "wEye");
-        setUniform(*state.texture, std::string("diffuseTexture"));
+        setUniform(*state.texture, "diffuseTexture");
         setUniformMaterial(*state.material, "material");
+        state.lightGrid->Bind(*this, 1);
+        if (state.shadows) setUniformShadows(*state.shadows);
 
-        setUniform((int)state.lights.size(), "nLights");
-        for (unsigned int i = 0; i < state.lights.size(); i++) {
-            setUniformLight(state.lights[i], std::string("lights[") + std::to_string(i) + std::string("]"));
-        }
+        vec3 La;
+        for (const Light& light : *state.lights) La = La + light.La;
+        setUniform(La, "La");
     }
 };
 
 //---------------------------
-class NPRShader : public Shader {
+class PhongStreamedShader : public Shader { // Phong reading the object and frame data from uniform blocks of the stream buffer
 //---------------------------
     const char * vertexSource = R"(
 		#version 330
 		precision highp float;
 
-		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
-		uniform	vec4  wLightPos;
-		uniform vec3  wEye;         // pos of eye
+		struct Light {
+			vec4 La, Le;	// xyz
+			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
+		};
+
+		layout(std140, row_major) uniform ObjectData {
+			mat4 MVP, M, Minv;          // MVP, Model, Model-inverse
+			vec4 kd, ks, ka;            // xyz, the shininess is ks.w
+		};
+
+		layout(std140) uniform FrameData {
+			Light lights[8];            // light sources
+			int   nLights;
+			vec3  wEye;                 // pos of eye
+		};
 
+		invariant gl_Position;      // the same depth as in the depth pre-pass
 		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
 		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
 		layout(location = 2) in vec2  vtxUV;
 
-		out vec3 wNormal, wView, wLight;				// in world space
+		out vec3 wNormal;		    // normal in world space
+		out vec3 wView;             // view in world space
+		out vec3 wLight[8];		    // light dir in world space
 		out vec2 texcoord;
 
 		void main() {
-		   gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
-		   vec4 wPos = vec4(vtxPos, 1) * M;
-		   wLight = wLightPos.xyz * wPos.w - wPos.xyz * wLightPos.w;
-		   wView  = wEye * wPos.w - wPos.xyz;
-		   wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
-		   texcoord = vtxUV;
+			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+			// vectors for radiance computation
+			vec4 wPos = vec4(vtxPos, 1) * M;
+			for(int i = 0; i < nLights; i++) {
+				wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
+			}
+		    wView  = wEye * wPos.w - wPos.xyz;
+		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+		    texcoord = vtxUV;
+		}
+	)";
+
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		struct Light {
+			vec4 La, Le;	// xyz
+			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
+		};
+
+		layout(std140, row_major) uniform ObjectData {
+			mat4 MVP, M, Minv;          // MVP, Model, Model-inverse
+			vec4 kd, ks, ka;            // xyz, the shininess is ks.w
+		};
+
+		layout(std140) uniform FrameData {
+			Light lights[8];            // light sources
+			int   nLights;
+			vec3  wEye;                 // pos of eye
+		};
+
+		uniform sampler2D diffuseTexture;
+
+		in  vec3 wNormal;       // interpolated world sp normal
+		in  vec3 wView;         // interpolated world sp view
+		in  vec3 wLight[8];     // interpolated world sp illum dir
+		in  vec2 texcoord;
+
+        out vec4 fragmentColor; // output goes to frame buffer
+
+		void main() {
+			vec3 N = normalize(wNormal);
+			vec3 V = normalize(wView);
+			if (dot(N, V) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
+			vec3 texColor = texture(diffuseTexture, texcoord).rgb;
+			vec3 ambient = ka.xyz * texColor;
+			vec3 diffuse = kd.xyz * texColor;
+
+			float visibility[4] = float[4](1.0, 1.0, 1.0, 1.0);	// of the shadowed lights
+			if (nShadows > 0) visibility[0] = shadow(shadowMaps[0], -wLight[0], shadowFar[0], N);
+			if (nShadows > 1) visibility[1] = shadow(shadowMaps[1], -wLight[1], shadowFar[1], N);
+			if (nShadows > 2) visibility[2] = shadow(shadowMaps[2], -wLight[2], shadowFar[2], N);
+			if (nShadows > 3) visibility[3] = shadow(shadowMaps[3], -wLight[3], shadowFar[3], N);
+
+			vec3 radiance = vec3(0, 0, 0);
+			for(int i = 0; i < nLights; i++) {
+				vec3 L = normalize(wLight[i]);
+				vec3 H = normalize(L + V);
+				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
+				// kd and ka are modulated by the texture
+				radiance += ambient * lights[i].La.xyz +
+                           (diffuse * texColor * cost + ks.xyz * pow(cosd, ks.w)) * lights[i].Le.xyz * attenuation(lights[i].range, length(wLight[i])) *
+                           (i < 4 ? visibility[i] : 1.0);
+			}
+			fragmentColor = vec4(radiance, 1);
+		}
+	)";
+public:
+    enum { OBJECT_BINDING, FRAME_BINDING };
+
+    struct ObjectBlock {    // std140 layout of ObjectData
+        mat4 MVP, M, Minv;
+        vec4 kd, ks, ka;
+    };
+
+    struct FrameBlock {     // std140 layout of FrameData
+        struct {
+            vec4 La, Le, wLightPos;
+            float range, padding[3];
+        } lights[maxShaderLights];
+        int nLights, padding[3];
+        vec3 wEye;
+        float padding2;
+    };
+
+    PhongStreamedShader() {
+        create(vertexSource, withGLSL(fragmentSource, std::string(attenuationGLSL) + shadowGLSL).c_str(), "fragmentColor");
+        glUniformBlockBinding(getId(), glGetUniformBlockIndex(getId(), "ObjectData"), OBJECT_BINDING);
+        glUniformBlockBinding(getId(), glGetUniformBlockIndex(getId(), "FrameData"), FRAME_BINDING);
+        setShadowSamplers();
+    }
+
+    const char * Name() { return "Phong"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+
+    // The lights and the eye of the frame go into the stream buffer once, bound for every program of the blocks
+    static void WriteFrame(StreamBuffer& stream, const std::vector<Light>& lights, vec3 wEye) {
+        FrameBlock block = {};
+        block.nLights = lights.size() < maxShaderLights ? (int)lights.size() : maxShaderLights;
+        for (int i = 0; i < block.nLights; i++) {
+            const Light& light = lights[i];
+            block.lights[i].La = vec4(light.La.x, light.La.y, light.La.z, 0);
+            block.lights[i].Le = vec4(light.Le.x, light.Le.y, light.Le.z, 0);
+            block.lights[i].wLightPos = light.wLightPos;
+            block.lights[i].range = light.range;
+        }
+        block.wEye = wEye;
+        stream.BindUniforms(FRAME_BINDING, stream.Write(&block, sizeof(block)), sizeof(block));
+    }
+
+    static ObjectBlock Block(const RenderState& state) {
+        const Material& material = *state.material;
+        return ObjectBlock{ state.MVP, state.M, state.Minv, vec4(material.kd.x, material.kd.y, material.kd.z, 0),
+                            vec4(material.ks.x, material.ks.y, material.ks.z, material.shininess),
+                            vec4(material.ka.x, material.ka.y, material.ka.z, 0) };
+    }
+
+    // A draw costs a copy of its block into the stream buffer and a binding of its range. False when the
+    // stream buffer is full, the draw then has to take the uniforms of the Phong program.
+    bool BindStreamed(const RenderState& state) {
+        PROFILE_ZONE("PhongStreamedShader::Bind");
+        ObjectBlock block = Block(state);
+        long offset = state.objectData->Write(&block, sizeof(block));
+        if (offset < 0) return false;
+        Use(); 		// make this program run
+        state.objectData->BindUniforms(OBJECT_BINDING, offset, sizeof(block));
+        setUniform(*state.texture, "diffuseTexture");
+        if (state.shadows) setUniformShadows(*state.shadows);
+        return true;
+    }
+
+    void Bind(const RenderState& state) { BindStreamed(state); }
+};
+
+//---------------------------
+class PhongIndirectShader : public Shader { // Phong of the multi-draw indirect batches, the per-draw data is in a storage buffer
+//---------------------------
+    const char * vertexSource = R"(
+		#version 330
+		#extension GL_ARB_shader_storage_buffer_object : require
+		precision highp float;
+
+		struct Light {
+			vec3 La, Le;
+			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
+		};
+
+		struct DrawData {
+			mat4 MVP, M, Minv;          // MVP, Model, Model-inverse
+			vec4 kd, ks, ka;            // xyz, the shininess is ks.w
+		};
+
+		layout(std430, row_major) readonly buffer Draws { DrawData draws[]; };
+
+		uniform Light[8] lights;    // light sources
+		uniform int   nLights;
+		uniform vec3  wEye;         // pos of eye
+
+		invariant gl_Position;      // the same depth as in the depth pre-pass
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
+		layout(location = 2) in vec2  vtxUV;
+		layout(location = 3) in uint  drawIndex;         // per instance, the base instance of the draw selects it
+
+		out vec3 wNormal;		    // normal in world space
+		out vec3 wView;             // view in world space
+		out vec3 wLight[8];		    // light dir in world space
+		out vec2 texcoord;
+		flat out uint draw;
+
+		void main() {
+			gl_Position = vec4(vtxPos, 1) * draws[drawIndex].MVP; // to NDC
+			// vectors for radiance computation
+			vec4 wPos = vec4(vtxPos, 1) * draws[drawIndex].M;
+			for(int i = 0; i < nLights; i++) {
+				wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
+			}
+		    wView  = wEye * wPos.w - wPos.xyz;
+		    wNormal = (draws[drawIndex].Minv * vec4(vtxNorm, 0)).xyz;
+		    texcoord = vtxUV;
+		    draw = drawIndex;
+		}
+	)";
+
+    const char * fragmentSource = R"(
+		#version 330
+		#extension GL_ARB_shader_storage_buffer_object : require
+		precision highp float;
+
+		struct Light {
+			vec3 La, Le;
+			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
+		};
+
+		struct DrawData {
+			mat4 MVP, M, Minv;          // MVP, Model, Model-inverse
+			vec4 kd, ks, ka;            // xyz, the shininess is ks.w
+		};
+
+		layout(std430, row_major) readonly buffer Draws { DrawData draws[]; };
+
+		uniform Light[8] lights;    // light sources
+		uniform int   nLights;
+		uniform sampler2D diffuseTexture;
+
+		in  vec3 wNormal;       // interpolated world sp normal
+		in  vec3 wView;         // interpolated world sp view
+		in  vec3 wLight[8];     // interpolated world sp illum dir
+		in  vec2 texcoord;
+		flat in uint draw;
+
+        out vec4 fragmentColor; // output goes to frame buffer
+
+		void main() {
+			vec3 N = normalize(wNormal);
+			vec3 V = normalize(wView);
+			if (dot(N, V) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
+			vec3 texColor = texture(diffuseTexture, texcoord).rgb;
+			vec3 ka = draws[draw].ka.xyz * texColor;
+			vec3 kd = draws[draw].kd.xyz * texColor;
+			vec4 ks = draws[draw].ks;
+
+			float visibility[4] = float[4](1.0, 1.0, 1.0, 1.0);	// of the shadowed lights
+			if (nShadows > 0) visibility[0] = shadow(shadowMaps[0], -wLight[0], shadowFar[0], N);
+			if (nShadows > 1) visibility[1] = shadow(shadowMaps[1], -wLight[1], shadowFar[1], N);
+			if (nShadows > 2) visibility[2] = shadow(shadowMaps[2], -wLight[2], shadowFar[2], N);
+			if (nShadows > 3) visibility[3] = shadow(shadowMaps[3], -wLight[3], shadowFar[3], N);
+
+			vec3 radiance = vec3(0, 0, 0);
+			for(int i = 0; i < nLights; i++) {
+				vec3 L = normalize(wLight[i]);
+				vec3 H = normalize(L + V);
+				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
+				// kd and ka are modulated by the texture
+				radiance += ka * lights[i].La +
+                           (kd * texColor * cost + ks.xyz * pow(cosd, ks.w)) * lights[i].Le * attenuation(lights[i].range, length(wLight[i])) *
+                           (i < 4 ? visibility[i] : 1.0);
+			}
+			fragmentColor = vec4(radiance, 1);
+		}
+	)";
+public:
+    typedef PhongStreamedShader::ObjectBlock DrawData;  // std430 lays it out like the std140 block
+
+    PhongIndirectShader() {
+        create(vertexSource, withGLSL(fragmentSource, std::string(attenuationGLSL) + shadowGLSL).c_str(), "fragmentColor");
+        // the binding of the block is set here, the layout qualifier needs GLSL 4.20
+        glShaderStorageBlockBinding(getId(), glGetProgramResourceIndex(getId(), GL_SHADER_STORAGE_BLOCK, "Draws"),
+                                    IndirectDraws::dataBinding);
+        setShadowSamplers();
+    }
+
+    const char * Name() { return "Phong"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+
+    // Per batch of the same texture, the objects of the batch are in the storage buffer
+    void Bind(const RenderState& state) {
+        PROFILE_ZONE("PhongIndirectShader::Bind");
+        Use(); 		// make this program run
+        setUniform(state.wEye, "wEye");
+        setUniform(*state.texture, "diffuseTexture");
+        if (state.shadows) setUniformShadows(*state.shadows);
+
+        int nLights = state.lights->size() < maxShaderLights ? (int)state.lights->size() : maxShaderLights;
+        setUniform(nLights, "nLights");
+        for (int i = 0; i < nLights; i++) {
+            setUniformLight((*state.lights)[i], lightName(i));
+        }
+    }
+};
+
+//---------------------------
+class PhongShader : public Shader {
+//---------------------------
+    PhongLightingShader * lightingShader = nullptr;    // programs of the reduced shading rate
+    PhongResolveShader * resolveShader = nullptr;
+    PhongClusteredShader * clusteredShader = nullptr;
+    PhongStreamedShader * streamedShader = nullptr;     // of the stream buffer
+    PhongIndirectShader * indirectShader = nullptr;     // of the multi-draw indirect batches
+
+    const char * vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		struct Light {
+			vec3 La, Le;
+			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
+		};
+
+		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
+		uniform Light[8] lights;    // light sources
+		uniform int   nLights;
+		uniform vec3  wEye;         // pos of eye
+
+		invariant gl_Position;      // the same depth as in the depth pre-pass
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
+		layout(location = 2) in vec2  vtxUV;
+
+		out vec3 wNormal;		    // normal in world space
+		out vec3 wView;             // view in world space
+		out vec3 wLight[8];		    // light dir in world space
+		out vec2 texcoord;
+
+		void main() {
+			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+			// vectors for radiance computation
+			vec4 wPos = vec4(vtxPos, 1) * M;
+			for(int i = 0; i < nLights; i++) {
+				wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
+			}
+		    wView  = wEye * wPos.w - wPos.xyz;
+		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+		    texcoord = vtxUV;
+		}
+	)";
+
+    // fragment shader in GLSL
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		struct Light {
+			vec3 La, Le;
+			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
+		};
+
+		struct Material {
+			vec3 kd, ks, ka;
+			float shininess;
+		};
+
+		uniform Material material;
+		uniform Light[8] lights;    // light sources
+		uniform int   nLights;
+		uniform sampler2D diffuseTexture;
+
+		in  vec3 wNormal;       // interpolated world sp normal
+		in  vec3 wView;         // interpolated world sp view
+		in  vec3 wLight[8];     // interpolated world sp illum dir
+		in  vec2 texcoord;
+
+        out vec4 fragmentColor; // output goes to frame buffer
+
+		void main() {
+			vec3 N = normalize(wNormal);
+			vec3 V = normalize(wView);
+			if (dot(N, V) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
+			vec3 texColor = texture(diffuseTexture, texcoord).rgb;
+			vec3 ka = material.ka * texColor;
+			vec3 kd = material.kd * texColor;
+
+			float visibility[4] = float[4](1.0, 1.0, 1.0, 1.0);	// of the shadowed lights
+			if (nShadows > 0) visibility[0] = shadow(shadowMaps[0], -wLight[0], shadowFar[0], N);
+			if (nShadows > 1) visibility[1] = shadow(shadowMaps[1], -wLight[1], shadowFar[1], N);
+			if (nShadows > 2) visibility[2] = shadow(shadowMaps[2], -wLight[2], shadowFar[2], N);
+			if (nShadows > 3) visibility[3] = shadow(shadowMaps[3], -wLight[3], shadowFar[3], N);
+
+			vec3 radiance = vec3(0, 0, 0);
+			for(int i = 0; i < nLights; i++) {
+				vec3 L = normalize(wLight[i]);
+				vec3 H = normalize(L + V);
+				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
+				// kd and ka are modulated by the texture
+				radiance += ka * lights[i].La +
+                           (kd * texColor * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le * attenuation(lights[i].range, length(wLight[i])) *
+                           (i < 4 ? visibility[i] : 1.0);
+			}
+			fragmentColor = vec4(radiance, 1);
+		}
+	)";
+public:
+    PhongShader() {
+        create(vertexSource, withGLSL(fragmentSource, std::string(attenuationGLSL) + shadowGLSL).c_str(), "fragmentColor");
+        if (hasGLContext()) setShadowSamplers();
+        if (options.shadingRate > 1 && !options.deferred && !options.clustered && hasGLContext()) {
+            lightingShader = new PhongLightingShader();
+            resolveShader = new PhongResolveShader();
+        }
+        if (options.clustered && !options.deferred && hasGLContext()) clusteredShader = new PhongClusteredShader();
+        if (options.streamBuffer && hasGLContext()) streamedShader = new PhongStreamedShader();
+        if (options.indirect && hasGLContext() && indirectDrawsSupported()) indirectShader = new PhongIndirectShader();
+    }
+
+    const char * Name() { return "Phong"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+    bool ReducedRateLighting() { return lightingShader != nullptr; }
+    bool Deferred() { return options.deferred; }
+    Shader * IndirectProgram(const RenderState& state) {
+        return state.pass == PASS_FORWARD && !state.lightGrid ? indirectShader : nullptr;
+    }
+
+    void Bind(const RenderState& state) {
+        if (state.pass == PASS_LIGHTING) return lightingShader->Bind(state);
+        if (state.pass == PASS_RESOLVE) return resolveShader->Bind(state);
+        if (state.lightGrid) return clusteredShader->Bind(state);
+        if (state.objectData && streamedShader->BindStreamed(state)) return;
+        PROFILE_ZONE("PhongShader::Bind");
+        Use(); 		// make this program run
+        setUniform(state.MVP, "MVP");
+        setUniform(state.M, "M");
+        setUniform(state.Minv, "Minv");
+        setUniform(state.wEye, "wEye");
+        setUniform(*state.texture, "diffuseTexture");
+        setUniformMaterial(*state.material, "material");
+        if (state.shadows) setUniformShadows(*state.shadows);
+
+        int nLights = state.lights->size() < maxShaderLights ? (int)state.lights->size() : maxShaderLights;
+        setUniform(nLights, "nLights");
+        for (int i = 0; i < nLights; i++) {
+            setUniformLight((*state.lights)[i], lightName(i));
+        }
+    }
+};
+
+//---------------------------
+class NPRShader : public Shader {
+//---------------------------
+    const char * vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
+		uniform	vec4  wLightPos;
+		uniform vec3  wEye;         // pos of eye
+
+		invariant gl_Position;      // the same depth as in the depth pre-pass
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
+		layout(location = 2) in vec2  vtxUV;
+
+		out vec3 wNormal, wView, wLight;				// in world space
+		out vec2 texcoord;
+
+		void main() {
+		   gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+		   vec4 wPos = vec4(vtxPos, 1) * M;
+		   wLight = wLightPos.xyz * wPos.w - wPos.xyz * wLightPos.w;
+		   wView  = wEye * wPos.w - wPos.xyz;
+		   wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+		   texcoord = vtxUV;
+		}
+	)";
+
+    // fragment shader in GLSL
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform sampler2D diffuseTexture;
+
+		in  vec3 wNormal, wView, wLight;	// interpolated
+		in  vec2 texcoord;
+		out vec4 fragmentColor;    			// output goes to frame buffer
+
+		void main() {
+		   vec3 N = normalize(wNormal), V = normalize(wView), L = normalize(wLight);
+		   if (dot(N, V) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
+		   float y = (dot(N, L) > 0.5) ? 1 : 0.5;
+		   if (abs(dot(N, V)) < 0.2) fragmentColor = vec4(0, 0, 0, 1);
+		   else						 fragmentColor = vec4(y * texture(diffuseTexture, texcoord).rgb, 1);
+		}
+	)";
+public:
+    NPRShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+
+    const char * Name() { return "NPR"; }
+    SoftShading SoftwareShading() { return SOFT_NPR; }
+
+    void Bind(const RenderState& state) {
+        PROFILE_ZONE("NPRShader::Bind");
+        Use(); 		// make this program run
+        setUniform(state.MVP, "MVP");
+        setUniform(state.M, "M");
+        setUniform(state.Minv, "Minv");
+        setUniform(state.wEye, "wEye");
+        setUniform(*state.texture, "diffuseTexture");
+        setUniform((*state.lights)[0].wLightPos, "wLightPos");
+    }
+};
+
+//---------------------------
+class DepthIndirectShader : public Shader { // depth pre-pass of the indirect draws, the MVP is in the storage buffer
+//---------------------------
+    const char * vertexSource = R"(
+		#version 330
+		#extension GL_ARB_shader_storage_buffer_object : require
+		precision highp float;
+
+		struct DrawData {
+			mat4 MVP, M, Minv;          // MVP, Model, Model-inverse
+			vec4 kd, ks, ka;
+		};
+
+		layout(std430, row_major) readonly buffer Draws { DrawData draws[]; };
+
+		invariant gl_Position;      // the shading programs compute the same depth, they test it with GL_EQUAL
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+		layout(location = 3) in uint  drawIndex;
+
+		void main() {
+			gl_Position = vec4(vtxPos, 1) * draws[drawIndex].MVP; // to NDC
+		}
+	)";
+
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		out vec4 fragmentColor;    // masked out
+
+		void main() { }
+	)";
+public:
+    DepthIndirectShader() {
+        create(vertexSource, fragmentSource, "fragmentColor");
+        glShaderStorageBlockBinding(getId(), glGetProgramResourceIndex(getId(), GL_SHADER_STORAGE_BLOCK, "Draws"),
+                                    IndirectDraws::dataBinding);
+    }
+
+    const char * Name() { return "depth"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+
+    void Bind(const RenderState&) { Use(); }
+};
+
+//---------------------------
+class DepthShader : public Shader { // depth pre-pass: positions only, no color is written
+//---------------------------
+    const char * vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform mat4  MVP;
+
+		invariant gl_Position;      // the shading programs compute the same depth, they test it with GL_EQUAL
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+
+		void main() {
+			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+		}
+	)";
+
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		out vec4 fragmentColor;    // masked out
+
+		void main() { }
+	)";
+    DepthIndirectShader * indirectShader = nullptr;     // of the GPU culled objects
+public:
+    DepthShader() {
+        create(vertexSource, fragmentSource, "fragmentColor");
+        if (options.gpuCull && hasGLContext() && gpuCullingSupported()) indirectShader = new DepthIndirectShader();
+    }
+
+    const char * Name() { return "depth"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+    Shader * IndirectProgram(const RenderState&) { return indirectShader; }
+
+    void Bind(const RenderState& state) {
+        Use(); 		// make this program run
+        setUniform(state.MVP, "MVP");
+    }
+};
+
+//---------------------------
+class ShadowShader : public Shader { // distance to the light over its far distance, into a face of a cube depth map
+//---------------------------
+    const char * vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform mat4  MVP, M;       // MVP of the cube face, Model
+
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+
+		out vec3 wPos;
+
+		void main() {
+			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+			vec4 wPos4 = vec4(vtxPos, 1) * M;
+			wPos = wPos4.xyz / wPos4.w;
+		}
+	)";
+
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform vec3  wLightPos;
+		uniform float far;
+
+		in  vec3 wPos;
+		out vec4 fragmentColor;    // there is no color attachment
+
+		void main() { gl_FragDepth = length(wPos - wLightPos) / far; }
+	)";
+public:
+    vec3 wLightPos;     // of the map being rendered
+    float far = 1;
+
+    ShadowShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+
+    const char * Name() { return "shadow"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+
+    void Bind(const RenderState& state) {
+        Use(); 		// make this program run
+        setUniform(state.MVP, "MVP");
+        setUniform(state.M, "M");
+        setUniform(wLightPos, "wLightPos");
+        setUniform(far, "far");
+    }
+};
+
+//---------------------------
+class GBufferShader : public Shader { // surface attributes of the Phong model for the deferred lights
+//---------------------------
+    const char * vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
+		uniform vec3  wEye;         // pos of eye
+
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
+		layout(location = 2) in vec2  vtxUV;
+
+		out vec3 wNormal;		    // normal in world space
+		out vec3 wView;             // view in world space
+		out vec2 texcoord;
+
+		void main() {
+			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+			vec4 wPos = vec4(vtxPos, 1) * M;
+		    wView  = wEye * wPos.w - wPos.xyz;
+		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+		    texcoord = vtxUV;
+		}
+	)";
+
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform vec3  kd, ks, ka;
+		uniform float shininess;
+		uniform sampler2D diffuseTexture;
+
+		in  vec3 wNormal;       // interpolated world sp normal
+		in  vec3 wView;         // interpolated world sp view
+		in  vec2 texcoord;
+
+		layout(location = 0) out vec4 albedo;     // kd modulated by the texture twice, like in the Phong shader
+		layout(location = 1) out vec4 ambient;    // ka modulated by the texture
+		layout(location = 2) out vec4 specular;   // ks and shininess
+		layout(location = 3) out vec4 normal;     // in world space, turned towards the eye
+
+		void main() {
+			vec3 N = normalize(wNormal);
+			if (dot(N, wView) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
+			vec3 texColor = texture(diffuseTexture, texcoord).rgb;
+			albedo = vec4(kd * texColor * texColor, 1);
+			ambient = vec4(ka * texColor, 1);
+			specular = vec4(ks, shininess);
+			normal = vec4(N, 0);
+		}
+	)";
+public:
+    GBufferShader() { create(vertexSource, fragmentSource, "albedo"); }
+
+    const char * Name() { return "G-buffer"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+
+    void Bind(const RenderState& state) {
+        PROFILE_ZONE("GBufferShader::Bind");
+        Use(); 		// make this program run
+        setUniform(state.MVP, "MVP");
+        setUniform(state.M, "M");
+        setUniform(state.Minv, "Minv");
+        setUniform(state.wEye, "wEye");
+        setUniform(*state.texture, "diffuseTexture");
+        setUniform(state.material->kd, "kd");
+        setUniform(state.material->ks, "ks");
+        setUniform(state.material->ka, "ka");
+        setUniform(state.material->shininess, "shininess");
+    }
+};
+
+//---------------------------
+class DeferredLighting { // lights of the G-buffer accumulated over the screen rectangles of their volumes
+//---------------------------
+    // The pixel positions are reconstructed from the depth along the camera ray of the pixel
+    const char * lightVertexSource = R"(
+		#version 330
+		precision highp float;
+
+		layout(location = 0) in vec2  vtxNdc;       // corner of the screen rectangle of the light
+		layout(location = 1) in vec4  vtxLightPos;
+		layout(location = 2) in vec3  vtxLe;
+		layout(location = 3) in float vtxRange;
+
+		out vec2 ndc;
+		flat out vec4 wLightPos;
+		flat out vec3 Le;
+		flat out float range;
+
+		void main() {
+			gl_Position = vec4(vtxNdc, 0, 1);
+			ndc = vtxNdc;
+			wLightPos = vtxLightPos;
+			Le = vtxLe;
+			range = vtxRange;
+		}
+	)";
+
+    const char * lightFragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform sampler2D albedoMap, specularMap, normalMap, depthMap;	// the G-buffer
+		uniform vec3  wEye, forward, right, up;	// camera ray of ndc is forward + right * ndc.x + up * ndc.y
+		uniform float fp, bp;
+
+		in vec2 ndc;
+		flat in vec4 wLightPos;
+		flat in vec3 Le;
+		flat in float range;
+
+		out vec4 radiance;
+
+		void main() {
+			ivec2 pixel = ivec2(gl_FragCoord.xy);
+			float depth = texelFetch(depthMap, pixel, 0).r;
+			if (depth >= 1) discard;	// background
+			float z = 2 * fp * bp / (bp + fp - (2 * depth - 1) * (bp - fp));	// view depth
+			vec3 wPos = wEye + (forward + right * ndc.x + up * ndc.y) * z;
+
+			vec3 toLight = wLightPos.xyz - wPos * wLightPos.w;
+			float lightAttenuation = attenuation(range, length(toLight));
+			if (lightAttenuation <= 0) discard;
+			vec3 N = texelFetch(normalMap, pixel, 0).xyz;
+			vec3 V = normalize(wEye - wPos);
+			vec3 L = normalize(toLight);
+			vec3 H = normalize(L + V);
+			float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
+			vec4 specular = texelFetch(specularMap, pixel, 0);
+			vec3 albedo = texelFetch(albedoMap, pixel, 0).rgb;
+			radiance = vec4((albedo * cost + specular.rgb * pow(cosd, specular.a)) * Le * lightAttenuation, 1);
+		}
+	)";
+
+    // Full screen triangle adding the ambient term, the depth of the G-buffer goes to the frame for later passes
+    const char * compositeVertexSource = R"(
+		#version 330
+		precision highp float;
+
+		void main() {
+			gl_Position = vec4((gl_VertexID & 1) * 4 - 1, (gl_VertexID >> 1) * 4 - 1, 0, 1);
+		}
+	)";
+
+    const char * compositeFragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform sampler2D ambientMap, lightMap, depthMap;
+		uniform vec3 La;            // sum of the ambient light of the sources
+
+		out vec4 fragmentColor;
+
+		void main() {
+			ivec2 pixel = ivec2(gl_FragCoord.xy);
+			float depth = texelFetch(depthMap, pixel, 0).r;
+			if (depth >= 1) discard;	// the clear color stays
+			fragmentColor = vec4(texelFetch(ambientMap, pixel, 0).rgb * La + texelFetch(lightMap, pixel, 0).rgb, 1);
+			gl_FragDepth = depth;
+		}
+	)";
+
+    struct LightVertex {
+        vec2 ndc;
+        vec4 wLightPos;
+        vec3 Le;
+        float range;
+    };
+
+    GPUProgram lightProgram, compositeProgram;
+    unsigned int vao = 0, vbo = 0, emptyVao = 0;
+    size_t vboBytes = 0;
+    std::vector<LightVertex> vertices;     // two triangles per light, refilled every frame
+
+    void addRect(const vec4& rect, const Light& light) {
+        const vec2 corners[6] = { vec2(rect.x, rect.y), vec2(rect.z, rect.y), vec2(rect.z, rect.w),
+                                  vec2(rect.x, rect.y), vec2(rect.z, rect.w), vec2(rect.x, rect.w) };
+        for (const vec2& corner : corners) vertices.push_back(LightVertex{ corner, light.wLightPos, light.Le, light.range });
+    }
+public:
+    GBufferShader * gBufferShader = nullptr;
+    RenderTarget gBuffer;       // albedo, ambient, specular, normal and depth
+    RenderTarget lightBuffer;   // radiance of the lights, without the ambient term
+    int lightsDrawn = 0;        // lights of the last frame whose rectangle was not culled
+
+    void Create(int width, int height, size_t maxLights) {
+        AllocScope allocScope(ALLOC_SCENE);
+        gBufferShader = new GBufferShader();
+        lightProgram.create(lightVertexSource, Shader::withGLSL(lightFragmentSource, attenuationGLSL).c_str(), "radiance");
+        compositeProgram.create(compositeVertexSource, compositeFragmentSource, "fragmentColor");
+        const unsigned int gBufferFormats[] = { GL_RGBA8, GL_RGBA8, GL_RGBA16F, GL_RGBA16F };
+        gBuffer.Create(width, height, 4, gBufferFormats);
+        const unsigned int lightFormats[] = { GL_RGBA16F };
+        lightBuffer.Create(width, height, 1, lightFormats, 0);
+        vertices.reserve(maxLights * 6);
+
+        glGenVertexArrays(1, &emptyVao);
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        for (int i = 0; i < 4; i++) glEnableVertexAttribArray(i);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(LightVertex), (void*)offsetof(LightVertex, ndc));
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(LightVertex), (void*)offsetof(LightVertex, wLightPos));
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(LightVertex), (void*)offsetof(LightVertex, Le));
+        glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(LightVertex), (void*)offsetof(LightVertex, range));
+    }
+
+    bool Created() const { return gBuffer.Created(); }
+
+    void BeginGeometry() {
+        gBuffer.Bind();
+        glClearColor(0, 0, 0, 0);
+        glClearDepth(1);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // Accumulates the lights into the light buffer and composites the result into the default framebuffer.
+    // Every light is drawn, there is no limit of the uniform arrays; lights with a range only cover their rectangle.
+    void Shade(const std::vector<Light>& lights, Camera& camera) {
+        PROFILE_ZONE("DeferredLighting::Shade");
+        mat4 V = camera.V(), P = camera.P();
+        vec4 planes[6];
+        camera.FrustumPlanes(planes);
+        vertices.clear();
+        vec3 La;
+        for (const Light& light : lights) {
+            La = La + light.La;
+            vec4 rect(-1, -1, 1, 1);
+            if (light.range > 0 && light.wLightPos.w != 0) {
+                vec4 wCenter = light.wLightPos / light.wLightPos.w;
+                bool outside = false;
+                for (int i = 0; i < 6; i++) if (dot(planes[i], wCenter) < -light.range) outside = true;
+                if (outside || !sphereScreenRect(wCenter, light.range, V, P, camera.fp, rect)) continue;
+            }
+            addRect(rect, light);
+        }
+        lightsDrawn = (int)vertices.size() / 6;
+
+        {
+            GPU_SCOPE("light accumulation");
+            lightBuffer.Bind();
+            glClear(GL_COLOR_BUFFER_BIT);
+            glDisable(GL_DEPTH_TEST);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE);
+            lightProgram.Use();
+            lightProgram.setUniform(gBuffer.colors[0], "albedoMap", 0);
+            lightProgram.setUniform(gBuffer.colors[2], "specularMap", 1);
+            lightProgram.setUniform(gBuffer.colors[3], "normalMap", 2);
+            lightProgram.setUniform(gBuffer.depth, "depthMap", 3);
+            vec3 forward, right, up;
+            camera.RayBasis(forward, right, up);
+            lightProgram.setUniform(camera.wEye, "wEye");
+            lightProgram.setUniform(forward, "forward");
+            lightProgram.setUniform(right, "right");
+            lightProgram.setUniform(up, "up");
+            lightProgram.setUniform(camera.fp, "fp");
+            lightProgram.setUniform(camera.bp, "bp");
+            if (!vertices.empty()) {
+                size_t bytes = vertices.size() * sizeof(LightVertex);
+                glBindVertexArray(vao);
+                glStats.BindVertexArray();
+                glBindBuffer(GL_ARRAY_BUFFER, vbo);
+                glBufferData(GL_ARRAY_BUFFER, bytes, &vertices[0], GL_STREAM_DRAW);
+                glStats.vboMemory += bytes - vboBytes;
+                vboBytes = bytes;
+                glStats.Upload(bytes);
+                glDrawArrays(GL_TRIANGLES, 0, (int)vertices.size());
+                glStats.Draw((unsigned int)vertices.size(), (unsigned int)vertices.size() / 3);
+            }
+            glDisable(GL_BLEND);
+            glEnable(GL_DEPTH_TEST);
+        }
+
+        GPU_SCOPE("composite");
+        bindDefaultFramebuffer();
+        compositeProgram.Use();
+        compositeProgram.setUniform(gBuffer.colors[1], "ambientMap", 0);
+        compositeProgram.setUniform(lightBuffer.colors[0], "lightMap", 1);
+        compositeProgram.setUniform(gBuffer.depth, "depthMap", 2);
+        compositeProgram.setUniform(La, "La");
+        glBindVertexArray(emptyVao);
+        glStats.BindVertexArray();
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glStats.Draw(3, 1);
+    }
+};
+
+//---------------------------
+class TransparentShader : public Shader { // Phong of see-through surfaces into the weighted sums of the transparent pass
+//---------------------------
+    const char * vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
+		uniform vec3  wEye;         // pos of eye
+
+		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
+		layout(location = 1) in vec3  vtxNorm;      	 // normal in modeling space
+		layout(location = 2) in vec2  vtxUV;
+
+		out vec3 wPos;              // pos in world space
+		out vec3 wNormal;		    // normal in world space
+		out vec3 wView;             // view in world space
+		out vec2 texcoord;
+
+		void main() {
+			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+			vec4 wPos4 = vec4(vtxPos, 1) * M;
+			wPos = wPos4.xyz / wPos4.w;
+		    wView  = wEye - wPos;
+		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+		    texcoord = vtxUV;
+		}
+	)";
+
+    // The sums do not depend on the order of the fragments: color times alpha times weight with the weights in
+    // the second target are added, the alpha channel multiplies the transmittance
+    const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		struct Light {
+			vec3 La, Le;
+			vec4 wLightPos;
+			float range;	// of point lights, 0 reaches everywhere
+		};
+
+		struct Material {
+			vec3 kd, ks, ka;
+			float shininess;
+		};
+
+		uniform Material material;
+		uniform Light[8] lights;    // light sources
+		uniform int   nLights;
+		uniform sampler2D diffuseTexture;
+
+		in  vec3 wPos;
+		in  vec3 wNormal;
+		in  vec3 wView;
+		in  vec2 texcoord;
+
+		layout(location = 0) out vec4 accumulation;	// color * alpha * weight, alpha for the transmittance
+		layout(location = 1) out vec4 weight;		// alpha * weight
+
+		void main() {
+			vec3 N = normalize(wNormal);
+			vec3 V = normalize(wView);
+			if (dot(N, V) < 0) N = -N;	// both sides of a see-through surface are seen
+			vec4 texColor = texture(diffuseTexture, texcoord);
+			vec3 ka = material.ka * texColor.rgb;
+			vec3 kd = material.kd * texColor.rgb;
+
+			vec3 radiance = vec3(0, 0, 0);
+			for(int i = 0; i < nLights; i++) {
+				vec3 toLight = lights[i].wLightPos.xyz - wPos * lights[i].wLightPos.w;
+				vec3 L = normalize(toLight);
+				vec3 H = normalize(L + V);
+				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
+				radiance += ka * lights[i].La +
+                           (kd * texColor.rgb * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le * attenuation(lights[i].range, length(toLight));
+			}
+			float alpha = texColor.a;
+			float z = length(wView);	// nearer surfaces dominate, eq. 7 of McGuire and Bavoil
+			float w = alpha * clamp(10 / (1e-5 + pow(z / 5, 2) + pow(z / 200, 6)), 1e-2, 3e3);
+			accumulation = vec4(radiance * alpha * w, alpha);
+			weight = vec4(alpha * w);
+		}
+	)";
+public:
+    TransparentShader() { create(vertexSource, withGLSL(fragmentSource, attenuationGLSL).c_str(), "accumulation"); }
+
+    const char * Name() { return "transparent"; }
+    SoftShading SoftwareShading() { return SOFT_PHONG; }
+
+    void Bind(const RenderState& state) {
+        PROFILE_ZONE("TransparentShader::Bind");
+        Use(); 		// make this program run
+        setUniform(state.MVP, "MVP");
+        setUniform(state.M, "M");
+        setUniform(state.Minv, "Minv");
+        setUniform(state.wEye, "wEye");
+        setUniform(*state.texture, "diffuseTexture");
+        setUniformMaterial(*state.material, "material");
+
+        int nLights = state.lights->size() < maxShaderLights ? (int)state.lights->size() : maxShaderLights;
+        setUniform(nLights, "nLights");
+        for (int i = 0; i < nLights; i++) {
+            setUniformLight((*state.lights)[i], lightName(i));
+        }
+    }
+};
+
+//---------------------------
+class WeightedTransparency { // weighted blended order independent transparency, the objects need no sorting
+//---------------------------
+    // Full screen triangle blending the weighted average color of the transparent surfaces over the frame
+    const char * compositeVertexSource = R"(
+		#version 330
+		precision highp float;
+
+		void main() {
+			gl_Position = vec4((gl_VertexID & 1) * 4 - 1, (gl_VertexID >> 1) * 4 - 1, 0, 1);
 		}
 	)";
 
-    // fragment shader in GLSL
-    const char * fragmentSource = R"(
+    const char * compositeFragmentSource = R"(
 		#version 330
 		precision highp float;
 
-		uniform sampler2D diffuseTexture;
+		uniform sampler2D accumulationMap, weightMap;
 
-		in  vec3 wNormal, wView, wLight;	// interpolated
-		in  vec2 texcoord;
-		out vec4 fragmentColor;    			// output goes to frame buffer
+		out vec4 fragmentColor;		// alpha is the transmittance, the frame is blended with it
 
 		void main() {
-		   vec3 N = normalize(wNormal), V = normalize(wView), L = normalize(wLight);
-		   if (dot(N, V) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
-		   float y = (dot(N, L) > 0.5) ? 1 : 0.5;
-		   if (abs(dot(N, V)) < 0.2) fragmentColor = vec4(0, 0, 0, 1);
-		   else						 fragmentColor = vec4(y * texture(diffuseTexture, texcoord).rgb, 1);
+			ivec2 pixel = ivec2(gl_FragCoord.xy);
+			vec4 accumulation = texelFetch(accumulationMap, pixel, 0);
+			if (accumulation.a >= 1) discard;	// no transparent surface
+			float weight = texelFetch(weightMap, pixel, 0).r;
+			fragmentColor = vec4(accumulation.rgb / max(weight, 1e-5), accumulation.a);
 		}
 	)";
+
+    GPUProgram compositeProgram;
+    unsigned int emptyVao = 0;
 public:
-    NPRShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+    TransparentShader * shader = nullptr;
+    RenderTarget target;    // the sums of the transparent surfaces with a copy of the opaque depth
+
+    void Create(int width, int height) {
+        AllocScope allocScope(ALLOC_SCENE);
+        shader = new TransparentShader();
+        compositeProgram.create(compositeVertexSource, compositeFragmentSource, "fragmentColor");
+        const unsigned int formats[] = { GL_RGBA16F, GL_R16F };
+        target.Create(width, height, 2, formats);
+        glGenVertexArrays(1, &emptyVao);
+    }
 
-    void Bind(RenderState state) {
-        Use(); 		// make this program run
-        setUniform(state.MVP, "MVP");
-        setUniform(state.M, "M");
-        setUniform(state.Minv, "Minv");
-        setUniform(state.wEye, "wEye");
-        setUniform(*state.texture, std::string("diffuseTexture"));
-        setUniform(state.lights[0].wLightPos, "wLightPos");
+    bool Created() const { return target.Created(); }
+
+    // The transparent surfaces are tested against the depth of the opaque ones, but do not write it.
+    // GL 3.3 has one blend function for every target: the color sums add, the alpha channel of the first
+    // target multiplies the transmittance, the second target has no alpha.
+    void Begin() {
+        target.CopyDefaultDepth();
+        const float clearAccumulation[] = { 0, 0, 0, 1 }, clearWeight[] = { 0, 0, 0, 0 };
+        glClearBufferfv(GL_COLOR, 0, clearAccumulation);
+        glClearBufferfv(GL_COLOR, 1, clearWeight);
+        glDepthMask(GL_FALSE);
+        glEnable(GL_BLEND);
+        glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+    }
+
+    // Blends the average color over the default framebuffer with the transmittance of the pixel
+    void Resolve() {
+        GPU_SCOPE("transparent composite");
+        bindDefaultFramebuffer();
+        glDisable(GL_DEPTH_TEST);
+        glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+        compositeProgram.Use();
+        compositeProgram.setUniform(target.colors[0], "accumulationMap", 0);
+        compositeProgram.setUniform(target.colors[1], "weightMap", 1);
+        glBindVertexArray(emptyVao);
+        glStats.BindVertexArray();
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glStats.Draw(3, 1);
+        glDisable(GL_BLEND);
+        glEnable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
     }
 };
 
@@ -408,34 +1873,51 @@ public:
 class Geometry {
 //---------------------------
 protected:
-    unsigned int vao, vbo;        // vertex array object
+    unsigned int vao = 0, vbo = 0;    // vertex array object
+    unsigned int positionVao = 0, positionVbo = 0;  // positions only, of the depth pre-pass
 public:
+    vec3 center;                  // bounding sphere in modeling space
+    float radius = 0;
+    size_t vboBytes = 0;          // GPU memory of the vertex buffer
+
     Geometry() {
+        if (!hasGLContext() || options.meshPool) return;   // pooled meshes share the vertex array of the pool
         glGenVertexArrays(1, &vao);
         glBindVertexArray(vao);
         glGenBuffers(1, &vbo); // Generate 1 vertex buffer object
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
     }
     virtual void Draw() = 0;
-    ~Geometry() {
-        glDeleteBuffers(1, &vbo);
-        glDeleteVertexArrays(1, &vao);
+    virtual void DrawPositions() { Draw(); }  // with the position stream only, if there is one
+    virtual const MeshRange * Mesh() { return nullptr; }  // in the mesh pool, if it is pooled
+    virtual void DrawSoftware(const SoftDraw& draw) = 0;
+    virtual void Trace(const SoftDraw& draw) = 0;
+    virtual ~Geometry() {
+        glStats.vboMemory -= vboBytes;
+        if (vbo > 0) glDeleteBuffers(1, &vbo);
+        if (vao > 0) glDeleteVertexArrays(1, &vao);
+        if (positionVbo > 0) glDeleteBuffers(1, &positionVbo);
+        if (positionVao > 0) glDeleteVertexArrays(1, &positionVao);
     }
 };
 
 //---------------------------
 class ParamSurface : public Geometry {
 //---------------------------
-    struct VertexData {
-        vec3 position, normal;
-        vec2 texcoord;
-    };
+    typedef SoftVertex VertexData;     // position, normal, texcoord
 
     unsigned int nVtxPerStrip, nStrips;
+    std::vector<VertexData> cpuVertices;  // kept instead of the vertex buffer when there is no GL context
+    RayMesh rayMesh;                      // triangles of the cpu vertices for the ray tracer
+    const RayShape * rayShape = &rayMesh; // traced instead of the triangles, if the surface has a closed form
+    MeshRange meshRange;                  // of the indexed triangles in the mesh pool
+    bool pooled = false;
 public:
     ParamSurface() { nVtxPerStrip = nStrips = 0; }
+    ~ParamSurface() { if (pooled) meshPool.Free(meshRange); }
 
     virtual void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) = 0;
+    virtual const RayShape * Analytic() { return nullptr; }  // the same surface for direct ray intersection
 
     VertexData GenVertexData(float u, float v) {
         VertexData vtxData;
@@ -449,7 +1931,16 @@ public:
         return vtxData;
     }
 
-    void create(int N = tessellationLevel, int M = tessellationLevel) {
+    void create(int N = options.tessellation, int M = options.tessellation) {
+        PROFILE_ZONE("ParamSurface::create");
+        AllocScope allocScope(ALLOC_GEOMETRY);
+        if (options.analytic && Analytic()) {   // only ray traced, nothing is tessellated
+            rayShape = Analytic();
+            AABB bounds = rayShape->Bounds();
+            center = bounds.Center();
+            radius = length(bounds.max - center);
+            return;
+        }
         nVtxPerStrip = (M + 1) * 2;
         nStrips = N;
         std::vector<VertexData> vtxData;	// vertices on the CPU
@@ -459,7 +1950,25 @@ public:
                 vtxData.push_back(GenVertexData((float)j / M, (float)(i + 1) / N));
             }
         }
+        vec3 boxMin = vtxData[0].position, boxMax = vtxData[0].position;
+        for (const VertexData& vtx : vtxData) {
+            boxMin = vec3(fmin(boxMin.x, vtx.position.x), fmin(boxMin.y, vtx.position.y), fmin(boxMin.z, vtx.position.z));
+            boxMax = vec3(fmax(boxMax.x, vtx.position.x), fmax(boxMax.y, vtx.position.y), fmax(boxMax.z, vtx.position.z));
+        }
+        center = (boxMin + boxMax) * 0.5f;
+        radius = 0;
+        for (const VertexData& vtx : vtxData) radius = fmax(radius, length(vtx.position - center));
+        if (!hasGLContext()) {
+            cpuVertices.swap(vtxData);
+            if (options.raytrace) rayMesh.Build(&cpuVertices[0], nVtxPerStrip, nStrips);
+            return;
+        }
+        if (options.meshPool) return createPooled(vtxData, N, M);
         glBufferData(GL_ARRAY_BUFFER, nVtxPerStrip * nStrips * sizeof(VertexData), &vtxData[0], GL_STATIC_DRAW);
+        glStats.vboMemory -= vboBytes;
+        vboBytes = nVtxPerStrip * nStrips * sizeof(VertexData);
+        glStats.vboMemory += vboBytes;
+        glStats.Upload(vboBytes);
         // Enable the vertex attribute arrays
         glEnableVertexAttribArray(0);  // attribute array 0 = POSITION
         glEnableVertexAttribArray(1);  // attribute array 1 = NORMAL
@@ -468,23 +1977,89 @@ public:
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, position));
         glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, normal));
         glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, texcoord));
+        if (options.depthPrepass) createPositions(vtxData);
+    }
+
+    // The (N + 1) x (M + 1) grid of the strip vertices is stored once, the triangles of the strips index it with
+    // the vertex order of the strips, so the pooled mesh rasterizes the same
+    void createPooled(const std::vector<VertexData>& stripData, int N, int M) {
+        std::vector<VertexData> grid((N + 1) * (M + 1));
+        for (int i = 0; i <= N; i++) for (int j = 0; j <= M; j++)
+            grid[i * (M + 1) + j] = i < N ? stripData[i * nVtxPerStrip + 2 * j] : stripData[(N - 1) * nVtxPerStrip + 2 * j + 1];
+        std::vector<unsigned int> indices;
+        indices.reserve(N * M * 6);
+        for (int i = 0; i < N; i++) {
+            auto strip = [i, M](int k) { return (unsigned int)((i + (k & 1)) * (M + 1) + k / 2); };
+            for (int k = 0; k < 2 * M; k++) {   // odd triangles of a strip swap their first two vertices
+                indices.push_back(strip(k & 1 ? k + 1 : k));
+                indices.push_back(strip(k & 1 ? k : k + 1));
+                indices.push_back(strip(k + 2));
+            }
+        }
+        meshRange = meshPool.Allocate(&grid[0], (unsigned int)grid.size(), &indices[0], (unsigned int)indices.size(),
+                                      options.depthPrepass);
+        pooled = true;
+    }
+
+    // The depth pre-pass reads 12 bytes per vertex instead of the 32 of the interleaved stream
+    void createPositions(const std::vector<VertexData>& vtxData) {
+        std::vector<vec3> positions(vtxData.size());
+        for (size_t i = 0; i < vtxData.size(); i++) positions[i] = vtxData[i].position;
+        if (positionVao == 0) {
+            glGenVertexArrays(1, &positionVao);
+            glGenBuffers(1, &positionVbo);
+        }
+        glBindVertexArray(positionVao);
+        glBindBuffer(GL_ARRAY_BUFFER, positionVbo);
+        size_t bytes = positions.size() * sizeof(vec3);
+        glBufferData(GL_ARRAY_BUFFER, bytes, &positions[0], GL_STATIC_DRAW);
+        glStats.vboMemory += bytes;
+        vboBytes += bytes;
+        glStats.Upload(bytes);
+        glEnableVertexAttribArray(0);  // attribute array 0 = POSITION
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), (void*)0);
     }
 
+    const MeshRange * Mesh() { return pooled ? &meshRange : nullptr; }
+
     void Draw() {
-        glBindVertexArray(vao);
-        for (unsigned int i = 0; i < nStrips; i++) glDrawArrays(GL_TRIANGLE_STRIP, i *  nVtxPerStrip, nVtxPerStrip);
+        if (pooled) meshPool.Draw(meshRange, false);
+        else drawStrips(vao);
+    }
+
+    void DrawPositions() {
+        if (pooled) meshPool.Draw(meshRange, true);
+        else drawStrips(positionVao > 0 ? positionVao : vao);
+    }
+
+    void drawStrips(unsigned int vertexArray) {
+        glBindVertexArray(vertexArray);
+        glStats.BindVertexArray();
+        commandRecorder.VertexArray(vertexArray);
+        for (unsigned int i = 0; i < nStrips; i++) {
+            glDrawArrays(GL_TRIANGLE_STRIP, i *  nVtxPerStrip, nVtxPerStrip);
+            glStats.Draw(nVtxPerStrip, nVtxPerStrip - 2);
+            commandRecorder.DrawArrays(GL_TRIANGLE_STRIP, i * nVtxPerStrip, nVtxPerStrip);
+        }
+    }
+
+    void DrawSoftware(const SoftDraw& draw) {
+        softRasterizer.DrawStrips(draw, &cpuVertices[0], nVtxPerStrip, nStrips);
     }
+
+    void Trace(const SoftDraw& draw) { rayTracer.AddInstance(draw, rayShape); }
 };
 
 //---------------------------
 class Sphere : public ParamSurface {
 //---------------------------
 public:
-    Sphere() { create(); }
+    Sphere(int tessellation = options.tessellation) { create(tessellation, tessellation); }
     void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
         U = U * 2.0f * (float)M_PI, V = V * (float)M_PI;
         X = Cos(U) * Sin(V); Y = Sin(U) * Sin(V); Z = Cos(V);
     }
+    const RayShape * Analytic() { static RayAnalytic shape(SHAPE_SPHERE); return &shape; }
 };
 
 
@@ -493,21 +2068,23 @@ public:
 class Cylinder : public ParamSurface {
 //---------------------------
 public:
-    Cylinder() { create(); }
+    Cylinder(int tessellation = options.tessellation) { create(tessellation, tessellation); }
     void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
         U = U * 2.0f * M_PI, V = V;
         X = Cos(U); Z = Sin(U); Y = V;
     }
+    const RayShape * Analytic() { static RayAnalytic shape(SHAPE_CYLINDER); return &shape; }
 };
 
 //---------------------------
 class  Plane : public ParamSurface {
 //---------------------------
 public:
-    Plane() { create(); }
+    Plane(int tessellation = options.tessellation) { create(tessellation, tessellation); }
     void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
       X= U*2-1;Z=V*2-1;Y=0;
     }
+    const RayShape * Analytic() { static RayAnalytic shape(SHAPE_PLANE); return &shape; }
 };
 
 
@@ -515,7 +2092,7 @@ public:
 class Paraboloid : public ParamSurface {
 //---------------------------
 public:
-    Paraboloid() { create(); }
+    Paraboloid(int tessellation = options.tessellation) { create(tessellation, tessellation); }
     void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
         Dnum2 s = U*M_PI*2;
         Dnum2 r=V;
@@ -523,12 +2100,13 @@ public:
         Z= Sin(s)*r;
         Y=X*X+Z*Z;
     }
+    const RayShape * Analytic() { static RayAnalytic shape(SHAPE_PARABOLOID); return &shape; }
 };
 //---------------------------
 class CylinderTop : public ParamSurface {
 //---------------------------
 public:
-    CylinderTop() { create(); }
+    CylinderTop(int tessellation = options.tessellation) { create(tessellation, tessellation); }
     void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
         Dnum2 s = U*M_PI*2;
         Dnum2 r=V;
@@ -536,6 +2114,7 @@ public:
         X= Cos(s)*r;
         Z= Sin(s)*r;
     }
+    const RayShape * Analytic() { static RayAnalytic shape(SHAPE_DISK); return &shape; }
 };
 
 
@@ -544,6 +2123,52 @@ public:
 
 
 
+struct Object;
+
+//---------------------------
+struct DrawPacket { // a visible object with the state of its draw, recorded by a worker and drawn by the GL thread
+//---------------------------
+    Object *   object;
+    Shader *   shader;
+    Material * material;
+    Texture *  texture;
+    Geometry * geometry;
+    mat4 M, Minv, MVP;
+    unsigned int index;     // of the object in the scene, orders the packets of the same state
+    bool transparent;
+
+    // The transparent packets follow the opaque ones, which form batches of the same shader, texture and material
+    bool operator<(const DrawPacket& b) const {
+        if (transparent != b.transparent) return b.transparent;
+        if (shader != b.shader) return shader < b.shader;
+        if (texture != b.texture) return texture < b.texture;
+        if (material != b.material) return material < b.material;
+        return index < b.index;
+    }
+
+    void Transform(RenderState& state) const { // fills the per-object fields of the state
+        state.M = M;
+        state.Minv = Minv;
+        state.MVP = MVP;
+        state.material = material;
+        state.texture = texture;
+    }
+
+    void Draw(RenderState& state, Shader * program = nullptr) const { // program overrides the shader
+        PROFILE_ZONE("DrawPacket::Draw");
+        Transform(state);
+        (program ? program : shader)->Bind(state);
+        geometry->Draw();
+    }
+
+    void DrawDepth(RenderState& state, Shader * depthProgram) const { // positions only
+        PROFILE_ZONE("DrawPacket::DrawDepth");
+        Transform(state);
+        depthProgram->Bind(state);
+        geometry->DrawPositions();
+    }
+};
+
 //---------------------------
 struct Object {
 //---------------------------
@@ -553,6 +2178,7 @@ struct Object {
     Geometry * geometry;
     vec3 scale, translation, rotationAxis;
     float rotationAngle;
+    bool dynamic = false;   // moved by the animation, its shadows are drawn every frame
 public:
     Object(Shader * _shader, Material * _material, Texture * _texture, Geometry * _geometry) :
             scale(vec3(1, 1, 1)), translation(vec3(0, 0, 0)), rotationAxis(0, 0, 0), rotationAngle(0) {
@@ -567,7 +2193,55 @@ public:
         Minv = TranslateMatrix(-translation) * RotationMatrix(-rotationAngle, rotationAxis) * ScaleMatrix(vec3(1 / scale.x, 1 / scale.y, 1 / scale.z));
     }
 
-    void Draw(RenderState state) {
+    bool Transparent() const { return texture && texture->seeThrough; }  // drawn by the transparent pass
+
+    bool InFrustum(const vec4 planes[6]) { // bounding sphere test in world space
+        mat4 M, Minv;
+        SetModelingTransform(M, Minv);
+        return InFrustum(M, planes);
+    }
+
+    bool InFrustum(const mat4& M, const vec4 planes[6]) { // with the modeling transform of the frame
+        vec4 wCenter = vec4(geometry->center.x, geometry->center.y, geometry->center.z, 1) * M;
+        float wRadius = geometry->radius * fmax(fabs(scale.x), fmax(fabs(scale.y), fabs(scale.z)));
+        for (int i = 0; i < 6; i++) if (dot(planes[i], wCenter) < -wRadius) return false;
+        return true;
+    }
+
+    // The frustum test and the state of the draw into the packet. The object is only read, so the objects can be
+    // recorded on any thread. False if the object is culled.
+    bool Record(const vec4 planes[6], const mat4& V, const mat4& P, unsigned int index, DrawPacket& packet) {
+        SetModelingTransform(packet.M, packet.Minv);
+        if (!InFrustum(packet.M, planes)) return false;
+        packet.MVP = packet.M * V * P;
+        packet.object = this;
+        packet.shader = shader;
+        packet.material = material;
+        packet.texture = texture;
+        packet.geometry = geometry;
+        packet.index = index;
+        packet.transparent = Transparent();
+        return true;
+    }
+
+    void Draw(RenderState& state, Shader * program = nullptr) { // program overrides the shader
+        PROFILE_ZONE("Object::Draw");
+        Bind(state, program ? program : shader);
+        geometry->Draw();
+    }
+
+    void DrawDepth(RenderState& state, Shader * depthProgram) { // positions only
+        PROFILE_ZONE("Object::DrawDepth");
+        Bind(state, depthProgram);
+        geometry->DrawPositions();
+    }
+
+    void Bind(RenderState& state, Shader * program) {
+        Transform(state);
+        program->Bind(state);
+    }
+
+    void Transform(RenderState& state) { // fills the per-object fields of the state
         mat4 M, Minv;
         SetModelingTransform(M, Minv);
         state.M = M;
@@ -575,26 +2249,342 @@ public:
         state.MVP = state.M * state.V * state.P;
         state.material = material;
         state.texture = texture;
-        shader->Bind(state);
-        geometry->Draw();
+    }
+
+    void DrawSoftware(const RenderState& state) { geometry->DrawSoftware(SoftwareDraw(state)); }
+
+    void Trace(const RenderState& state) { geometry->Trace(SoftwareDraw(state)); }
+
+    SoftDraw SoftwareDraw(const RenderState& state) { // the same uniforms for the software rasterizer and ray tracer
+        SoftDraw draw;
+        SetModelingTransform(draw.M, draw.Minv);
+        draw.MVP = draw.M * state.V * state.P;
+        draw.kd = material->kd;
+        draw.ks = material->ks;
+        draw.ka = material->ka;
+        draw.shininess = material->shininess;
+        draw.texture = texture;
+        draw.shading = shader->SoftwareShading();
+        return draw;
     }
 
     virtual void Animate(float tstart, float tend) { }
 };
 
+//---------------------------
+struct LampParts { // geometries of a lamp, shared by all lamps of the same tessellation
+//---------------------------
+    Geometry * cylinder, * cylinderTop, * sphere, * paraboloid;
+
+    LampParts(int tessellation) {
+        cylinder = new Cylinder(tessellation);
+        cylinderTop = new CylinderTop(tessellation);
+        sphere = new Sphere(tessellation);
+        paraboloid = new Paraboloid(tessellation);
+    }
+};
+
+//---------------------------
+struct Lamp { // base, two arms with three joints and the paraboloid head holding the light
+//---------------------------
+    Object * base, * baseTop, * joint0, * arm0, * joint1, * arm1, * joint2, * head;
+    vec3 position;      // of the base
+    float phase;        // added to the animation time, so that lamps do not move in sync
+    vec4 wHeadLight;    // light position in the head, updated by Update
+
+    Lamp(std::vector<Object *>& objects, const LampParts& parts, Shader * shader, Material * bodyMaterial,
+         Material * headMaterial, Texture * bodyTexture, Texture * topTexture, vec3 _position, float _phase = 0) {
+        position = _position;
+        phase = _phase;
+        base = part(objects, new Object(shader, bodyMaterial, bodyTexture, parts.cylinder), vec3(2.0f, 0.5f, 2.0f));
+        baseTop = part(objects, new Object(shader, bodyMaterial, topTexture, parts.cylinderTop), vec3(2.01f, 0.25f, 2.01f));
+        joint0 = part(objects, new Object(shader, bodyMaterial, bodyTexture, parts.sphere), vec3(0.5f, 0.5f, 0.5f));
+        arm0 = part(objects, new Object(shader, bodyMaterial, bodyTexture, parts.cylinder), vec3(0.3f, 2.0f, 0.3f));
+        joint1 = part(objects, new Object(shader, bodyMaterial, bodyTexture, parts.sphere), vec3(0.5f, 0.5f, 0.5f));
+        arm1 = part(objects, new Object(shader, bodyMaterial, bodyTexture, parts.cylinder), vec3(0.3f, 2.0f, 0.3f));
+        joint2 = part(objects, new Object(shader, bodyMaterial, bodyTexture, parts.sphere), vec3(0.5f, 0.5f, 0.5f));
+        head = part(objects, new Object(shader, headMaterial, bodyTexture, parts.paraboloid), vec3(2.0f, 1.5f, 2.0f));
+        for (Object * moving : { arm0, joint1, arm1, joint2, head }) moving->dynamic = true;
+        arm0->rotationAxis = vec3(0.3, 1, 0.3);
+        arm1->rotationAxis = vec3(-0.5, 1, -0.5);
+        head->rotationAxis = vec3(-0.3, 0.5, -0.1);
+    }
+
+    static Object * part(std::vector<Object *>& objects, Object * object, vec3 scale) {
+        object->scale = scale;
+        object->rotationAxis = vec3(0, 1, 0);
+        objects.push_back(object);
+        return object;
+    }
+
+    // Each part is attached to the end of the previous one
+    void Update(float ttime) {
+        mat4 M, Minv;
+        vec4 temp;
+        float t = ttime + phase;
+        base->translation = position + vec3(0, -3.5, 0);
+        baseTop->translation = position + vec3(0, -3, 0);
+        joint0->translation = position + vec3(0, -3, 0);
+        joint0->SetModelingTransform(M, Minv);
+
+        temp = vec4(0, 0, 0, 1) * M;
+        arm0->rotationAngle = t;
+        arm0->translation = vec3(temp.x, temp.y, temp.z);
+        arm0->SetModelingTransform(M, Minv);
+
+        temp = vec4(0, 1, 0, 1) * M;
+        joint1->translation = vec3(temp.x, temp.y, temp.z);
+        joint1->SetModelingTransform(M, Minv);
+
+        temp = vec4(0, 0, 0, 1) * M;
+        arm1->rotationAngle = t;
+        arm1->translation = vec3(temp.x, temp.y, temp.z);
+        arm1->SetModelingTransform(M, Minv);
+
+        temp = vec4(0, 1, 0, 1) * M;
+        joint2->translation = vec3(temp.x, temp.y, temp.z);
+        head->rotationAngle = t;
+        head->translation = vec3(temp.x, temp.y, temp.z);
+        head->SetModelingTransform(M, Minv);
+        wHeadLight = vec4(0, 0.6, 0, 1) * M;
+    }
+};
+
+//---------------------------
+class PointShadows { // cube depth maps of the first point lights, the static casters are cached until the light moves
+//---------------------------
+    static const int maxLights = ShadowMaps::maxLights;
+    struct Cache {
+        unsigned int staticMap = 0;     // static casters only, rendered when the light moved
+        unsigned int map = 0;           // the static map with the dynamic casters of the frame drawn over it
+        vec4 wLightPos;
+        float far = 0;
+        bool valid = false;
+    };
+    Cache caches[maxLights];
+    int nLights = 0, size = 0;
+    unsigned int staticFbo = 0, fbo = 0;
+    size_t gpuBytes = 0;
+    ShadowShader * shader = nullptr;
+
+    unsigned int createCubeMap() {
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+        for (int face = 0; face < 6; face++)
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT32F, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);     // 2x2 PCF of each tap
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        gpuBytes += (size_t)size * size * 4 * 6;
+        return texture;
+    }
+
+    // Looks along the axis of the face with the up vector of the cube map layout, 90 degrees wide
+    static Camera faceCamera(vec3 wPos, int face, float far) {
+        static const vec3 directions[6] = { vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1) };
+        static const vec3 ups[6] = { vec3(0, -1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1), vec3(0, -1, 0), vec3(0, -1, 0) };
+        Camera camera;
+        camera.wEye = wPos;
+        camera.wLookat = wPos + directions[face];
+        camera.wVup = ups[face];
+        camera.fov = (float)M_PI / 2;
+        camera.asp = 1;
+        camera.fp = far / 1000;
+        camera.bp = far;
+        return camera;
+    }
+
+    static void attach(unsigned int framebuffer, unsigned int target, unsigned int cubeMap, int face) {
+        glBindFramebuffer(target, framebuffer);
+        glFramebufferTexture2D(target, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, cubeMap, 0);
+    }
+
+    void drawCasters(const std::vector<Object *>& objects, bool dynamic, Camera& camera, RenderState& state) {
+        vec4 planes[6];
+        camera.FrustumPlanes(planes);
+        state.V = camera.V();
+        state.P = camera.P();
+        for (Object * obj : objects)
+            if (obj->dynamic == dynamic && obj->InFrustum(planes)) obj->DrawDepth(state, shader);
+    }
+public:
+    ShadowMaps maps;            // of the last frame
+    int staticUpdates = 0;      // maps whose static casters were rendered again in the last frame
+
+    void Create(int _nLights, int _size) {
+        AllocScope allocScope(ALLOC_TEXTURES);
+        nLights = _nLights < maxLights ? _nLights : maxLights;
+        size = _size;
+        shader = new ShadowShader();
+        for (int i = 0; i < nLights; i++) {
+            caches[i].staticMap = createCubeMap();
+            caches[i].map = createCubeMap();
+        }
+        glStats.textureMemory += gpuBytes;
+        unsigned int framebuffers[2];
+        glGenFramebuffers(2, framebuffers);
+        staticFbo = framebuffers[0];
+        fbo = framebuffers[1];
+        for (unsigned int framebuffer : framebuffers) {
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+        }
+        glClearDepth(1);    // maps of directional lights stay cleared, they do not shadow
+        for (int i = 0; i < nLights; i++) for (int face = 0; face < 6; face++) {
+            attach(fbo, GL_FRAMEBUFFER, caches[i].staticMap, face);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            attach(fbo, GL_FRAMEBUFFER, caches[i].map, face);
+            glClear(GL_DEPTH_BUFFER_BIT);
+        }
+        bindDefaultFramebuffer();
+    }
+
+    bool Created() const { return nLights > 0; }
+
+    // The maps of the first point lights, a light without a range reaches the default far distance
+    void Render(const std::vector<Light>& lights, const std::vector<Object *>& objects, float defaultFar, RenderState& state) {
+        PROFILE_ZONE("PointShadows::Render");
+        glViewport(0, 0, size, size);
+        staticUpdates = 0;
+        for (int i = 0; i < nLights && i < (int)lights.size(); i++) {
+            const Light& light = lights[i];
+            Cache& cache = caches[i];
+            if (light.wLightPos.w == 0) continue;   // directional lights are not shadowed
+            vec4 wLightPos = light.wLightPos / light.wLightPos.w;
+            float far = light.range > 0 ? light.range : defaultFar;
+            bool moved = !cache.valid || far != cache.far || wLightPos.x != cache.wLightPos.x ||
+                         wLightPos.y != cache.wLightPos.y || wLightPos.z != cache.wLightPos.z;
+            shader->wLightPos = vec3(wLightPos.x, wLightPos.y, wLightPos.z);
+            shader->far = far;
+            for (int face = 0; face < 6; face++) {
+                Camera camera = faceCamera(shader->wLightPos, face, far);
+                if (moved) {
+                    attach(staticFbo, GL_FRAMEBUFFER, cache.staticMap, face);
+                    glClear(GL_DEPTH_BUFFER_BIT);
+                    drawCasters(objects, false, camera, state);
+                }
+                attach(staticFbo, GL_READ_FRAMEBUFFER, cache.staticMap, face);
+                attach(fbo, GL_DRAW_FRAMEBUFFER, cache.map, face);
+                glBlitFramebuffer(0, 0, size, size, 0, 0, size, size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+                glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+                drawCasters(objects, true, camera, state);
+            }
+            if (moved) staticUpdates++;
+            cache.wLightPos = wLightPos;
+            cache.far = far;
+            cache.valid = true;
+        }
+        bindDefaultFramebuffer();
+        maps.count = nLights;
+        maps.size = size;
+        for (int i = 0; i < nLights; i++) {
+            maps.maps[i] = caches[i].map;
+            maps.far[i] = caches[i].far;
+        }
+        if (benchmark.IsActive()) benchmark.AddCounter("static shadow maps rendered", staticUpdates);
+    }
+
+    ~PointShadows() {
+        for (int i = 0; i < nLights; i++) {
+            glDeleteTextures(1, &caches[i].staticMap);
+            glDeleteTextures(1, &caches[i].map);
+        }
+        if (fbo > 0) {
+            glDeleteFramebuffers(1, &staticFbo);
+            glDeleteFramebuffers(1, &fbo);
+        }
+        glStats.textureMemory -= gpuBytes;
+    }
+};
+
+//---------------------------
+class OverdrawMeter { // samples passing the depth test of the opaque pass, the fragments its programs shade
+//---------------------------
+    static const int nSlots = 3;        // frames in flight, read back when the query is reused
+    unsigned int queries[nSlots] = {};
+    static constexpr const char * counterName = "shaded fragments/pixel";
+    int frames[nSlots] = {};
+    bool pending[nSlots] = {}, measured[nSlots] = {};
+    int current = 0, frame = 0;
+
+    void collect(int slot) {
+        GLuint samples = 0;
+        glGetQueryObjectuiv(queries[slot], GL_QUERY_RESULT, &samples);
+        double perPixel = samples / ((double)windowWidth * windowHeight * (options.msaa > 1 ? options.msaa : 1));
+        if (benchmark.IsActive()) benchmark.AddCounter(counterName, perPixel, measured[slot]);
+        else printf("Frame %d: %.3f shaded fragments per pixel\n", frames[slot], perPixel);
+        pending[slot] = false;
+    }
+public:
+    void Begin() {
+        if (queries[0] == 0) {
+            glGenQueries(nSlots, queries);
+            if (benchmark.IsActive()) benchmark.AddCounter(counterName, 0, false);  // not in a measured frame
+        }
+        if (pending[current]) collect(current);
+        glBeginQuery(GL_SAMPLES_PASSED, queries[current]);
+    }
+
+    void End() {
+        glEndQuery(GL_SAMPLES_PASSED);
+        frames[current] = frame++;
+        pending[current] = true;
+        measured[current] = benchmark.IsMeasuring();
+        if (!benchmark.IsActive()) collect(current);   // printed in order, the wait is not measured
+        current = (current + 1) % nSlots;
+    }
+};
+
 //---------------------------
 class Scene {
 //---------------------------
 public:
     std::vector<Object *> objects;
+    std::vector<Lamp *> lamps;
+    std::vector<Object *> visibleObjects; // opaque objects passing the frustum test in the current frame
+    std::vector<Object *> transparentObjects;   // transparent ones passing it, in any order
     Camera camera; // 3D camera
+    vec3 orbitEye;  // eye position at time zero, the camera orbits the lookat point
     std::vector<Light> lights;
+    float time = 0;         // animation time of the last update
+    float tracedTime = -1;  // of the frame in the accumulation of the ray tracer
+    RenderTarget lightingTarget;    // lights of the reduced shading rate
+    DeferredLighting deferred;      // G-buffer and light accumulation of the deferred objects
+    LightGrid lightGrid;            // lights binned into the froxels for clustered forward shading
+    Shader * depthShader = nullptr; // of the depth pre-pass
+    PointShadows shadows;
+    WeightedTransparency transparency;  // sums of the transparent objects blended over the frame
+    StreamBuffer objectData;        // uniform blocks of the frame and of the Phong draws
+    IndirectDraws indirect;         // commands and per-draw data of the pooled objects
+    struct IndirectBatch {          // consecutive commands of the same texture, one multi-draw
+        Texture * texture;
+        unsigned int first, count;
+    };
+    std::vector<IndirectBatch> indirectBatches;
+    GpuCulling gpuCulling;          // frustum and depth pyramid tests of the compute shader
+    std::vector<Object *> gpuCulledObjects, cpuCulledObjects;   // the pooled forward objects, and the rest
+    struct GpuBatch {               // commands of the same program and texture, one multi-draw
+        Shader * program;
+        Texture * texture;
+    };
+    std::vector<GpuBatch> gpuBatches;
+    bool gpuTransformsSet = false;  // of the static objects
+    std::vector<std::vector<DrawPacket>> threadPackets; // visible objects recorded by each worker thread
+    std::vector<std::vector<const DrawPacket *>> threadOrder;  // the packets of the thread sorted, cheaper to move
+    std::vector<const DrawPacket *> drawList;   // the merged packets, visibleObjects then transparentObjects in their order
+    OverdrawMeter overdrawMeter;
 
     void Build() {
+        PROFILE_ZONE("Scene::Build");
+        AllocScope allocScope(ALLOC_SCENE);
         // Shaders
-        Shader * phongShader = new PhongShader();
-        Shader * gouraudShader = new GouraudShader();
-        Shader * nprShader = new NPRShader();
+        Shader * shader = CreateShader(options.shader);
 
         // Materials
         Material * material0 = new Material;
@@ -615,62 +2605,28 @@ public:
 
         // Geometries
         Geometry * plane = new  Plane();
-        Geometry * cilinder0 = new  Cylinder();
-        Geometry * sphere1 = new Sphere();
-        Geometry * cilinder1 = new  Cylinder();
-        Geometry * sphere2 = new Sphere();
-        Geometry * cilinder2 = new  Cylinder();
-        Geometry * sphere3 = new Sphere();
-        Geometry *  cylindertop= new CylinderTop();
-        Geometry * paraboloid = new Paraboloid();
+        LampParts * lampParts = new LampParts(options.tessellation);
         // Create objects by setting up their vertex data on the GPU
-        Object *  planeObject1 = new Object(phongShader, material0, texture4x8, plane);
+        Object *  planeObject1 = new Object(shader, material0, texture4x8, plane);
         planeObject1->scale = vec3(16.0f, 16.0f, 16.0f);
+        planeObject1->translation = vec3(0, -3.5, 0);
+        planeObject1->rotationAxis = vec3(0, 1, 0);
         objects.push_back( planeObject1);
 
-        Object * cilinderObject0 = new Object(phongShader, material0, texture15x20,  cilinder0);
-        cilinderObject0->scale = vec3(2.0f, 0.5f, 2.0f);
-        objects.push_back(cilinderObject0);
-
-        Object * mobiusObject1 = new Object(phongShader, material0, texture4x8, cylindertop);
-        mobiusObject1->scale  = vec3(2.01f, 0.25f, 2.01f);
-        objects.push_back(mobiusObject1);
-        // Create objects by setting up their vertex data on the GPU
-        Object * sphereObject1 = new Object(phongShader, material0, texture15x20, sphere1);
-        sphereObject1->scale = vec3(0.5f, 0.5f, 0.5f);
-        objects.push_back(sphereObject1);
-
-        // Create objects by setting up their vertex data on the GPU
-        Object * cilinderObject1 = new Object(phongShader, material0, texture15x20,  cilinder1);
-        cilinderObject1->scale = vec3(0.3f, 2.0f, 0.3f);
-        objects.push_back(cilinderObject1);
-
-        // Create objects by setting up their vertex data on the GPU
-        Object * sphereObject2 = new Object(phongShader, material0, texture15x20, sphere2);
-        sphereObject2->scale = vec3(0.5f, 0.5f, 0.5f);
-
-        objects.push_back(sphereObject2);
-
-        // Create objects by setting up their vertex data on the GPU
-        Object * cilinderObject2 = new Object(phongShader, material0, texture15x20,  cilinder2);
-        cilinderObject2->scale = vec3(0.3f, 2.0f, 0.3f);
-        objects.push_back(cilinderObject2);
-
-        // Create objects by setting up their vertex data on the GPU
-        Object * sphereObject3 = new Object(phongShader, material0, texture15x20, sphere3);
-        sphereObject3->scale = vec3(0.5f, 0.5f, 0.5f);
-        objects.push_back(sphereObject3);
-
-        Object * paraboloidObject1 = new Object(phongShader, material1, texture15x20, paraboloid);
-        paraboloidObject1->scale = vec3(2.0f, 1.5f, 2.0f);
-
-        objects.push_back(paraboloidObject1);
+        lamps.push_back(new Lamp(objects, *lampParts, shader, material0, material1, texture15x20, texture4x8, vec3(0, 0, 0)));
+        if (options.transparent) {
+            Texture * glass = new CheckerBoardTexture(15, 20, true);
+            for (Lamp * lamp : lamps) lamp->head->texture = glass;
+        }
 
         int nObjects = objects.size();
+        visibleObjects.reserve(nObjects);
+        transparentObjects.reserve(nObjects);
         // Camera
         camera.wEye = vec3(10, 3, 10);
         camera.wLookat = vec3(0, 1, 0);
         camera.wVup = vec3(0, 1, 0);
+        orbitEye = vec3(8, 3, 8);
 
 
         // Lights
@@ -687,15 +2643,482 @@ public:
         lights[2].La = vec3(0.1f, 0.1f, 0.1f);
         lights[2].Le = vec3(0, 0, 3);
 
+        // more lights are dim white ones on a circle above the lamp, fewer keep the first ones
+        int nLights = options.lights > 0 ? options.lights : 1;
+        for (int i = 3; i < nLights; i++) {
+            float angle = 2 * (float)M_PI * (i - 3) / (nLights - 3);
+            Light light;
+            light.wLightPos = vec4(10 * cosf(angle), 8, 10 * sinf(angle), 1);
+            light.La = vec3(0.02f, 0.02f, 0.02f);
+            light.Le = vec3(0.5f, 0.5f, 0.5f);
+            light.range = options.lightRange;
+            lights.push_back(light);
+        }
+        lights.resize(nLights);
+
+    }
+
+    // Targets and programs of the optional passes. The lighting target of the reduced shading rate holds the
+    // diffuse and specular sums with the distance and normal cosine of the surface, a texel for rate x rate pixels
+    void CreateRenderTargets() {
+        AllocScope allocScope(ALLOC_SCENE);
+        if (options.parallelRecord) CreateDrawLists();
+        if (options.deferred && hasGLContext()) deferred.Create(windowWidth, windowHeight, lights.size());
+        if (options.clustered && !options.deferred && hasGLContext()) lightGrid.Create(lights.size());
+        if (options.depthPrepass && hasGLContext()) depthShader = new DepthShader();
+        if (options.shadows > 0 && hasGLContext()) shadows.Create(options.shadows, options.shadowSize);
+        if (options.transparent && hasGLContext()) transparency.Create(windowWidth, windowHeight);
+        // every object is drawn at most once per frame by the Phong program reading the blocks
+        if (options.streamBuffer && hasGLContext())
+            objectData.Create(objects.size() * sizeof(PhongStreamedShader::ObjectBlock) + sizeof(PhongStreamedShader::FrameBlock),
+                              objects.size() + 1);
+        if (options.indirect && hasGLContext()) {
+            if (indirectDrawsSupported()) {
+                indirect.Create(objects.size(), sizeof(PhongIndirectShader::DrawData));
+                indirectBatches.reserve(objects.size());
+            } else printf("Indirect draws need GL 4.3 or its multi-draw indirect and storage buffer extensions\n");
+        }
+        if (options.shadingRate > 1 && !options.deferred && !options.clustered && hasGLContext()) {
+            const unsigned int formats[] = { GL_RGBA16F, GL_RGBA16F, GL_RG32F };
+            int rate = options.shadingRate;
+            lightingTarget.Create((windowWidth + rate - 1) / rate, (windowHeight + rate - 1) / rate, 3, formats);
+        }
+        if (options.gpuCull && indirect.Created()) CreateGpuCulling();
+    }
+
+    // The pooled opaque objects of the forward pass are culled by the compute shader, sorted into batches of
+    // the same program and texture. Their meshes, materials and bounding spheres are uploaded once.
+    void CreateGpuCulling() {
+        if (!gpuCullingSupported()) {
+            printf("GPU culling needs GL 4.3 or the compute shader extension\n");
+            return;
+        }
+        if (lightGrid.Created() || lightingTarget.Created()) {
+            printf("GPU culling covers the forward pass, it is not used with clustered or reduced rate shading\n");
+            return;
+        }
+        RenderState forward;
+        for (Object * obj : objects) {
+            bool gpu = obj->geometry->Mesh() && !obj->Transparent() && obj->shader->IndirectProgram(forward) &&
+                       !(deferred.Created() && obj->shader->Deferred());
+            (gpu ? gpuCulledObjects : cpuCulledObjects).push_back(obj);
+        }
+        std::sort(gpuCulledObjects.begin(), gpuCulledObjects.end(), [&forward](Object * a, Object * b) {
+            Shader * pa = a->shader->IndirectProgram(forward), * pb = b->shader->IndirectProgram(forward);
+            if (pa != pb) return pa < pb;
+            return a->texture < b->texture;
+        });
+        std::vector<CullObject> cullObjects(gpuCulledObjects.size());
+        for (size_t i = 0; i < gpuCulledObjects.size(); i++) {
+            Object * obj = gpuCulledObjects[i];
+            GpuBatch batch = { obj->shader->IndirectProgram(forward), obj->texture };
+            if (gpuBatches.empty() || gpuBatches.back().program != batch.program || gpuBatches.back().texture != batch.texture) {
+                gpuBatches.push_back(batch);
+                cullObjects[i].first = (unsigned int)i;
+            }
+            else cullObjects[i].first = cullObjects[i - 1].first;
+            const Geometry& geometry = *obj->geometry;
+            const Material& material = *obj->material;
+            const MeshRange& mesh = *obj->geometry->Mesh();
+            cullObjects[i].sphere = vec4(geometry.center.x, geometry.center.y, geometry.center.z, geometry.radius);
+            cullObjects[i].kd = vec4(material.kd.x, material.kd.y, material.kd.z, 0);
+            cullObjects[i].ks = vec4(material.ks.x, material.ks.y, material.ks.z, material.shininess);
+            cullObjects[i].ka = vec4(material.ka.x, material.ka.y, material.ka.z, 0);
+            cullObjects[i].count = mesh.indexCount;
+            cullObjects[i].firstIndex = mesh.firstIndex;
+            cullObjects[i].baseVertex = (int)mesh.firstVertex;
+            cullObjects[i].batch = (unsigned int)gpuBatches.size() - 1;
+        }
+        gpuCulling.Create(cullObjects, (unsigned int)gpuBatches.size(), options.hiZ, windowWidth, windowHeight);
+        if (!gpuCulling.Created()) {
+            cpuCulledObjects = objects;
+            gpuCulledObjects.clear();
+            return;
+        }
+        printf("GPU culling: %d objects in %d batches, %d culled on the CPU\n",
+               (int)gpuCulledObjects.size(), (int)gpuBatches.size(), (int)cpuCulledObjects.size());
+    }
+
+    // Any thread may record every object of a frame, the lists never grow in the render loop
+    void CreateDrawLists() {
+        threadPackets.resize(workerPool.ThreadCount());
+        threadOrder.resize(workerPool.ThreadCount());
+        for (std::vector<DrawPacket>& packets : threadPackets) packets.reserve(objects.size());
+        for (std::vector<const DrawPacket *>& order : threadOrder) order.reserve(objects.size());
+        drawList.reserve(objects.size());
+        printf("Draw packets recorded on %d threads\n", workerPool.ThreadCount());
+    }
+
+    static Shader * CreateShader(const char * name) {
+        if (strcmp(name, "gouraud") == 0) return new GouraudShader();
+        if (strcmp(name, "npr") == 0) return new NPRShader();
+        if (strcmp(name, "phong") != 0) printf("Unknown shader %s, using phong\n", name);
+        return new PhongShader();
+    }
+
+    // Lamps on a jittered grid with random materials, textures and tessellation levels, reproducible from the seed
+    void BuildSynthetic(int nLamps, int nLights, int nTextures, const std::vector<int>& lodLevels, unsigned int seed) {
+        PROFILE_ZONE("Scene::BuildSynthetic");
+        AllocScope allocScope(ALLOC_SCENE);
+        std::mt19937 rng(seed);
+        auto uniform = [&rng](float lo, float hi) { return std::uniform_real_distribution<float>(lo, hi)(rng); };
+        auto pick = [&rng](size_t n) { return (size_t)std::uniform_int_distribution<int>(0, (int)n - 1)(rng); };
+
+        Shader * shader = CreateShader(options.shader);
+
+        std::vector<Material *> materials(4);
+        for (Material *& material : materials) {
+            material = new Material;
+            material->kd = vec3(uniform(0.2f, 0.9f), uniform(0.2f, 0.9f), uniform(0.2f, 0.9f));
+            material->ks = vec3(1, 1, 1) * uniform(0.2f, 1.5f);
+            material->ka = vec3(0.1f, 0.1f, 0.1f);
+            material->shininess = uniform(10, 100);
+        }
+
+        std::vector<Texture *> textures(nTextures > 0 ? nTextures : 1);
+        for (Texture *& texture : textures) texture = new CheckerBoardTexture(2 + (int)pick(31), 2 + (int)pick(31));
+
+        std::vector<LampParts *> lodParts;
+        for (int tessellation : lodLevels) lodParts.push_back(new LampParts(tessellation));
+
+        const float spacing = 8;
+        int side = (int)ceil(sqrt((float)nLamps));
+        float halfExtent = (side - 1) * spacing / 2;
+
+        Object * ground = new Object(shader, materials[0], textures[0], new Plane());
+        ground->scale = vec3(1, 1, 1) * fmax(16.0f, halfExtent + spacing);
+        ground->translation = vec3(0, -3.5, 0);
+        ground->rotationAxis = vec3(0, 1, 0);
+        objects.push_back(ground);
+
+        for (int i = 0; i < nLamps; i++) {
+            vec3 position((i % side) * spacing - halfExtent + uniform(-1, 1), 0, (i / side) * spacing - halfExtent + uniform(-1, 1));
+            Material * body = materials[pick(materials.size())], * head = materials[pick(materials.size())];
+            Texture * bodyTexture = textures[pick(textures.size())], * topTexture = textures[pick(textures.size())];
+            lamps.push_back(new Lamp(objects, *lodParts[pick(lodParts.size())], shader, body, head,
+                                     bodyTexture, topTexture, position, uniform(0, 2 * (float)M_PI)));
+        }
+        if (options.transparent) {
+            Texture * glass = new CheckerBoardTexture(15, 20, true);
+            for (Lamp * lamp : lamps) lamp->head->texture = glass;
+        }
+        visibleObjects.reserve(objects.size());
+        transparentObjects.reserve(objects.size());
+
+        camera.wLookat = vec3(0, 1, 0);
+        camera.wVup = vec3(0, 1, 0);
+        camera.bp = fmax(100.0f, 4 * halfExtent);
+        orbitEye = vec3(8 + halfExtent, 3 + halfExtent * 0.4f, 8 + halfExtent);
+        camera.wEye = orbitEye;
+
+        // the first light follows the head of the first lamp, the others hang above the grid with the light range
+        lights.resize(nLights > 0 ? nLights : 1);
+        lights[0].La = vec3(0.1f, 0.1f, 0.1f);
+        lights[0].Le = vec3(3, 3, 3);
+        for (size_t i = 1; i < lights.size(); i++) {
+            lights[i].wLightPos = vec4(uniform(-halfExtent, halfExtent), uniform(5, 10), uniform(-halfExtent, halfExtent), 1);
+            lights[i].La = vec3(0.02f, 0.02f, 0.02f);
+            lights[i].Le = vec3(uniform(0, 1), uniform(0, 1), uniform(0, 1));
+            lights[i].range = options.lightRange;
+        }
+        printf("Synthetic scene: %d lamps, %d objects, %d lights, %d textures, %d tessellation levels, seed %u\n",
+               nLamps, (int)objects.size(), (int)lights.size(), (int)textures.size(), (int)lodParts.size(), seed);
+    }
+
+    // Lamp arms follow each other, the first light sits in the first lamp head and the camera orbits the scene
+    void Update(float ttime) {
+        PROFILE_ZONE("Scene::Update");
+        time = ttime;
+        for (Lamp * lamp : lamps) lamp->Update(ttime);
+        if (!lamps.empty()) lights[0].wLightPos = lamps[0]->wHeadLight;
+        vec3 eye = orbitEye;
+        vec3 lookat = camera.wLookat;
+        ttime=ttime/2;
+        vec3 rotMat3 = vec3((eye.x - lookat.x) * cos(ttime) + (eye.z - lookat.z) * sin(ttime) + lookat.x,eye.y,-(eye.x - lookat.x) * sin(ttime) + (eye.z - lookat.z) * cos(ttime) + lookat.z);
+        camera.wEye =rotMat3;
+    }
+
+    void Cull() {
+        PROFILE_ZONE("Scene::Cull");
+        BenchScope scope(PHASE_CULL);
+        vec4 planes[6];
+        camera.FrustumPlanes(planes);
+        visibleObjects.clear();
+        transparentObjects.clear();
+        // the GPU culled objects get the transforms of the moving ones, the others are placed by the first update
+        for (size_t i = 0; i < gpuCulledObjects.size(); i++)
+            if (gpuCulledObjects[i]->dynamic || !gpuTransformsSet)
+                gpuCulledObjects[i]->SetModelingTransform(gpuCulling.transforms[i].M, gpuCulling.transforms[i].Minv);
+        gpuTransformsSet = true;
+        if (!threadPackets.empty()) {
+            RecordPackets(planes);
+            return;
+        }
+        for (Object * obj : gpuCulling.Created() ? cpuCulledObjects : objects)
+            if (obj->InFrustum(planes)) (obj->Transparent() ? transparentObjects : visibleObjects).push_back(obj);
+        // objects of the same shader form one batch, inside it the same texture and material follow each other
+        std::sort(visibleObjects.begin(), visibleObjects.end(), [](const Object * a, const Object * b) {
+            if (a->shader != b->shader) return a->shader < b->shader;
+            if (a->texture != b->texture) return a->texture < b->texture;
+            return a->material < b->material;
+        });
+    }
+
+    // Chunks of the objects are tested and recorded by the workers into the packets of their thread, each thread
+    // sorts its own packets, then the sorted lists are merged here
+    void RecordPackets(const vec4 planes[6]) {
+        PROFILE_ZONE("Scene::RecordPackets");
+        const std::vector<Object *>& candidates = gpuCulling.Created() ? cpuCulledObjects : objects;
+        const mat4 V = camera.V(), P = camera.P();
+        const int chunk = 64;
+        for (std::vector<DrawPacket>& packets : threadPackets) packets.clear();
+        auto record = [&](int c, int thread) {
+            std::vector<DrawPacket>& packets = threadPackets[thread];
+            size_t end = std::min(candidates.size(), (size_t)(c + 1) * chunk);
+            for (size_t i = (size_t)c * chunk; i < end; i++) {
+                packets.emplace_back();
+                if (!candidates[i]->Record(planes, V, P, (unsigned int)i, packets.back())) packets.pop_back();
+            }
+        };
+        workerPool.ParallelFor((int)((candidates.size() + chunk - 1) / chunk), record);
+        auto sort = [this](int t, int) {
+            std::vector<const DrawPacket *>& order = threadOrder[t];
+            order.clear();
+            for (const DrawPacket& packet : threadPackets[t]) order.push_back(&packet);
+            std::sort(order.begin(), order.end(), [](const DrawPacket * a, const DrawPacket * b) { return *a < *b; });
+        };
+        workerPool.ParallelFor((int)threadOrder.size(), sort);
+
+        drawList.clear();
+        size_t heads[WorkerPool::maxThreads] = {};
+        for (;;) {
+            int first = -1;
+            for (int t = 0; t < (int)threadOrder.size(); t++)
+                if (heads[t] < threadOrder[t].size() && (first < 0 || *threadOrder[t][heads[t]] < *threadOrder[first][heads[first]]))
+                    first = t;
+            if (first < 0) break;
+            drawList.push_back(threadOrder[first][heads[first]++]);
+        }
+        for (const DrawPacket * packet : drawList)
+            (packet->transparent ? transparentObjects : visibleObjects).push_back(packet->object);
+    }
+
+    // The i-th of the visible objects followed by the transparent ones, from its packet if they were recorded
+    Object * Visible(size_t i) {
+        return i < visibleObjects.size() ? visibleObjects[i] : transparentObjects[i - visibleObjects.size()];
+    }
+
+    void TransformVisible(RenderState& state, size_t i) {
+        if (threadPackets.empty()) Visible(i)->Transform(state);
+        else drawList[i]->Transform(state);
+    }
+
+    void DrawVisible(RenderState& state, size_t i, Shader * program = nullptr) {
+        if (threadPackets.empty()) Visible(i)->Draw(state, program);
+        else drawList[i]->Draw(state, program);
+    }
+
+    void DrawVisibleDepth(RenderState& state, size_t i, Shader * depthProgram) {
+        if (threadPackets.empty()) Visible(i)->DrawDepth(state, depthProgram);
+        else drawList[i]->DrawDepth(state, depthProgram);
     }
 
     void Render() {
+        Cull();
+        PROFILE_ZONE("Scene::Render");
+        BenchScope scope(PHASE_SUBMIT);
         RenderState state;
         state.wEye = camera.wEye;
         state.V = camera.V();
         state.P = camera.P();
-        state.lights = lights;
-        for (Object * obj : objects) obj->Draw(state);
+        state.lights = &lights;
+        if (objectData.Created()) {
+            objectData.Begin();
+            PhongStreamedShader::WriteFrame(objectData, lights, camera.wEye);
+            state.objectData = &objectData;
+        }
+        if (shadows.Created()) RenderShadows(state);
+        if (lightGrid.Created()) BinLights(state);
+        if (lightingTarget.Created()) RenderLighting(state);
+        if (deferred.Created()) RenderDeferred(state);
+        if (gpuCulling.Created()) {
+            GPU_SCOPE("GPU culling");
+            vec4 planes[6];
+            camera.FrustumPlanes(planes);
+            gpuCulling.Cull(state.V, state.P, planes, camera.fp);
+        }
+        if (depthShader) RenderDepth(state);
+        {
+            GPU_SCOPE("opaque pass");
+            if (options.overdraw) overdrawMeter.Begin();
+            if (gpuCulling.Created()) DrawGpuCulled(state, nullptr);
+            for (size_t i = 0; i < visibleObjects.size(); ) {
+                Shader * shader = visibleObjects[i]->shader;
+                bool skip = deferred.Created() && shader->Deferred();
+                GPU_SCOPE(shader->Name());
+                size_t end = i;
+                while (end < visibleObjects.size() && visibleObjects[end]->shader == shader) end++;
+                Shader * indirectProgram = indirect.Created() && !skip ? shader->IndirectProgram(state) : nullptr;
+                if (indirectProgram) DrawIndirect(state, indirectProgram, i, end);
+                else for (; i < end; i++) if (!skip) DrawVisible(state, i);
+                i = end;
+            }
+            if (options.overdraw) overdrawMeter.End();
+        }
+        if (depthShader) {
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+        }
+        if (gpuCulling.HiZ()) {
+            GPU_SCOPE("depth pyramid");
+            gpuCulling.UpdateHiZ(state.V, state.P);
+        }
+        if (transparency.Created()) RenderTransparent(state);
+        if (objectData.Created()) {
+            objectData.End();
+            if (benchmark.IsActive()) benchmark.AddCounter("stream buffer waits", objectData.waited ? 1 : 0);
+        }
+    }
+
+    // A multi-draw per batch of the compacted commands, with the indirect program of the override if there is one
+    void DrawGpuCulled(RenderState& state, Shader * program) {
+        PROFILE_ZONE("Scene::DrawGpuCulled");
+        GPU_SCOPE("GPU culled");
+        for (size_t i = 0; i < gpuBatches.size(); i++) {
+            state.texture = gpuBatches[i].texture;
+            (program ? program->IndirectProgram(state) : gpuBatches[i].program)->Bind(state);
+            gpuCulling.Draw((unsigned int)i, IndirectDraws::dataBinding);
+        }
+    }
+
+    // The pooled objects of the batch go into the command and data buffers, the runs of the same texture are
+    // drawn by one multi-draw each. The others, and the ones not fitting, are drawn one by one.
+    void DrawIndirect(RenderState& state, Shader * program, size_t begin, size_t end) {
+        PROFILE_ZONE("Scene::DrawIndirect");
+        indirect.Begin();
+        indirectBatches.clear();
+        for (size_t i = begin; i < end; i++) {
+            Object * obj = visibleObjects[i];
+            const MeshRange * mesh = obj->geometry->Mesh();
+            TransformVisible(state, i);
+            PhongIndirectShader::DrawData data = PhongStreamedShader::Block(state);
+            int index = mesh ? indirect.Add(*mesh, &data) : -1;
+            if (index < 0) {
+                DrawVisible(state, i);
+                continue;
+            }
+            if (indirectBatches.empty() || indirectBatches.back().texture != obj->texture)
+                indirectBatches.push_back(IndirectBatch{ obj->texture, (unsigned int)index, 0 });
+            indirectBatches.back().count++;
+        }
+        indirect.End();
+        for (const IndirectBatch& batch : indirectBatches) {
+            state.texture = batch.texture;
+            program->Bind(state);
+            indirect.Draw(batch.first, batch.count);
+        }
+    }
+
+    // After the opaque objects, every transparent one adds to the sums of its pixels, which are then blended
+    // over the frame, so the result does not depend on their order
+    void RenderTransparent(RenderState& state) {
+        GPU_SCOPE("transparent pass");
+        transparency.Begin();
+        for (size_t i = 0; i < transparentObjects.size(); i++) DrawVisible(state, visibleObjects.size() + i, transparency.shader);
+        transparency.Resolve();
+    }
+
+    // The depth of the opaque pass is laid down without color, the shading programs then run only for the
+    // fragments of equal depth, which are the visible ones
+    void RenderDepth(RenderState& state) {
+        GPU_SCOPE("depth pre-pass");
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        for (size_t i = 0; i < visibleObjects.size(); i++)
+            if (!(deferred.Created() && visibleObjects[i]->shader->Deferred())) DrawVisibleDepth(state, i, depthShader);
+        if (gpuCulling.Created()) DrawGpuCulled(state, depthShader);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+    }
+
+    // Deferred objects fill the G-buffer, their lights and ambient term are composited into the frame with
+    // its depth, so the forward objects are drawn over them. The G-buffer is single sampled, MSAA only
+    // smooths the forward objects.
+    void RenderDeferred(RenderState& state) {
+        {
+            GPU_SCOPE("G-buffer pass");
+            deferred.BeginGeometry();
+            for (size_t i = 0; i < visibleObjects.size(); i++)
+                if (visibleObjects[i]->shader->Deferred()) DrawVisible(state, i, deferred.gBufferShader);
+        }
+        deferred.Shade(lights, camera);
+    }
+
+    // Every object casts shadows, also those outside of the view frustum
+    void RenderShadows(RenderState& state) {
+        {
+            GPU_SCOPE("shadow maps");
+            shadows.Render(lights, objects, camera.bp, state);
+        }
+        state.V = camera.V();
+        state.P = camera.P();
+        state.shadows = &shadows.maps;
+    }
+
+    // The froxels of the current camera get the lights touching them, the clustered program reads the lists
+    void BinLights(RenderState& state) {
+        PROFILE_ZONE("Scene::BinLights");
+        lightGrid.Begin(windowWidth, windowHeight, state.V, state.P, camera.fp, camera.bp);
+        for (const Light& light : lights) lightGrid.AddLight(light.wLightPos, light.Le, light.range);
+        lightGrid.End();
+        state.lightGrid = &lightGrid;
+    }
+
+    // Objects of reduced rate lighting are drawn into the lighting buffer first, the opaque pass then upsamples it
+    void RenderLighting(RenderState& state) {
+        GPU_SCOPE("lighting pass");
+        lightingTarget.Bind();
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        state.pass = PASS_LIGHTING;
+        for (size_t i = 0; i < visibleObjects.size(); i++) if (visibleObjects[i]->shader->ReducedRateLighting()) DrawVisible(state, i);
+        bindDefaultFramebuffer();
+        state.pass = PASS_RESOLVE;
+        state.lighting = &lightingTarget;
+    }
+
+    // Without a GL context the same frame is rasterized on the CPU
+    void RenderSoftware() {
+        Cull();
+        PROFILE_ZONE("Scene::RenderSoftware");
+        BenchScope scope(PHASE_SUBMIT);
+        RenderState state;
+        state.V = camera.V();
+        state.P = camera.P();
+        softRasterizer.Begin(windowWidth, windowHeight, vec4(0.5f, 0.5f, 0.8f, 1.0f), camera.wEye);
+        for (size_t i = 0; i < lights.size() && i < maxShaderLights; i++)
+            softRasterizer.AddLight(lights[i].La, lights[i].Le, lights[i].wLightPos, lights[i].range);
+        for (Object * obj : visibleObjects) obj->DrawSoftware(state);
+        for (Object * obj : transparentObjects) obj->DrawSoftware(state);  // opaque, there is no blending
+        softRasterizer.End();
+    }
+
+    // Every object is traced, also those outside of the frustum cast shadows. While the animation time stands
+    // still, the samples of the frames are accumulated.
+    void RenderRayTraced() {
+        PROFILE_ZONE("Scene::RenderRayTraced");
+        BenchScope scope(PHASE_SUBMIT);
+        RenderState state;
+        state.V = camera.V();
+        state.P = camera.P();
+        vec3 forward, right, up;
+        camera.RayBasis(forward, right, up);
+        rayTracer.Begin(windowWidth, windowHeight, vec4(0.5f, 0.5f, 0.8f, 1.0f), camera.wEye, forward, right, up,
+                        camera.fp, camera.bp, time != tracedTime);
+        tracedTime = time;
+        for (const Light& light : lights) rayTracer.AddLight(light.La, light.Le, light.wLightPos, light.range);
+        for (Object * obj : objects) obj->Trace(state);
+        rayTracer.End();
     }
 
     void Animate(float tstart, float tend) {
@@ -718,75 +3141,33 @@ Scene scene;
 
 // Initialization, create an OpenGL context
 void onInitialization() {
-    glViewport(0, 0, windowWidth, windowHeight);
-    glEnable(GL_DEPTH_TEST);
-    glDisable(GL_CULL_FACE);
-    scene.Build();
+    scene.camera.asp = (float)windowWidth / windowHeight;   // the scene was constructed before the options were read
+    if (hasGLContext()) {
+        glViewport(0, 0, windowWidth, windowHeight);
+        glEnable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+    }
+    if (options.lamps > 0) scene.BuildSynthetic(options.lamps, options.lights, options.textures, options.lodLevels, options.seed);
+    else scene.Build();
+    scene.CreateRenderTargets();
 }
 
 // Window has become invalid: Redraw
 void onDisplay() {
-    glClearColor(0.5f, 0.5f, 0.8f, 1.0f);							// background color
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
-    scene.Render();
-    glutSwapBuffers();
-    // exchange the two buffers
-    float ttime = glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
-    mat4 M, Minv;
-    vec4 temp;
-    scene.objects[0]->translation = vec3(0, -3.5, 0);
-    scene.objects[0]->rotationAxis = vec3(0, 1, 0);
-
-    scene.objects[1]->rotationAngle = 0.0f;
-    scene.objects[1]->rotationAxis = vec3(0, 1, 0);
-    scene.objects[1]->translation = vec3(0, -3.5, 0);
-
-
-    scene.objects[2]->rotationAngle = 0.0f;
-    scene.objects[2]->rotationAxis = vec3(0, 1, 0);
-    scene.objects[2]->translation = vec3(0, -3, 0);
-
-
-    scene.objects[3]->rotationAngle =0.0f;
-    scene.objects[3]->rotationAxis = vec3(0, 1, 0);
-    scene.objects[3]->translation = vec3(0, -3, 0);
-    scene.objects[3]->SetModelingTransform( M, Minv);
-
-    temp = vec4(0, 0, 0, 1) * M;
-    scene.objects[4]->rotationAngle = ttime;
-    scene.objects[4]->rotationAxis =vec3(0.3,1,0.3);
-    scene.objects[4]->translation = vec3(temp.x, temp.y, temp.z);
-    scene.objects[4]->SetModelingTransform( M, Minv);
-
-    temp = vec4(0, 1, 0, 1) * M;
-    scene.objects[5]->rotationAngle = 0.0f;
-    scene.objects[5]->rotationAxis = vec3(0, 1, 0);
-    scene.objects[5]->translation = vec3(temp.x, temp.y, temp.z);
-    scene.objects[5]->SetModelingTransform( M, Minv);
-
-    temp = vec4(0, 0, 0, 1) * M;
-    scene.objects[6]->rotationAngle = ttime;
-    scene.objects[6]->rotationAxis = vec3(-0.5,1,-0.5);
-    scene.objects[6]->translation =  vec3(temp.x, temp.y, temp.z);
-    scene.objects[6]->SetModelingTransform( M, Minv);
-
-    temp = vec4(0, 1, 0, 1) * M;
-    scene.objects[7]->rotationAngle = 0.0f;
-    scene.objects[7]->rotationAxis = vec3(0, 1, 0);
-    scene.objects[7]->translation = vec3(temp.x, temp.y, temp.z);
-
-    scene.objects[8]->rotationAngle = ttime;
-    scene.objects[8]->rotationAxis = vec3(-0.3,0.5,-0.1);
-    scene.objects[8]->translation = vec3(temp.x, temp.y, temp.z);
-    scene.objects[8]->SetModelingTransform( M, Minv);
-    temp = vec4(0, 0.6, 0, 1) * M;
-    scene.lights[0].wLightPos = vec4(temp.x, temp.y, temp.z,1);
-    vec3 eye = vec3(8, 3, 8);
-    vec3 lookat = vec3(0, 1, 0);
-    ttime=ttime/2;
-    vec3 rotMat3 = vec3((eye.x - lookat.x) * cos(ttime) + (eye.z - lookat.z) * sin(ttime) + lookat.x,eye.y,-(eye.x - lookat.x) * sin(ttime) + (eye.z - lookat.z) * cos(ttime) + lookat.z);
-    scene.camera.wEye =rotMat3;
-
+    AllocScope allocScope(ALLOC_RENDER_LOOP);
+    {
+        BenchScope scope(PHASE_UPDATE);
+        scene.Update(getElapsedTime());
+    }
+    if (options.raytrace) scene.RenderRayTraced();
+    else if (!hasGLContext()) scene.RenderSoftware();
+    else {
+        glClearColor(0.5f, 0.5f, 0.8f, 1.0f);							// background color
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
+        commandRecorder.Clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, 0.5f, 0.5f, 0.8f, 1.0f);
+        scene.Render();
+    }
+    swapBuffers();
 }
 
 // Key of ASCII code pressed
@@ -807,11 +3188,13 @@ void onIdle() {
     static float tend = 0;
     const float dt = 0.1f; // dt is infinitesimal
     float tstart = tend;
-    tend = glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
+    tend = getElapsedTime();
 
+    AllocScope allocScope(ALLOC_RENDER_LOOP);
+    BenchScope scope(PHASE_UPDATE);
     for (float t = tstart; t < tend; t += dt) {
         float Dt = fmin(dt, tend - t);
         scene.Animate(t, t + Dt);
     }
-    glutPostRedisplay();
+    postRedisplay();
 }
\ No newline at end of file
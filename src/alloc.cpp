@@ -0,0 +1,82 @@
+//=============================================================================================
+// Allocation tracking: replacement of the global operator new/delete with per-tag counters
+//=============================================================================================
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include "alloc.h"
+
+//---------------------------
+struct AllocCounters {
+//---------------------------
+	std::atomic<size_t> count{ 0 }, liveBytes{ 0 }, peakBytes{ 0 };
+};
+
+static AllocCounters counters[ALLOC_TAG_COUNT];
+static thread_local AllocTag threadTag = ALLOC_OTHER;
+
+// Every block starts with its size and tag, so that delete can charge the right counter
+static const size_t headerSize = 16;	// keeps the alignment of malloc
+
+static const char * tagNames[ALLOC_TAG_COUNT] = { "other", "scene", "geometry", "textures", "render loop", "tools" };
+
+const char * allocTagName(AllocTag tag) { return tagNames[tag]; }
+
+AllocTag allocSetTag(AllocTag tag) {
+	AllocTag previous = threadTag;
+	threadTag = tag;
+	return previous;
+}
+
+size_t allocCount(AllocTag tag) { return counters[tag].count.load(std::memory_order_relaxed); }
+size_t allocLiveBytes(AllocTag tag) { return counters[tag].liveBytes.load(std::memory_order_relaxed); }
+size_t allocPeakBytes(AllocTag tag) { return counters[tag].peakBytes.load(std::memory_order_relaxed); }
+
+size_t allocCountExceptTools() {
+	size_t total = 0;
+	for (int tag = 0; tag < ALLOC_TAG_COUNT; tag++) if (tag != ALLOC_TOOLS) total += allocCount((AllocTag)tag);
+	return total;
+}
+
+static void * trackedAlloc(size_t size) {
+	unsigned char * block = (unsigned char *)malloc(size + headerSize);
+	if (!block) return nullptr;
+	AllocTag tag = threadTag;
+	*(size_t *)block = size;
+	*(AllocTag *)(block + sizeof(size_t)) = tag;
+	AllocCounters& c = counters[tag];
+	c.count.fetch_add(1, std::memory_order_relaxed);
+	size_t live = c.liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+	size_t peak = c.peakBytes.load(std::memory_order_relaxed);
+	while (live > peak && !c.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) { }
+	return block + headerSize;
+}
+
+static void trackedFree(void * p) {
+	if (!p) return;
+	unsigned char * block = (unsigned char *)p - headerSize;
+	AllocTag tag = *(AllocTag *)(block + sizeof(size_t));
+	counters[tag].liveBytes.fetch_sub(*(size_t *)block, std::memory_order_relaxed);
+	free(block);
+}
+
+void * operator new(size_t size) {
+	void * p = trackedAlloc(size);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void * operator new[](size_t size) {
+	void * p = trackedAlloc(size);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void * operator new(size_t size, const std::nothrow_t&) noexcept { return trackedAlloc(size); }
+void * operator new[](size_t size, const std::nothrow_t&) noexcept { return trackedAlloc(size); }
+void operator delete(void * p) noexcept { trackedFree(p); }
+void operator delete[](void * p) noexcept { trackedFree(p); }
+void operator delete(void * p, size_t) noexcept { trackedFree(p); }
+void operator delete[](void * p, size_t) noexcept { trackedFree(p); }
+void operator delete(void * p, const std::nothrow_t&) noexcept { trackedFree(p); }
+void operator delete[](void * p, const std::nothrow_t&) noexcept { trackedFree(p); }
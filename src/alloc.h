@@ -0,0 +1,24 @@
+//=============================================================================================
+// Allocation tracking: the global operator new counts allocations and live bytes per subsystem tag
+//=============================================================================================
+#pragma once
+#include <stddef.h>
+
+// Allocations are charged to the innermost AllocScope of the allocating thread
+enum AllocTag { ALLOC_OTHER, ALLOC_SCENE, ALLOC_GEOMETRY, ALLOC_TEXTURES, ALLOC_RENDER_LOOP, ALLOC_TOOLS, ALLOC_TAG_COUNT };
+
+const char * allocTagName(AllocTag tag);
+AllocTag allocSetTag(AllocTag tag);		// returns the previous tag of the thread
+size_t allocCount(AllocTag tag);		// allocations so far
+size_t allocLiveBytes(AllocTag tag);	// requested bytes not freed yet
+size_t allocPeakBytes(AllocTag tag);
+size_t allocCountExceptTools();			// all allocations but those of the measurement tools (ALLOC_TOOLS)
+
+//---------------------------
+class AllocScope {
+//---------------------------
+	AllocTag previous;
+public:
+	AllocScope(AllocTag tag) : previous(allocSetTag(tag)) { }
+	~AllocScope() { allocSetTag(previous); }
+};
@@ -0,0 +1,146 @@
+//=============================================================================================
+// Frame benchmark: CPU time per frame phase, GPU time per scope and allocations, percentile report
+//=============================================================================================
+#include "framework.h"
+#include "bench.h"
+#include "gputimer.h"
+#include "alloc.h"
+#include "options.h"
+#include <algorithm>
+#include <string.h>
+
+Benchmark benchmark;
+
+static const char * phaseNames[PHASE_COUNT] = { "update", "cull", "submit" };
+
+//---------------------------
+struct Percentiles {
+//---------------------------
+	double mean = 0, p50 = 0, p95 = 0, p99 = 0, max = 0;
+
+	Percentiles(std::vector<double> samples) { // nearest-rank percentiles
+		if (samples.empty()) return;
+		std::sort(samples.begin(), samples.end());
+		for (double s : samples) mean += s;
+		mean /= samples.size();
+		p50 = rank(samples, 50); p95 = rank(samples, 95); p99 = rank(samples, 99);
+		max = samples.back();
+	}
+
+	static double rank(const std::vector<double>& sorted, double p) {
+		size_t idx = (size_t)ceil(p / 100.0 * sorted.size());
+		return sorted[idx > 0 ? idx - 1 : 0];
+	}
+
+	void print(const char * name) const {
+		printf("%-24s %9.3f %9.3f %9.3f %9.3f %9.3f\n", name, mean, p50, p95, p99, max);
+	}
+
+	void writeJson(FILE * file, const char * name, bool last) const {
+		fprintf(file, "    \"%s\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f }%s\n",
+			name, mean, p50, p95, p99, max, last ? "" : ",");
+	}
+};
+
+void Benchmark::Start(int _nFrames) {
+	active = true;
+	nFrames = _nFrames;
+	for (int p = 0; p < PHASE_COUNT; p++) cpuPhase[p].reserve(nFrames);
+	cpuFrame.reserve(nFrames);
+	allocations.reserve(nFrames);
+	gpuScopes.reserve(64);
+	counters.reserve(16);
+}
+
+void Benchmark::BeginFrame(bool measured) {
+	measuring = active && measured && (int)cpuFrame.size() < nFrames;
+	if (!measuring) return;
+	for (int p = 0; p < PHASE_COUNT; p++) phaseTime[p] = 0;
+	frameStart = std::chrono::steady_clock::now();
+	frameAllocStart = allocCountExceptTools();
+}
+
+void Benchmark::AddGPUTime(const char * scope, double ms, bool measured) {
+	for (Series& series : gpuScopes) {
+		if (strcmp(series.name, scope) == 0) {
+			if (measured) series.samples.push_back(ms);
+			return;
+		}
+	}
+	gpuScopes.push_back(Series{ scope, std::vector<double>() });	// scopes seen first in a measured frame allocate
+	gpuScopes.back().samples.reserve(nFrames);
+	if (measured) gpuScopes.back().samples.push_back(ms);
+}
+
+void Benchmark::AddCounter(const char * name, double value, bool measured) {
+	for (Series& series : counters) {
+		if (strcmp(series.name, name) == 0) {
+			if (measured) series.samples.push_back(value);
+			return;
+		}
+	}
+	counters.push_back(Series{ name, std::vector<double>() });
+	counters.back().samples.reserve(nFrames);
+	if (measured) counters.back().samples.push_back(value);
+}
+
+void Benchmark::EndFrame() {
+	if (!measuring) return;
+	allocations.push_back((double)(allocCountExceptTools() - frameAllocStart));
+	cpuFrame.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+	for (int p = 0; p < PHASE_COUNT; p++) cpuPhase[p].push_back(phaseTime[p]);
+	measuring = false;
+}
+
+bool Benchmark::Report(const char * jsonPath) {
+	printf("\n%d measured frames, times in ms\n", (int)cpuFrame.size());
+	printf("%-24s %9s %9s %9s %9s %9s\n", "phase", "mean", "p50", "p95", "p99", "max");
+	for (int p = 0; p < PHASE_COUNT; p++) Percentiles(cpuPhase[p]).print(phaseNames[p]);
+	Percentiles(cpuFrame).print("cpu frame");
+	for (const Series& series : gpuScopes) {
+		char name[64];
+		snprintf(name, sizeof(name), "gpu %s", series.name);
+		Percentiles(series.samples).print(name);
+	}
+	if (gpuTimer.nStalls > 0) printf("GPU timer readback waited for the GPU %d times\n", gpuTimer.nStalls);
+	Percentiles(allocations).print("allocations");
+	for (const Series& series : counters) Percentiles(series.samples).print(series.name);
+
+	printf("\n%-24s %12s %12s %12s\n", "CPU memory", "allocations", "live KB", "peak KB");
+	for (int tag = 0; tag < ALLOC_TAG_COUNT; tag++)
+		printf("%-24s %12zu %12.1f %12.1f\n", allocTagName((AllocTag)tag), allocCount((AllocTag)tag),
+			allocLiveBytes((AllocTag)tag) / 1024.0, allocPeakBytes((AllocTag)tag) / 1024.0);
+
+	size_t steadyAllocations = 0;
+	for (double n : allocations) steadyAllocations += (size_t)n;
+	bool passed = steadyAllocations == 0;
+	if (!passed) printf("FAILED: %zu allocations in the measured frames, the render loop must not allocate\n", steadyAllocations);
+
+	if (!jsonPath || !jsonPath[0]) return passed;
+	FILE * file = fopen(jsonPath, "w");
+	if (!file) {
+		printf("%s cannot be written\n", jsonPath);
+		return passed;
+	}
+	fprintf(file, "{\n  \"renderer\": \"%s\",\n  \"frames\": %d,\n  \"unit\": \"ms\",\n  \"cpu\": {\n",
+		hasGLContext() ? (const char *)glGetString(GL_RENDERER) : options.raytrace ? "ray tracer" : "software rasterizer", (int)cpuFrame.size());
+	for (int p = 0; p < PHASE_COUNT; p++) Percentiles(cpuPhase[p]).writeJson(file, phaseNames[p], false);
+	Percentiles(cpuFrame).writeJson(file, "frame", true);
+	fprintf(file, "  },\n  \"gpu\": {\n");
+	for (size_t i = 0; i < gpuScopes.size(); i++)
+		Percentiles(gpuScopes[i].samples).writeJson(file, gpuScopes[i].name, i + 1 == gpuScopes.size());
+	fprintf(file, "  },\n  \"allocations\": {\n    \"steady_state\": %zu,\n", steadyAllocations);
+	Percentiles(allocations).writeJson(file, "per_frame", true);
+	fprintf(file, "  },\n  \"counters\": {\n");
+	for (size_t i = 0; i < counters.size(); i++)
+		Percentiles(counters[i].samples).writeJson(file, counters[i].name, i + 1 == counters.size());
+	fprintf(file, "  },\n  \"memory\": {\n");
+	for (int tag = 0; tag < ALLOC_TAG_COUNT; tag++)
+		fprintf(file, "    \"%s\": { \"allocations\": %zu, \"live_bytes\": %zu, \"peak_bytes\": %zu }%s\n",
+			allocTagName((AllocTag)tag), allocCount((AllocTag)tag), allocLiveBytes((AllocTag)tag),
+			allocPeakBytes((AllocTag)tag), tag + 1 == ALLOC_TAG_COUNT ? "" : ",");
+	fprintf(file, "  }\n}\n");
+	fclose(file);
+	printf("Benchmark results written to %s\n", jsonPath);
+	return passed;
+}
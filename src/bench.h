@@ -0,0 +1,54 @@
+//=============================================================================================
+// Frame benchmark: CPU time per frame phase, GPU time per scope and allocations, percentile report
+//=============================================================================================
+#pragma once
+#include <vector>
+#include <chrono>
+
+enum BenchPhase { PHASE_UPDATE, PHASE_CULL, PHASE_SUBMIT, PHASE_COUNT };
+
+//---------------------------
+class Benchmark {
+//---------------------------
+	struct Series {
+		const char * name;
+		std::vector<double> samples;
+	};
+	std::vector<double> cpuPhase[PHASE_COUNT], cpuFrame;	// samples in milliseconds
+	std::vector<Series> gpuScopes;				// per named GPU scope, arriving a few frames late from the GPU timer
+	std::vector<double> allocations;			// operator new calls per frame, the tools excluded
+	std::vector<Series> counters;				// per named counter of the renderers, e.g. rays per second
+	size_t frameAllocStart = 0;
+	double phaseTime[PHASE_COUNT];				// accumulated in the current frame
+	std::chrono::steady_clock::time_point frameStart;
+	int nFrames = 0;
+	bool active = false, measuring = false;
+public:
+	void Start(int _nFrames);					// reserves the sample arrays, nothing is allocated while measuring
+	void BeginFrame(bool measured);				// warm-up frames are rendered but not measured
+	void EndFrame();
+	void AddPhaseTime(BenchPhase phase, double ms) { if (measuring) phaseTime[phase] += ms; }
+	void AddGPUTime(const char * scope, double ms, bool measured);	// warm-up frames only create the scope
+	void AddCounter(const char * name, double value) { AddCounter(name, value, measuring); }	// warm-up frames only create the counter
+	void AddCounter(const char * name, double value, bool measured);	// of an earlier frame, read back from the GPU
+	bool IsActive() const { return active; }
+	bool IsMeasuring() const { return measuring; }
+	// Prints mean/p50/p95/p99/max of every phase and writes the same as JSON if a path is given,
+	// fails if any measured frame allocated
+	bool Report(const char * jsonPath);
+};
+
+extern Benchmark benchmark;
+
+//---------------------------
+class BenchScope { // CPU time spent in the scope is added to the phase of the current frame
+//---------------------------
+	BenchPhase phase;
+	std::chrono::steady_clock::time_point start;
+public:
+	BenchScope(BenchPhase _phase) : phase(_phase) { if (benchmark.IsActive()) start = std::chrono::steady_clock::now(); }
+	~BenchScope() {
+		if (benchmark.IsActive())
+			benchmark.AddPhaseTime(phase, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+};
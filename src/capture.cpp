@@ -0,0 +1,155 @@
+//=============================================================================================
+// Deterministic frame capture: asynchronous PBO readback, BMP output and golden image comparison
+//=============================================================================================
+#include "framework.h"
+#include "options.h"
+#include "capture.h"
+
+FrameCapture frameCapture;
+
+// 24 bit BMP with bottom-up rows, the order glReadPixels delivers
+static bool writeBMP(const char * path, int width, int height, const unsigned char * bgra) {
+	FILE * file = fopen(path, "wb");
+	if (!file) {
+		printf("%s cannot be written\n", path);
+		return false;
+	}
+	int rowSize = (width * 3 + 3) & ~3;
+	unsigned int imageSize = rowSize * height, fileSize = 54 + imageSize;
+	unsigned char header[54] = { 'B', 'M' };
+	auto put32 = [&header](int offset, unsigned int v) { for (int i = 0; i < 4; i++) header[offset + i] = (v >> (8 * i)) & 0xFF; };
+	put32(2, fileSize); put32(10, 54); put32(14, 40); put32(18, width); put32(22, height);
+	header[26] = 1; header[28] = 24;
+	put32(34, imageSize);
+	fwrite(header, 1, 54, file);
+	std::vector<unsigned char> row(rowSize, 0);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) for (int c = 0; c < 3; c++) row[x * 3 + c] = bgra[(y * width + x) * 4 + c];
+		fwrite(&row[0], 1, rowSize, file);
+	}
+	fclose(file);
+	return true;
+}
+
+// Reads a 24 bit BMP of the expected size into BGRA
+static bool readBMP(const char * path, int width, int height, std::vector<unsigned char>& bgra) {
+	FILE * file = fopen(path, "rb");
+	if (!file) return false;
+	unsigned char header[54];
+	bool ok = fread(header, 1, 54, file) == 54 && header[0] == 'B' && header[1] == 'M' && header[28] == 24;
+	auto get32 = [&header](int offset) { return header[offset] | header[offset + 1] << 8 | header[offset + 2] << 16 | header[offset + 3] << 24; };
+	ok = ok && get32(18) == width && get32(22) == height;
+	if (ok) {
+		fseek(file, get32(10), SEEK_SET);
+		int rowSize = (width * 3 + 3) & ~3;
+		std::vector<unsigned char> row(rowSize);
+		bgra.resize(width * height * 4);
+		for (int y = 0; y < height && ok; y++) {
+			ok = fread(&row[0], 1, rowSize, file) == (size_t)rowSize;
+			for (int x = 0; x < width; x++) {
+				for (int c = 0; c < 3; c++) bgra[(y * width + x) * 4 + c] = row[x * 3 + c];
+				bgra[(y * width + x) * 4 + 3] = 255;
+			}
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+void FrameCapture::Start(int _width, int _height) {
+	width = _width; height = _height;
+	for (int i = 0; i < nPBOs; i++) pboFrame[i] = -1;
+	if (!hasGLContext()) return;
+	glGenBuffers(nPBOs, pbos);
+	for (int i = 0; i < nPBOs; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void FrameCapture::Capture(const unsigned char * cpuPixels) {
+	if (!IsActive()) return;
+	int frame = frameIndex++;
+	if (frame % options.captureEvery != 0) return;
+	if (cpuPixels) {
+		process(frame, cpuPixels);
+		return;
+	}
+
+	// the PBO about to be reused holds the oldest readback, by now the GPU is done with it
+	if (pboFrame[next] >= 0) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[next]);
+		const unsigned char * pixels = (const unsigned char *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if (pixels) process(pboFrame[next], pixels);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[next]);
+	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);	// returns at once, copy lands in the PBO
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	pboFrame[next] = frame;
+	next = (next + 1) % nPBOs;
+}
+
+void FrameCapture::Finish() {
+	if (!IsActive()) return;
+	for (int i = 0; i < nPBOs; i++) {
+		int slot = (next + i) % nPBOs;	// oldest first
+		if (pboFrame[slot] < 0) continue;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+		const unsigned char * pixels = (const unsigned char *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if (pixels) process(pboFrame[slot], pixels);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		pboFrame[slot] = -1;
+	}
+	if (pbos[0] > 0) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		glDeleteBuffers(nPBOs, pbos);
+	}
+	width = height = 0;
+	if (options.goldenDir) printf("Golden image comparison: %d of %d frames differ\n", nFailed, nCompared);
+}
+
+void FrameCapture::process(int frame, const unsigned char * bgra) {
+	char path[1024];
+	if (options.captureDir) {
+		snprintf(path, sizeof(path), "%s/frame_%04d.bmp", options.captureDir, frame);
+		writeBMP(path, width, height, bgra);
+	}
+	if (!options.goldenDir) return;
+
+	snprintf(path, sizeof(path), "%s/frame_%04d.bmp", options.goldenDir, frame);
+	nCompared++;
+	if (!readBMP(path, width, height, golden)) {
+		printf("Frame %d: golden image %s is missing or has a different size\n", frame, path);
+		nFailed++;
+		return;
+	}
+	// root mean square error over all channels plus the share of visibly changed pixels
+	double sumSquared = 0;
+	int nChanged = 0, maxDiff = 0;
+	diff.resize(width * height * 4);
+	for (int i = 0; i < width * height; i++) {
+		int pixelDiff = 0;
+		for (int c = 0; c < 3; c++) {
+			int d = abs((int)bgra[i * 4 + c] - (int)golden[i * 4 + c]);
+			sumSquared += d * d;
+			if (d > pixelDiff) pixelDiff = d;
+		}
+		if (pixelDiff > options.pixelThreshold) nChanged++;
+		if (pixelDiff > maxDiff) maxDiff = pixelDiff;
+		unsigned char shade = (unsigned char)(pixelDiff * 4 > 255 ? 255 : pixelDiff * 4);
+		diff[i * 4] = diff[i * 4 + 1] = 0; diff[i * 4 + 2] = shade;	// differences in red
+	}
+	double rmse = sqrt(sumSquared / (width * height * 3));
+	double changed = 100.0 * nChanged / (width * height);
+	bool failed = rmse > options.tolerance;
+	if (failed) {
+		nFailed++;
+		if (options.captureDir) {
+			snprintf(path, sizeof(path), "%s/frame_%04d_diff.bmp", options.captureDir, frame);
+			writeBMP(path, width, height, &diff[0]);
+		}
+	}
+	printf("Frame %d: rmse %.3f, max %d, changed pixels %.2f%% %s\n", frame, rmse, maxDiff, changed, failed ? "FAILED" : "ok");
+}
@@ -0,0 +1,28 @@
+//=============================================================================================
+// Deterministic frame capture: asynchronous PBO readback, BMP output and golden image comparison
+//=============================================================================================
+#pragma once
+#include <vector>
+
+//---------------------------
+class FrameCapture {
+//---------------------------
+	static const int nPBOs = 3;		// a frame is mapped nPBOs captured frames after its readback was issued
+	unsigned int pbos[nPBOs] = { 0, 0, 0 };
+	int pboFrame[nPBOs];			// frame index waiting in the PBO, -1 if empty
+	int width = 0, height = 0, frameIndex = 0, next = 0;
+	std::vector<unsigned char> golden, diff;	// reused for every compared frame
+
+	void process(int frame, const unsigned char * bgra);
+public:
+	int nCompared = 0, nFailed = 0;
+
+	void Start(int _width, int _height);
+	// Issues the readback of the current frame and writes the one issued nPBOs captures ago;
+	// a frame rendered on the CPU is given by its pixels and written at once
+	void Capture(const unsigned char * cpuPixels = nullptr);
+	void Finish();		// drains the frames still in flight
+	bool IsActive() const { return width > 0; }
+};
+
+extern FrameCapture frameCapture;
@@ -0,0 +1,200 @@
+//=============================================================================================
+// Command stream: binary log of the draw commands of each frame, recorder and replayer
+//=============================================================================================
+#include "framework.h"
+#include "cmdstream.h"
+#include "bench.h"
+#include <string.h>
+
+CommandRecorder commandRecorder;
+CommandReplayer commandReplayer;
+
+static const char logMagic[4] = { 'G', 'L', 'C', 'S' };
+static const unsigned int logVersion = 1;
+static const long frameCountOffset = 16;	// of the frame count in the header
+
+bool CommandRecorder::Open(const char * path, int width, int height) {
+	file = fopen(path, "wb");
+	if (!file) {
+		printf("%s cannot be written\n", path);
+		return false;
+	}
+	unsigned int header[4] = { logVersion, (unsigned int)width, (unsigned int)height, 0 };
+	fwrite(logMagic, 1, sizeof(logMagic), file);
+	fwrite(header, sizeof(unsigned int), 4, file);
+	frame.reserve(64 * 1024);
+	return true;
+}
+
+void CommandRecorder::EndFrame() {
+	if (!recording) return;
+	unsigned int size = (unsigned int)frame.size();
+	fwrite(&size, sizeof(size), 1, file);
+	if (size > 0) fwrite(&frame[0], 1, size, file);
+	frame.clear();		// keeps the capacity, the next frame does not allocate
+	nFrames++;
+	recording = false;
+}
+
+void CommandRecorder::Close() {
+	if (!file) return;
+	fseek(file, frameCountOffset, SEEK_SET);
+	fwrite(&nFrames, sizeof(nFrames), 1, file);
+	fclose(file);
+	file = nullptr;
+	recording = false;
+	printf("%u frames of draw commands recorded\n", nFrames);
+}
+
+// Reads the 32 bit values of a command payload
+static const unsigned char * get(const unsigned char * p, void * data, size_t size) {
+	memcpy(data, p, size);
+	return p + size;
+}
+
+// 0 for an unknown command or uniform type, a uniform command must have its type byte in the log
+static size_t payloadSize(const unsigned char * command) {
+	switch (command[0]) {
+	case CMD_CLEAR:			return 5 * 4;
+	case CMD_PROGRAM:		return 4;
+	case CMD_UNIFORM:		return command[5] <= UNIFORM_MAT4 ? 4 + 1 + uniformSize((UniformType)command[5]) * 4 : 0;
+	case CMD_TEXTURE:		return 3 * 4;
+	case CMD_VERTEX_ARRAY:	return 4;
+	case CMD_DRAW_ARRAYS:	return 3 * 4;
+	case CMD_DRAW_ELEMENTS:	return 4 * 4;
+	default:				return 0;
+	}
+}
+
+bool CommandReplayer::Load(const char * path, int width, int height) {
+	FILE * file = fopen(path, "rb");
+	if (!file) {
+		printf("%s cannot be read\n", path);
+		return false;
+	}
+	char magic[4];
+	unsigned int header[4];
+	bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, logMagic, 4) == 0 &&
+		fread(header, sizeof(unsigned int), 4, file) == 4 && header[0] == logVersion;
+	if (ok) {
+		long begin = ftell(file);
+		fseek(file, 0, SEEK_END);
+		log.resize(ftell(file) - begin);
+		fseek(file, begin, SEEK_SET);
+		ok = log.empty() || fread(&log[0], 1, log.size(), file) == log.size();
+	}
+	fclose(file);
+	if (!ok) {
+		printf("%s is not a command log of version %u\n", path, logVersion);
+		return false;
+	}
+	if ((int)header[1] != width || (int)header[2] != height)
+		printf("Command log was recorded at %ux%u, replayed at %dx%d\n", header[1], header[2], width, height);
+
+	unsigned int vertexArray = 0;
+	for (size_t offset = 0; offset + 4 <= log.size(); ) {
+		unsigned int size;
+		get(&log[offset], &size, 4);
+		offset += 4;
+		if (offset + size > log.size()) break;		// truncated by an interrupted recording
+		const size_t end = offset + size;
+		for (size_t c = offset; c < end; c += 1 + payloadSize(&log[c])) {
+			const unsigned char * command = &log[c];
+			bool complete = !(command[0] == CMD_UNIFORM && c + 6 > end);
+			size_t payload = complete ? payloadSize(command) : 0;
+			if (payload == 0 || c + 1 + payload > end) {
+				printf("Command log is corrupt: command %d of frame %d is unknown or crosses the end of the frame\n",
+					command[0], FrameCount());
+				return false;
+			}
+			unsigned int name = 0;
+			bool valid = true;
+			if (command[0] == CMD_PROGRAM) get(command + 1, &name, 4), valid = glIsProgram(name);
+			if (command[0] == CMD_TEXTURE) get(command + 9, &name, 4), valid = glIsTexture(name);
+			if (command[0] == CMD_VERTEX_ARRAY) get(command + 1, &name, 4), valid = glIsVertexArray(name), vertexArray = name;
+			if (command[0] == CMD_DRAW_ELEMENTS) {	// indexed draws need the index buffer of a pooled vertex array
+				GLint indexBuffer = 0;
+				glBindVertexArray(vertexArray);
+				glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &indexBuffer);
+				glBindVertexArray(0);
+				name = vertexArray, valid = indexBuffer != 0;
+			}
+			if (!valid) {
+				printf("Command log does not match the scene: command %d with name %u in frame %d\n",
+					command[0], name, FrameCount());
+				return false;
+			}
+		}
+		frameStart.push_back(offset);
+		frameEnd.push_back(offset + size);
+		offset += size;
+	}
+	if (FrameCount() < (int)header[3]) printf("Command log holds only %d of %u frames\n", FrameCount(), header[3]);
+	printf("Replaying %d frames of draw commands from %s\n", FrameCount(), path);
+	return FrameCount() > 0;
+}
+
+void CommandReplayer::Replay(int frame) {
+	PROFILE_ZONE("CommandReplayer::Replay");
+	AllocScope allocScope(ALLOC_RENDER_LOOP);
+	BenchScope scope(PHASE_SUBMIT);
+	const unsigned char * p = &log[frameStart[frame]], * end = &log[0] + frameEnd[frame];
+	while (p < end) {
+		CommandType type = (CommandType)*p++;
+		unsigned int v[4];
+		float f[16];
+		switch (type) {
+		case CMD_CLEAR:
+			p = get(p, v, 4);
+			p = get(p, f, 4 * 4);
+			glClearColor(f[0], f[1], f[2], f[3]);
+			glClear(v[0]);
+			break;
+		case CMD_PROGRAM:
+			p = get(p, v, 4);
+			glUseProgram(v[0]);
+			glStats.BindProgram();
+			break;
+		case CMD_UNIFORM: {
+			p = get(p, v, 4);
+			UniformType uniform = (UniformType)*p++;
+			p = get(p, f, uniformSize(uniform) * 4);
+			switch (uniform) {
+			case UNIFORM_INT:	glUniform1iv(v[0], 1, (const int *)f); break;
+			case UNIFORM_FLOAT:	glUniform1fv(v[0], 1, f); break;
+			case UNIFORM_VEC2:	glUniform2fv(v[0], 1, f); break;
+			case UNIFORM_VEC3:	glUniform3fv(v[0], 1, f); break;
+			case UNIFORM_VEC4:	glUniform4fv(v[0], 1, f); break;
+			case UNIFORM_MAT4:	glUniformMatrix4fv(v[0], 1, GL_TRUE, f); break;
+			}
+			glStats.Uniform();
+			break;
+		}
+		case CMD_TEXTURE:
+			p = get(p, v, 3 * 4);
+			glUniform1i(v[0], v[1]);
+			glActiveTexture(GL_TEXTURE0 + v[1]);
+			glBindTexture(GL_TEXTURE_2D, v[2]);
+			glStats.Uniform();
+			glStats.BindTexture();
+			break;
+		case CMD_VERTEX_ARRAY:
+			p = get(p, v, 4);
+			glBindVertexArray(v[0]);
+			glStats.BindVertexArray();
+			break;
+		case CMD_DRAW_ARRAYS:
+			p = get(p, v, 3 * 4);
+			glDrawArrays(v[0], v[1], v[2]);
+			glStats.Draw(v[2], v[0] == GL_TRIANGLE_STRIP ? v[2] - 2 : v[2] / 3);
+			break;
+		case CMD_DRAW_ELEMENTS:
+			p = get(p, v, 4 * 4);
+			glDrawElementsBaseVertex(v[0], v[1], GL_UNSIGNED_INT, (void*)(v[2] * sizeof(unsigned int)), v[3]);
+			glStats.Draw(v[1], v[1] / 3);
+			break;
+		default:
+			return;		// rejected by Load already
+		}
+	}
+}
@@ -0,0 +1,95 @@
+//=============================================================================================
+// Command stream: records the high-level draw commands of each frame into a binary log
+// and replays them against a GL context without the scene update
+//=============================================================================================
+#pragma once
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+// Log layout: header { "GLCS", version, width, height, frame count }, then per frame its byte size
+// followed by the commands, each an opcode byte and a fixed payload of native 32 bit values
+enum CommandType : unsigned char {
+	CMD_CLEAR,			// mask, r, g, b, a
+	CMD_PROGRAM,		// program name
+	CMD_UNIFORM,		// location, uniform type, data
+	CMD_TEXTURE,		// sampler location, texture unit, texture name
+	CMD_VERTEX_ARRAY,	// vertex array name
+	CMD_DRAW_ARRAYS,	// mode, first, count
+	CMD_DRAW_ELEMENTS,	// mode, count, first index, base vertex of 32 bit indices
+};
+
+enum UniformType : unsigned char { UNIFORM_INT, UNIFORM_FLOAT, UNIFORM_VEC2, UNIFORM_VEC3, UNIFORM_VEC4, UNIFORM_MAT4 };
+
+inline int uniformSize(UniformType type) {	// in 32 bit values
+	static const int sizes[] = { 1, 1, 2, 3, 4, 16 };
+	return sizes[type];
+}
+
+//---------------------------
+class CommandRecorder {
+//---------------------------
+	FILE * file = nullptr;
+	bool recording = false;
+	unsigned int nFrames = 0;
+	std::vector<unsigned char> frame;	// commands of the current frame, written when it ends
+
+	void put(const void * data, size_t size) {
+		const unsigned char * bytes = (const unsigned char *)data;
+		frame.insert(frame.end(), bytes, bytes + size);
+	}
+	void put(unsigned int value) { put(&value, sizeof(value)); }
+public:
+	bool Open(const char * path, int width, int height);
+	void Close();					// patches the frame count into the header
+	void BeginFrame() { recording = file != nullptr; }
+	void EndFrame();				// commands issued until the next BeginFrame, e.g. the overlay, are not recorded
+
+	void Clear(unsigned int mask, float r, float g, float b, float a) {
+		if (!recording) return;
+		float color[4] = { r, g, b, a };
+		frame.push_back(CMD_CLEAR); put(mask); put(color, sizeof(color));
+	}
+	void Program(unsigned int program) {
+		if (!recording) return;
+		frame.push_back(CMD_PROGRAM); put(program);
+	}
+	void Uniform(int location, UniformType type, const void * data) {
+		if (!recording || location < 0) return;
+		frame.push_back(CMD_UNIFORM); put((unsigned int)location); frame.push_back(type);
+		put(data, uniformSize(type) * 4);
+	}
+	void Texture(int location, unsigned int unit, unsigned int texture) {
+		if (!recording || location < 0) return;
+		frame.push_back(CMD_TEXTURE); put((unsigned int)location); put(unit); put(texture);
+	}
+	void VertexArray(unsigned int vao) {
+		if (!recording) return;
+		frame.push_back(CMD_VERTEX_ARRAY); put(vao);
+	}
+	void DrawArrays(unsigned int mode, int first, int count) {
+		if (!recording) return;
+		frame.push_back(CMD_DRAW_ARRAYS); put(mode); put((unsigned int)first); put((unsigned int)count);
+	}
+	void DrawElements(unsigned int mode, unsigned int count, unsigned int firstIndex, unsigned int baseVertex) {
+		if (!recording) return;
+		frame.push_back(CMD_DRAW_ELEMENTS); put(mode); put(count); put(firstIndex); put(baseVertex);
+	}
+};
+
+extern CommandRecorder commandRecorder;
+
+//---------------------------
+class CommandReplayer {
+//---------------------------
+	std::vector<unsigned char> log;
+	std::vector<size_t> frameStart, frameEnd;	// byte ranges of the frames in the log
+public:
+	// Reads the log and checks that its programs, textures and vertex arrays exist in the current context,
+	// which holds when the scene was built with the same options as at recording
+	bool Load(const char * path, int width, int height);
+	int FrameCount() const { return (int)frameStart.size(); }
+	void Replay(int frame);
+};
+
+extern CommandReplayer commandReplayer;
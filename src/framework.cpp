@@ -4,6 +4,24 @@
 // Do not change it if you want to submit a homework.
 //=============================================================================================
 #include "framework.h"
+#include "options.h"
+#include "headless.h"
+#include "bench.h"
+#include "capture.h"
+#include "gputimer.h"
+#include "softraster.h"
+#include "raytracer.h"
+#include "workers.h"
+#include <chrono>
+#include <string.h>
+#if defined(SOFTWARE_ONLY)
+#elif defined(__APPLE__)
+#include <OpenGL/OpenGL.h>
+#elif !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <GL/glx.h>
+#endif
+
+unsigned int windowWidth = 600, windowHeight = 600;
 
 // Initialization
 void onInitialization();
@@ -26,8 +44,157 @@ void onMouse(int button, int state, int pX, int pY);
 // Idle event indicating that some time elapsed: do animation here
 void onIdle();
 
+static std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+static int frameIndex = 0;	// frames presented so far
+
+float getElapsedTime() {
+#if !defined(SOFTWARE_ONLY)
+	if (!options.headless && !options.fixedClock) return glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
+#endif
+	if (options.fixedClock) return frameIndex * options.timestep;	// fixed simulated clock makes runs comparable
+	return std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void swapBuffers() {
+	AllocScope allocScope(ALLOC_TOOLS);		// measurement and capture, not part of the render loop
+	commandRecorder.EndFrame();
+	gpuTimer.EndFrame();
+	glStats.EndFrame();
+	if (options.headless) resolveHeadlessFramebuffer();
+	// before the overlay, so that captures do not depend on the statistics
+	frameCapture.Capture(options.raytrace ? rayTracer.Pixels() : options.software ? softRasterizer.Pixels() : nullptr);
+	if (options.overlay && hasGLContext()) drawStatsOverlay();
+#if !defined(SOFTWARE_ONLY)
+	if (!options.headless) glutSwapBuffers();
+#endif
+	frameIndex++;
+	gpuTimer.BeginFrame();
+	commandRecorder.BeginFrame();
+}
+
+void postRedisplay() {
+#if !defined(SOFTWARE_ONLY)
+	if (!options.headless) glutPostRedisplay();
+#endif
+}
+
+bool hasGLContext() { return !options.software; }
+
+static void writeTrace() { profilerExport(options.tracePath); }
+
+static void closeStats() { glStats.CloseDump(); }
+
+static void closeRecording() { commandRecorder.Close(); }
+
+#if !defined(SOFTWARE_ONLY)
+// GLUT has no call for the swap interval, so it is set through the extension of the platform
+static void setSwapInterval(int interval) {
+#if defined(__APPLE__)
+	GLint swapInterval = interval;
+	if (CGLSetParameter(CGLGetCurrentContext(), kCGLCPSwapInterval, &swapInterval) == kCGLNoError) return;
+#elif defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+	typedef BOOL (WINAPI * SwapIntervalEXT)(int);
+	SwapIntervalEXT swapIntervalEXT = (SwapIntervalEXT)wglGetProcAddress("wglSwapIntervalEXT");
+	if (swapIntervalEXT && swapIntervalEXT(interval)) return;
+#else
+	typedef void (* SwapIntervalEXT)(Display *, GLXDrawable, int);
+	typedef int (* SwapIntervalMESA)(unsigned int);
+	Display * display = glXGetCurrentDisplay();
+	const char * extensions = display ? glXQueryExtensionsString(display, DefaultScreen(display)) : nullptr;
+	if (extensions && strstr(extensions, "GLX_EXT_swap_control")) {
+		SwapIntervalEXT swapIntervalEXT = (SwapIntervalEXT)glXGetProcAddressARB((const GLubyte *)"glXSwapIntervalEXT");
+		swapIntervalEXT(display, glXGetCurrentDrawable(), interval);
+		return;
+	}
+	if (extensions && strstr(extensions, "GLX_MESA_swap_control")) {
+		SwapIntervalMESA swapIntervalMESA = (SwapIntervalMESA)glXGetProcAddressARB((const GLubyte *)"glXSwapIntervalMESA");
+		if (swapIntervalMESA(interval) == 0) return;
+	}
+#endif
+	printf("Swap interval %d cannot be set\n", interval);
+}
+#endif
+
+static void printGLInfo() {
+	int majorVersion, minorVersion;
+	printf("GL Vendor    : %s\n", glGetString(GL_VENDOR));
+	printf("GL Renderer  : %s\n", glGetString(GL_RENDERER));
+	printf("GL Version (string)  : %s\n", glGetString(GL_VERSION));
+	glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
+	glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
+	printf("GL Version (integer) : %d.%d\n", majorVersion, minorVersion);
+	printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+}
+
+// Renders the configured number of frames into an offscreen FBO or with the software rasterizer, then exits
+static int runHeadless() {
+	if (options.software) {
+		if (options.replayPath) {
+			printf("Replaying draw commands needs a GL context\n");
+			return 1;
+		}
+		workerPool.Start(options.threads);
+		printf("%s on %d threads\n", options.raytrace ? "Ray tracer" : "Software rasterizer", workerPool.ThreadCount());
+	}
+	else {
+		if (!createHeadlessContext(windowWidth, windowHeight, options.msaa)) return 1;
+		printGLInfo();
+		if (options.clustered || options.parallelRecord) workerPool.Start(options.threads);	// bins the lights, records the draws
+	}
+
+	onInitialization();	// the replayed commands refer to the programs, textures and vertex arrays of the scene
+	if (options.replayPath && !commandReplayer.Load(options.replayPath, windowWidth, windowHeight)) {
+		destroyHeadlessContext();
+		return 1;
+	}
+	commandRecorder.BeginFrame();
+	if (options.bench) benchmark.Start(options.frames);
+	if ((options.bench || options.tracePath) && hasGLContext()) gpuTimer.Start();
+	if (options.captureDir || options.goldenDir) frameCapture.Start(windowWidth, windowHeight);
+	int nFrames = options.bench ? options.warmupFrames + options.frames : options.frames;
+	for (int frame = 0; frame < nFrames; frame++) {
+		benchmark.BeginFrame(frame >= options.warmupFrames);
+		if (options.replayPath) {	// the recorded frames are looped, without scene update and culling
+			commandReplayer.Replay(frame % commandReplayer.FrameCount());
+			swapBuffers();
+		}
+		else {
+			onIdle();
+			onDisplay();
+		}
+		benchmark.EndFrame();
+	}
+	frameCapture.Finish();
+	gpuTimer.Finish();		// the last frames are still in flight
+	if (hasGLContext()) glFinish();
+	printf("Rendered %d frames offscreen\n", nFrames);
+	if (options.raytrace)
+		printf("Traced %.1f M rays in %.2f s, %.2f Mrays/s, primary rays %.2f Mrays/s per thread in packets of %d, %d samples per pixel\n",
+			rayTracer.TotalRays() / 1e6, rayTracer.TotalSeconds(), rayTracer.TotalRays() / rayTracer.TotalSeconds() / 1e6,
+			rayTracer.PrimaryRate() / 1e6, options.packet, rayTracer.SampleCount());
+	bool benchPassed = !options.bench || benchmark.Report(options.benchJson);
+
+	if (hasGLContext()) destroyHeadlessContext();
+	return frameCapture.nFailed > 0 || !benchPassed ? 1 : 0;
+}
+
 // Entry point of the application
 int main(int argc, char * argv[]) {
+	parseOptions(argc, argv);
+#if defined(SOFTWARE_ONLY)
+	if (!options.software) {
+		printf("This build has no GL, only --software and --raytrace can render\n");
+		return 1;
+	}
+#endif
+	windowWidth = options.width;
+	windowHeight = options.height;
+	if (options.tracePath) atexit(writeTrace);	// glutMainLoop only returns through exit
+	if (options.statsPath && glStats.OpenDump(options.statsPath)) atexit(closeStats);
+	if (options.recordPath && commandRecorder.Open(options.recordPath, windowWidth, windowHeight)) atexit(closeRecording);
+	if (options.headless) return runHeadless();
+
+#if !defined(SOFTWARE_ONLY)
 	// Initialize GLUT, Glew and OpenGL 
 	glutInit(&argc, argv);
 
@@ -36,12 +203,13 @@ int main(int argc, char * argv[]) {
 #if !defined(__APPLE__)
 	glutInitContextVersion(majorVersion, minorVersion);
 #endif
-	glutInitWindowSize(windowWidth, windowHeight);				// Application window is initially of resolution 600x600
+	glutInitWindowSize(windowWidth, windowHeight);				// Application window is initially of the resolution of the options
 	glutInitWindowPosition(100, 100);							// Relative location of the application window
 #if defined(__APPLE__)
-	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_3_2_CORE_PROFILE);  // 8 bit R,G,B,A + double buffer + depth buffer
+	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_3_2_CORE_PROFILE | (options.msaa > 1 ? GLUT_MULTISAMPLE : 0));  // 8 bit R,G,B,A + double buffer + depth buffer
 #else
-	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+	if (options.msaa > 1) glutSetOption(GLUT_MULTISAMPLE, options.msaa);	// samples per pixel of the window
+	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | (options.msaa > 1 ? GLUT_MULTISAMPLE : 0));
 #endif
 	glutCreateWindow(argv[0]);
 
@@ -49,16 +217,16 @@ int main(int argc, char * argv[]) {
 	glewExperimental = true;	// magic
 	glewInit();
 #endif
-	printf("GL Vendor    : %s\n", glGetString(GL_VENDOR));
-	printf("GL Renderer  : %s\n", glGetString(GL_RENDERER));
-	printf("GL Version (string)  : %s\n", glGetString(GL_VERSION));
-	glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
-	glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
-	printf("GL Version (integer) : %d.%d\n", majorVersion, minorVersion);
-	printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+	printGLInfo();
+	if (options.vsync >= 0) setSwapInterval(options.vsync);
+	if (options.clustered || options.parallelRecord) workerPool.Start(options.threads);	// bins the lights, records the draws
 
 	// Initialize this program and create shaders
 	onInitialization();
+	// frames still in flight when the window closes are not written or timed
+	if (options.captureDir || options.goldenDir) frameCapture.Start(windowWidth, windowHeight);
+	if (options.tracePath) gpuTimer.Start();
+	commandRecorder.BeginFrame();
 
 	glutDisplayFunc(onDisplay);                // Register event handlers
 	glutMouseFunc(onMouse);
@@ -68,5 +236,6 @@ int main(int argc, char * argv[]) {
 	glutMotionFunc(onMouseMotion);
 
 	glutMainLoop();
+#endif
 	return 1;
 }
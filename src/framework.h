@@ -5,14 +5,21 @@
 // Do not change it if you want to submit a homework.
 // In the homework, file operations other than printf are prohibited.
 //=============================================================================================
+#pragma once
 #define _USE_MATH_DEFINES		// M_PI
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <vector>
 #include <string>
-
-#if defined(__APPLE__)
+#include "profiler.h"
+#include "glstats.h"
+#include "cmdstream.h"
+#include "alloc.h"
+
+#if defined(SOFTWARE_ONLY)
+#include "nogl.h"			// no GL library, the CPU renderers only
+#elif defined(__APPLE__)
 #include <GLUT/GLUT.h>
 #include <OpenGL/gl3.h>
 #else
@@ -23,8 +30,14 @@
 #include <GL/freeglut.h>	// must be downloaded unless you have an Apple
 #endif
 
-// Resolution of screen
-const unsigned int windowWidth = 600, windowHeight = 600;
+// Resolution of screen, 600x600 unless the options say otherwise
+extern unsigned int windowWidth, windowHeight;
+
+// Services of the active backend (GLUT window or headless offscreen context)
+float getElapsedTime();		// seconds elapsed since the start of the program
+void swapBuffers();			// present the rendered frame
+void postRedisplay();		// ask for a new onDisplay call
+bool hasGLContext();		// false when the software rasterizer renders, resources then stay on the CPU
 
 //--------------------------
 struct vec2 {
@@ -190,8 +203,13 @@ class Texture {
 		return image;
 	}
 
+	size_t gpuBytes = 0;	// GPU memory held by the texture image
+
 public:
 	unsigned int textureId = 0;
+	bool seeThrough = false;		// alpha is derived from the color, its objects are drawn by the transparent pass
+	std::vector<vec4> cpuImage;		// kept instead of the GL texture when there is no GL context
+	int cpuWidth = 0, cpuHeight = 0, cpuSampling = GL_LINEAR;
 
 	Texture() { textureId = 0; }
 
@@ -214,22 +232,34 @@ public:
 	}
 
 	void create(std::string pathname, bool transparent = false) {
+		AllocScope allocScope(ALLOC_TEXTURES);
 		int width, height;
 		std::vector<vec4> image = load(pathname, transparent, width, height);
 		if (image.size() > 0) create(width, height, image);
+		seeThrough = transparent;
 	}
 
 	void create(int width, int height, const std::vector<vec4>& image, int sampling = GL_LINEAR) {
+		AllocScope allocScope(ALLOC_TEXTURES);
+		if (!hasGLContext()) {
+			cpuImage = image; cpuWidth = width; cpuHeight = height; cpuSampling = sampling;
+			return;
+		}
 		if (textureId == 0) glGenTextures(1, &textureId);  				// id generation
 		glBindTexture(GL_TEXTURE_2D, textureId);    // binding
 
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_FLOAT, &image[0]); // To GPU
+		glStats.textureMemory -= gpuBytes;
+		gpuBytes = (size_t)width * height * 4;	// GL_RGBA is stored with 8 bits per channel
+		glStats.textureMemory += gpuBytes;
+		glStats.Upload((size_t)width * height * sizeof(vec4));
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampling); // sampling
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampling);
 	}
 
 	~Texture() {
 		if (textureId > 0) glDeleteTextures(1, &textureId);
+		glStats.textureMemory -= gpuBytes;
 	}
 };
 
@@ -237,7 +267,7 @@ public:
 class GPUProgram {
 //--------------------------
 	unsigned int shaderProgramId = 0;
-	unsigned int vertexShader = 0, geometryShader = 0, fragmentShader = 0;
+	unsigned int vertexShader = 0, geometryShader = 0, fragmentShader = 0, computeShader = 0;
 	bool waitError = true;
 
 	void getErrorInfo(unsigned int handle) { // shader error report
@@ -273,9 +303,9 @@ class GPUProgram {
 		return true;
 	}
 
-	int getLocation(const std::string& name) {	// get the address of a GPU uniform variable
-		int location = glGetUniformLocation(shaderProgramId, name.c_str());
-		if (location < 0) printf("uniform %s cannot be set\n", name.c_str());
+	int getLocation(const char * name) {	// get the address of a GPU uniform variable
+		int location = glGetUniformLocation(shaderProgramId, name);
+		if (location < 0) printf("uniform %s cannot be set\n", name);
 		return location;
 	}
 
@@ -296,6 +326,8 @@ public:
 		        const char * const fragmentShaderSource, const char * const fragmentShaderOutputName,
 		        const char * const geometryShaderSource = nullptr)
 	{
+		PROFILE_ZONE("GPUProgram::create");
+		if (!hasGLContext()) return false;
 		// Create vertex shader from string
 		if (vertexShader == 0) vertexShader = glCreateShader(GL_VERTEX_SHADER);
 		if (!vertexShader) {
@@ -350,47 +382,86 @@ public:
 		return true;
 	}
 
+	bool createCompute(const char * const computeShaderSource) {	// a program of a single compute shader, GL 4.3
+		PROFILE_ZONE("GPUProgram::createCompute");
+		if (!hasGLContext()) return false;
+		if (computeShader == 0) computeShader = glCreateShader(GL_COMPUTE_SHADER);
+		if (!computeShader) {
+			printf("Error in compute shader creation\n");
+			exit(1);
+		}
+		glShaderSource(computeShader, 1, (const GLchar**)&computeShaderSource, NULL);
+		glCompileShader(computeShader);
+		if (!checkShader(computeShader, "Compute shader error")) return false;
+
+		shaderProgramId = glCreateProgram();
+		if (!shaderProgramId) {
+			printf("Error in shader program creation\n");
+			exit(1);
+		}
+		glAttachShader(shaderProgramId, computeShader);
+		glLinkProgram(shaderProgramId);
+		return checkLinking(shaderProgramId);
+	}
+
 	void Use() { 		// make this program run
+		glStats.BindProgram();
+		commandRecorder.Program(shaderProgramId);
 		glUseProgram(shaderProgramId);
 	}
 
-	void setUniform(int i, const std::string& name) {
+	void setUniform(int i, const char * name) {
 		int location = getLocation(name);
 		if (location >= 0) glUniform1i(location, i);
+		commandRecorder.Uniform(location, UNIFORM_INT, &i);
+		glStats.Uniform();
 	}
 
-	void setUniform(float f, const std::string& name) {
+	void setUniform(float f, const char * name) {
 		int location = getLocation(name);
 		if (location >= 0) glUniform1f(location, f);
+		commandRecorder.Uniform(location, UNIFORM_FLOAT, &f);
+		glStats.Uniform();
 	}
 
-	void setUniform(const vec2& v, const std::string& name) {
+	void setUniform(const vec2& v, const char * name) {
 		int location = getLocation(name);
 		if (location >= 0) glUniform2fv(location, 1, &v.x);
+		commandRecorder.Uniform(location, UNIFORM_VEC2, &v.x);
+		glStats.Uniform();
 	}
 
-	void setUniform(const vec3& v, const std::string& name) {
+	void setUniform(const vec3& v, const char * name) {
 		int location = getLocation(name);
 		if (location >= 0) glUniform3fv(location, 1, &v.x);
+		commandRecorder.Uniform(location, UNIFORM_VEC3, &v.x);
+		glStats.Uniform();
 	}
 
-	void setUniform(const vec4& v, const std::string& name) {
+	void setUniform(const vec4& v, const char * name) {
 		int location = getLocation(name);
 		if (location >= 0) glUniform4fv(location, 1, &v.x);
+		commandRecorder.Uniform(location, UNIFORM_VEC4, &v.x);
+		glStats.Uniform();
 	}
 
-	void setUniform(const mat4& mat, const std::string& name) {
+	void setUniform(const mat4& mat, const char * name) {
 		int location = getLocation(name);
 		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, mat);
+		commandRecorder.Uniform(location, UNIFORM_MAT4, (const float *)mat);
+		glStats.Uniform();
 	}
 
-	void setUniform(const Texture& texture, const std::string& samplerName, unsigned int textureUnit = 0) {
+	void setUniform(const Texture& texture, const char * samplerName, unsigned int textureUnit = 0) {
 		int location = getLocation(samplerName);
 		if (location >= 0) {
 			glUniform1i(location, textureUnit);
 			glActiveTexture(GL_TEXTURE0 + textureUnit);
 			glBindTexture(GL_TEXTURE_2D, texture.textureId);
+			glStats.BindTexture();
 		}
+		commandRecorder.Texture(location, textureUnit, texture.textureId);
+		glStats.Uniform();
 	}
 
 	~GPUProgram() { if (shaderProgramId > 0) glDeleteProgram(shaderProgramId); }
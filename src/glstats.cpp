@@ -0,0 +1,170 @@
+//=============================================================================================
+// GL call and resource statistics: per-frame counters and live GPU memory
+//=============================================================================================
+#include "framework.h"
+#include "glstats.h"
+#include <string.h>
+
+GLStats glStats;
+
+bool GLStats::OpenDump(const char * path) {
+	dumpFile = fopen(path, "w");
+	if (!dumpFile) {
+		printf("%s cannot be written\n", path);
+		return false;
+	}
+	size_t len = strlen(path);
+	csv = len >= 4 && strcmp(path + len - 4, ".csv") == 0;
+	if (csv) fprintf(dumpFile, "frame,draw_calls,vertices,primitives,uniform_calls,program_binds,texture_binds,"
+		"vao_binds,buffer_bytes,vbo_memory,texture_memory\n");
+	return true;
+}
+
+void GLStats::CloseDump() {
+	if (dumpFile) fclose(dumpFile);
+	dumpFile = nullptr;
+}
+
+void GLStats::EndFrame() {
+	lastFrame = frame;
+	frame = FrameCounters();
+	if (dumpFile) {
+		const FrameCounters& f = lastFrame;
+		const char * format = csv ? "%u,%u,%u,%u,%u,%u,%u,%u,%zu,%zu,%zu\n"
+			: "{\"frame\":%u,\"draw_calls\":%u,\"vertices\":%u,\"primitives\":%u,\"uniform_calls\":%u,\"program_binds\":%u,"
+			  "\"texture_binds\":%u,\"vao_binds\":%u,\"buffer_bytes\":%zu,\"vbo_memory\":%zu,\"texture_memory\":%zu}\n";
+		fprintf(dumpFile, format, frameIndex, f.drawCalls, f.vertices, f.primitives, f.uniformCalls, f.programBinds,
+			f.textureBinds, f.vaoBinds, f.bufferBytes, vboMemory, textureMemory);
+	}
+	frameIndex++;
+}
+
+// 3x5 pixel font, rows from top to bottom, '#' is a lit pixel
+static const char * glyphChars = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ .:/-";
+static const char * glyphs[] = {
+	"###" "#.#" "#.#" "#.#" "###",	".#." "##." ".#." ".#." "###",	"###" "..#" "###" "#.." "###",
+	"###" "..#" ".##" "..#" "###",	"#.#" "#.#" "###" "..#" "..#",	"###" "#.." "###" "..#" "###",
+	"###" "#.." "###" "#.#" "###",	"###" "..#" "..#" ".#." ".#.",	"###" "#.#" "###" "#.#" "###",
+	"###" "#.#" "###" "..#" "###",	".#." "#.#" "###" "#.#" "#.#",	"##." "#.#" "##." "#.#" "##.",
+	".##" "#.." "#.." "#.." ".##",	"##." "#.#" "#.#" "#.#" "##.",	"###" "#.." "##." "#.." "###",
+	"###" "#.." "##." "#.." "#..",	".##" "#.." "#.#" "#.#" ".##",	"#.#" "#.#" "###" "#.#" "#.#",
+	"###" ".#." ".#." ".#." "###",	"..#" "..#" "..#" "#.#" ".#.",	"#.#" "#.#" "##." "#.#" "#.#",
+	"#.." "#.." "#.." "#.." "###",	"#.#" "###" "###" "#.#" "#.#",	"##." "#.#" "#.#" "#.#" "#.#",
+	".#." "#.#" "#.#" "#.#" ".#.",	"##." "#.#" "##." "#.." "#..",	".#." "#.#" "#.#" "##." ".##",
+	"##." "#.#" "##." "#.#" "#.#",	".##" "#.." ".#." "..#" "##.",	"###" ".#." ".#." ".#." ".#.",
+	"#.#" "#.#" "#.#" "#.#" "###",	"#.#" "#.#" "#.#" "#.#" ".#.",	"#.#" "#.#" "###" "###" "#.#",
+	"#.#" "#.#" ".#." "#.#" "#.#",	"#.#" "#.#" ".#." ".#." ".#.",	"###" "..#" ".#." "#.." "###",
+	"..." "..." "..." "..." "...",	"..." "..." "..." "..." ".#.",	"..." ".#." "..." ".#." "...",
+	"..#" "..#" ".#." "#.." "#..",	"..." "..." "###" "..." "...",
+};
+
+//---------------------------
+class StatsOverlay {
+//---------------------------
+	static const int nLines = 3, nColumns = 48, scale = 2;
+	static const int cellWidth = 4, cellHeight = 6;	// glyph plus one pixel spacing
+	static const int width = nColumns * cellWidth * scale, height = nLines * cellHeight * scale;
+
+	const char * vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform vec4 rect;	// x, y of the lower left corner and width, height in NDC
+		layout(location = 0) in vec2 vtxUV;
+		out vec2 texcoord;
+
+		void main() {
+			texcoord = vtxUV;
+			gl_Position = vec4(rect.xy + vtxUV * rect.zw, 0, 1);
+		}
+	)";
+
+	const char * fragmentSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform sampler2D textTexture;
+		in  vec2 texcoord;
+		out vec4 fragmentColor;
+
+		void main() { fragmentColor = texture(textTexture, texcoord); }
+	)";
+
+	GPUProgram program;
+	unsigned int vao = 0, vbo = 0, texture = 0;
+	unsigned char image[width * height * 4];
+
+	void drawText(int line, const char * text) {
+		for (int col = 0; text[col] && col < nColumns; col++) {
+			const char * found = strchr(glyphChars, text[col]);
+			if (!found) continue;
+			const char * glyph = glyphs[found - glyphChars];
+			for (int gy = 0; gy < 5; gy++) for (int gx = 0; gx < 3; gx++) {
+				if (glyph[gy * 3 + gx] != '#') continue;
+				for (int sy = 0; sy < scale; sy++) for (int sx = 0; sx < scale; sx++) {
+					int x = (col * cellWidth + gx + 1) * scale + sx;
+					int y = height - 1 - ((line * cellHeight + gy + 1) * scale + sy);	// texture rows go bottom up
+					unsigned char * pixel = &image[(y * width + x) * 4];
+					pixel[0] = pixel[1] = pixel[2] = pixel[3] = 255;
+				}
+			}
+		}
+	}
+
+public:
+	StatsOverlay() : program(false) {
+		program.create(vertexSource, fragmentSource, "fragmentColor");
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		float uvs[] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+		glBufferData(GL_ARRAY_BUFFER, sizeof(uvs), uvs, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+
+	void Draw(const FrameCounters& f, size_t vboMemory, size_t textureMemory) {
+		for (int i = 0; i < width * height; i++) {	// translucent black background
+			image[4 * i] = image[4 * i + 1] = image[4 * i + 2] = 0;
+			image[4 * i + 3] = 160;
+		}
+		char line[nColumns + 1];
+		snprintf(line, sizeof(line), "DRAWS %u VERTS %u PRIMS %u", f.drawCalls, f.vertices, f.primitives);
+		drawText(0, line);
+		snprintf(line, sizeof(line), "UNIFORMS %u PROGRAMS %u TEXTURES %u VAOS %u",
+			f.uniformCalls, f.programBinds, f.textureBinds, f.vaoBinds);
+		drawText(1, line);
+		snprintf(line, sizeof(line), "UPLOAD %.1f KB VBO %.2f MB TEX %.2f MB",
+			f.bufferBytes / 1024.0, vboMemory / 1048576.0, textureMemory / 1048576.0);
+		drawText(2, line);
+
+		glActiveTexture(GL_TEXTURE0);	// the passes before may leave any unit active
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+
+		GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		program.Use();
+		float w = 2.0f * width / windowWidth, h = 2.0f * height / windowHeight;
+		program.setUniform(vec4(-1, 1 - h, w, h), "rect");
+		program.setUniform(0, "textTexture");
+		glBindVertexArray(vao);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		glDisable(GL_BLEND);
+		if (depthTest) glEnable(GL_DEPTH_TEST);
+	}
+};
+
+void drawStatsOverlay() {
+	static StatsOverlay * overlay = new StatsOverlay();
+	FrameCounters counting = glStats.frame;		// the overlay itself is not part of the statistics
+	overlay->Draw(glStats.lastFrame, glStats.vboMemory, glStats.textureMemory);
+	glStats.frame = counting;
+}
@@ -0,0 +1,46 @@
+//=============================================================================================
+// GL call and resource statistics: per-frame counters and live GPU memory
+//=============================================================================================
+#pragma once
+#include <stddef.h>
+#include <stdio.h>
+
+//---------------------------
+struct FrameCounters {
+//---------------------------
+	unsigned int drawCalls = 0, vertices = 0, primitives = 0;
+	unsigned int uniformCalls = 0, programBinds = 0, textureBinds = 0, vaoBinds = 0;
+	size_t bufferBytes = 0;		// uploaded by glBufferData / glBufferSubData
+};
+
+//---------------------------
+class GLStats {
+//---------------------------
+	FILE * dumpFile = nullptr;
+	bool csv = false;
+	unsigned int frameIndex = 0;
+public:
+	FrameCounters frame, lastFrame;			// counters of the current and of the last finished frame
+	size_t vboMemory = 0, textureMemory = 0;	// live GPU memory in bytes
+
+	void Draw(unsigned int nVertices, unsigned int nPrimitives) {
+		frame.drawCalls++;
+		frame.vertices += nVertices;
+		frame.primitives += nPrimitives;
+	}
+	void Uniform() { frame.uniformCalls++; }
+	void BindProgram() { frame.programBinds++; }
+	void BindTexture() { frame.textureBinds++; }
+	void BindVertexArray() { frame.vaoBinds++; }
+	void Upload(size_t bytes) { frame.bufferBytes += bytes; }
+
+	// Per-frame dump: CSV if the path ends with .csv, otherwise one JSON object per frame and line
+	bool OpenDump(const char * path);
+	void CloseDump();
+	void EndFrame();	// closes the counters of the frame and dumps them
+};
+
+extern GLStats glStats;
+
+// Draws the counters of the last frame as text in the top left corner
+void drawStatsOverlay();
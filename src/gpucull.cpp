@@ -0,0 +1,288 @@
+//=============================================================================================
+// GPU culling: the culling and depth reduction compute programs, the object, transform,
+// command and count buffers and the depth pyramid
+//=============================================================================================
+#include "gpucull.h"
+#include "indirect.h"
+#include "bench.h"
+#include <algorithm>
+
+static const int cullGroupSize = 64, reduceGroupSize = 8;
+static const char * counterName = "GPU culled visible objects";
+
+// The programs are GLSL 3.30 with the extensions of the support check, the bindings are set after linking
+static const char * cullSource = R"(
+	#version 330
+	#extension GL_ARB_compute_shader : require
+	#extension GL_ARB_shader_storage_buffer_object : require
+	layout(local_size_x = 64) in;
+
+	struct ObjectInfo {
+		vec4 sphere;                // center and radius in modeling space
+		vec4 kd, ks, ka;
+		uint count, firstIndex;
+		int  baseVertex;
+		uint batch, first;          // the batch and its first command
+		uint padding[3];
+	};
+
+	struct Transform { mat4 M, Minv; };
+
+	struct DrawData {               // read by the indirect programs
+		mat4 MVP, M, Minv;
+		vec4 kd, ks, ka;
+	};
+
+	struct Command {                // DrawElementsIndirectCommand
+		uint count, instanceCount, firstIndex;
+		int  baseVertex;
+		uint baseInstance;
+	};
+
+	layout(std430) readonly buffer Objects { ObjectInfo objects[]; };
+	layout(std430, row_major) readonly buffer Transforms { Transform transforms[]; };
+	layout(std430, row_major) writeonly buffer Draws { DrawData draws[]; };
+	layout(std430) writeonly buffer Commands { Command commands[]; };
+	layout(std430) buffer Counts { uint counts[]; };    // visible objects of the batches
+
+	uniform int   nObjects;
+	uniform mat4  V, P;
+	uniform vec4  planes[6];        // of the frustum, inside points give non-negative dot
+	uniform float fp;               // distance of the near plane
+
+	uniform int   hiZLevels;        // 0 without the depth pyramid
+	uniform mat4  hiZV, hiZP;       // camera of the pyramid
+	uniform sampler2D hiZMap;       // farthest depth of the covered pixels
+
+	// The sphere is behind the farthest depth of the pyramid texels covering its screen rectangle
+	bool occluded(vec4 wCenter, float radius) {
+		vec4 center = wCenter * hiZV;
+		if (-center.z - radius < fp) return false;     // reaches the near plane
+		vec2 lo = vec2(1, 1), hi = vec2(-1, -1);
+		for (int i = 0; i < 8; i++) {
+			vec4 corner = vec4(center.x + ((i & 1) != 0 ? radius : -radius), center.y + ((i & 2) != 0 ? radius : -radius),
+			                   center.z + ((i & 4) != 0 ? radius : -radius), 1) * hiZP;
+			lo = min(lo, corner.xy / corner.w);
+			hi = max(hi, corner.xy / corner.w);
+		}
+		if (any(lessThan(hi, vec2(-1, -1))) || any(greaterThan(lo, vec2(1, 1)))) return false; // not in the last frame
+		vec4 nearest = vec4(center.x, center.y, center.z + radius, 1) * hiZP;
+		float depth = nearest.z / nearest.w * 0.5 + 0.5;
+
+		ivec2 size = textureSize(hiZMap, 0);
+		ivec2 p0 = ivec2((clamp(lo, -1, 1) * 0.5 + 0.5) * vec2(size)), p1 = ivec2((clamp(hi, -1, 1) * 0.5 + 0.5) * vec2(size));
+		int level = 0;
+		ivec2 t0, t1, levelSize;
+		for (;; level++) {          // the coarsest level where the rectangle is at most 2x2 texels
+			levelSize = max(size >> level, ivec2(1, 1));
+			t0 = min(p0 >> level, levelSize - 1);
+			t1 = min(p1 >> level, levelSize - 1);
+			if (all(lessThanEqual(t1 - t0, ivec2(1, 1))) || level == hiZLevels - 1) break;
+		}
+		float farthest = 0;
+		for (int y = t0.y; y <= t1.y; y++)
+			for (int x = t0.x; x <= t1.x; x++) farthest = max(farthest, texelFetch(hiZMap, ivec2(x, y), level).r);
+		return depth > farthest;
+	}
+
+	void main() {
+		int i = int(gl_GlobalInvocationID.x);
+		if (i >= nObjects) return;
+		ObjectInfo object = objects[i];
+		mat4 M = transforms[i].M;
+		vec4 wCenter = vec4(object.sphere.xyz, 1) * M;
+		// the rows of the upper 3x3 are the scaled axes
+		float scale = max(length(vec3(M[0][0], M[1][0], M[2][0])),
+		                  max(length(vec3(M[0][1], M[1][1], M[2][1])), length(vec3(M[0][2], M[1][2], M[2][2]))));
+		float wRadius = object.sphere.w * scale;
+		for (int k = 0; k < 6; k++) if (dot(planes[k], wCenter) < -wRadius) return;
+		if (hiZLevels > 0 && occluded(wCenter, wRadius)) return;
+
+		uint slot = object.first + atomicAdd(counts[object.batch], 1u);
+		commands[slot] = Command(object.count, 1u, object.firstIndex, object.baseVertex, slot);
+		draws[slot] = DrawData(M * V * P, M, transforms[i].Minv, object.kd, object.ks, object.ka);
+	}
+)";
+
+static const char * reduceSource = R"(
+	#version 330
+	#extension GL_ARB_compute_shader : require
+	#extension GL_ARB_shader_image_load_store : require
+	layout(local_size_x = 8, local_size_y = 8) in;
+
+	uniform sampler2D source;       // the depth of the frame or the previous level of the pyramid
+	uniform int sourceLevel;
+	layout(r32f) writeonly uniform image2D target;
+	uniform vec2 targetSize;        // in texels, imageSize needs GLSL 4.30
+
+	void main() {
+		ivec2 size = ivec2(targetSize), p = ivec2(gl_GlobalInvocationID.xy);
+		if (any(greaterThanEqual(p, size))) return;
+		ivec2 sourceSize = textureSize(source, sourceLevel);
+		// 2x2 source texels, the last row and column also take the odd one left over
+		ivec2 first = sourceSize == size ? p : 2 * p;
+		ivec2 last = sourceSize == size ? p : 2 * p + 1;
+		if (p.x == size.x - 1) last.x = sourceSize.x - 1;
+		if (p.y == size.y - 1) last.y = sourceSize.y - 1;
+		float farthest = 0;
+		for (int y = first.y; y <= last.y; y++)
+			for (int x = first.x; x <= last.x; x++) farthest = max(farthest, texelFetch(source, ivec2(x, y), sourceLevel).r);
+		imageStore(target, p, vec4(farthest, 0, 0, 0));
+	}
+)";
+
+bool gpuCullingSupported() {
+	return indirectDrawsSupported() && (GLEW_VERSION_4_3 || (GLEW_ARB_compute_shader && GLEW_ARB_clear_buffer_object &&
+		   (GLEW_VERSION_4_2 || (GLEW_ARB_texture_storage && GLEW_ARB_shader_image_load_store))));
+}
+
+void GpuCulling::allocate(int buffer, size_t bytes, const void * data, unsigned int usage) {
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[buffer]);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, data, usage);
+	glStats.vboMemory += bytes - bufferBytes[buffer];
+	bufferBytes[buffer] = bytes;
+	if (data) glStats.Upload(bytes);
+}
+
+void GpuCulling::Create(const std::vector<CullObject>& objects, unsigned int nBatches, bool withHiZ, int width, int height) {
+	PROFILE_ZONE("GpuCulling::Create");
+	AllocScope allocScope(ALLOC_SCENE);
+	if (objects.empty() || !cullProgram.createCompute(cullSource) || !reduceProgram.createCompute(reduceSource)) return;
+	static const char * blocks[BUFFER_COUNT] = { "Objects", "Transforms", "Draws", "Commands", "Counts" };
+	for (int i = 0; i < BUFFER_COUNT; i++)
+		glShaderStorageBlockBinding(cullProgram.getId(), glGetProgramResourceIndex(cullProgram.getId(), GL_SHADER_STORAGE_BLOCK, blocks[i]), i);
+	reduceProgram.Use();
+	reduceProgram.setUniform(0, "target");		// image unit
+	nObjects = (unsigned int)objects.size();
+	countedDraws = (GLEW_VERSION_4_6 || GLEW_ARB_indirect_parameters);
+	batchFirst.assign(nBatches, 0);
+	batchSize.assign(nBatches, 0);
+	readCounts.resize(nBatches);
+	for (const CullObject& object : objects) {
+		batchFirst[object.batch] = object.first;
+		batchSize[object.batch]++;
+	}
+	transforms.resize(nObjects);
+
+	glGenBuffers(BUFFER_COUNT, buffers);
+	allocate(OBJECTS, nObjects * sizeof(CullObject), objects.data(), GL_STATIC_DRAW);
+	allocate(TRANSFORMS, nObjects * sizeof(Transform), nullptr, GL_STREAM_DRAW);
+	allocate(DRAWS, nObjects * (3 * sizeof(mat4) + 3 * sizeof(vec4)), nullptr, GL_DYNAMIC_COPY);
+	allocate(COMMANDS, nObjects * sizeof(DrawElementsIndirectCommand), nullptr, GL_DYNAMIC_COPY);
+	allocate(COUNTS, nBatches * sizeof(unsigned int), nullptr, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	if (!withHiZ) return;
+	depthCopy.Create(width, height, 0, nullptr);
+	for (int size = width > height ? width : height; size > 0; size >>= 1) hiZLevels++;
+	glGenTextures(1, &hiZ.textureId);
+	glBindTexture(GL_TEXTURE_2D, hiZ.textureId);
+	glTexStorage2D(GL_TEXTURE_2D, hiZLevels, GL_R32F, width, height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);	// read by texelFetch
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	for (int level = 0; level < hiZLevels; level++)
+		hiZBytes += (size_t)std::max(width >> level, 1) * std::max(height >> level, 1) * sizeof(float);
+	glStats.textureMemory += hiZBytes;
+}
+
+void GpuCulling::Cull(const mat4& V, const mat4& P, const vec4 planes[6], float fp) {
+	PROFILE_ZONE("GpuCulling::Cull");
+	allocate(TRANSFORMS, nObjects * sizeof(Transform), transforms.data(), GL_STREAM_DRAW);
+	// the commands past the counts of the batches stay empty if the multi-draws do not read the counts
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[COUNTS]);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	if (!countedDraws) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[COMMANDS]);
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	}
+	for (int i = 0; i < BUFFER_COUNT; i++) glBindBufferBase(GL_SHADER_STORAGE_BUFFER, i, buffers[i]);
+
+	cullProgram.Use();
+	cullProgram.setUniform((int)nObjects, "nObjects");
+	cullProgram.setUniform(V, "V");
+	cullProgram.setUniform(P, "P");
+	char name[16];
+	for (int i = 0; i < 6; i++) {
+		snprintf(name, sizeof(name), "planes[%d]", i);
+		cullProgram.setUniform(planes[i], name);
+	}
+	cullProgram.setUniform(fp, "fp");
+	cullProgram.setUniform(hiZValid ? hiZLevels : 0, "hiZLevels");
+	if (hiZValid) {
+		cullProgram.setUniform(hiZV, "hiZV");
+		cullProgram.setUniform(hiZP, "hiZP");
+		cullProgram.setUniform(hiZ, "hiZMap");
+	}
+	glDispatchCompute((nObjects + cullGroupSize - 1) / cullGroupSize, 1, 1);
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	if (!benchmark.IsActive()) return;
+	size_t bytes = batchSize.size() * sizeof(unsigned int);
+	if (readback == 0) {
+		glGenBuffers(1, &readback);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, readback);
+		glBufferData(GL_COPY_WRITE_BUFFER, nSlots * bytes, nullptr, GL_STREAM_READ);
+		glStats.vboMemory += nSlots * bytes;
+		benchmark.AddCounter(counterName, 0, false);	// not in a measured frame
+	}
+	if (pending[slot]) collect(slot);
+	glBindBuffer(GL_COPY_READ_BUFFER, buffers[COUNTS]);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, readback);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, slot * bytes, bytes);
+	pending[slot] = true;
+	measured[slot] = benchmark.IsMeasuring();
+	slot = (slot + 1) % nSlots;
+}
+
+void GpuCulling::collect(int s) {
+	glBindBuffer(GL_COPY_READ_BUFFER, readback);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, s * readCounts.size() * sizeof(unsigned int), readCounts.size() * sizeof(unsigned int),
+					   readCounts.data());
+	unsigned int visible = 0;
+	for (unsigned int count : readCounts) visible += count;
+	benchmark.AddCounter(counterName, visible, measured[s]);
+	pending[s] = false;
+}
+
+void GpuCulling::Draw(unsigned int batch, unsigned int binding) {
+	if (batchSize[batch] == 0) return;
+	meshPool.Bind();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffers[DRAWS]);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffers[COMMANDS]);
+	const void * offset = (const void *)(batchFirst[batch] * sizeof(DrawElementsIndirectCommand));
+	if (countedDraws) {
+		glBindBuffer(GL_PARAMETER_BUFFER_ARB, buffers[COUNTS]);
+		glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, GL_UNSIGNED_INT, offset, batch * sizeof(unsigned int), batchSize[batch], 0);
+	}
+	else glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, offset, batchSize[batch], 0);
+	glStats.Draw(0, 0);		// the visible vertices are not known on the CPU
+}
+
+void GpuCulling::UpdateHiZ(const mat4& V, const mat4& P) {
+	PROFILE_ZONE("GpuCulling::UpdateHiZ");
+	depthCopy.CopyDefaultDepth();
+	reduceProgram.Use();
+	for (int level = 0; level < hiZLevels; level++) {
+		int width = std::max(depthCopy.Width() >> level, 1), height = std::max(depthCopy.Height() >> level, 1);
+		reduceProgram.setUniform(level == 0 ? depthCopy.depth : hiZ, "source");
+		reduceProgram.setUniform(level == 0 ? 0 : level - 1, "sourceLevel");
+		reduceProgram.setUniform(vec2((float)width, (float)height), "targetSize");
+		glBindImageTexture(0, hiZ.textureId, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glDispatchCompute((width + reduceGroupSize - 1) / reduceGroupSize, (height + reduceGroupSize - 1) / reduceGroupSize, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
+	bindDefaultFramebuffer();
+	hiZV = V;
+	hiZP = P;
+	hiZValid = true;
+}
+
+GpuCulling::~GpuCulling() {
+	if (buffers[0] != 0) glDeleteBuffers(BUFFER_COUNT, buffers);
+	for (int i = 0; i < BUFFER_COUNT; i++) glStats.vboMemory -= bufferBytes[i];
+	if (readback != 0) {
+		glDeleteBuffers(1, &readback);
+		glStats.vboMemory -= nSlots * readCounts.size() * sizeof(unsigned int);
+	}
+	glStats.textureMemory -= hiZBytes;
+}
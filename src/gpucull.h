@@ -0,0 +1,73 @@
+//=============================================================================================
+// GPU culling: a compute shader tests the bounding spheres of the pooled objects against the
+// view frustum and optionally the depth pyramid (Hi-Z) of the last frame, and compacts the
+// visible ones into the indirect commands and per-draw data of their batch (GL 4.3)
+//=============================================================================================
+#pragma once
+#include "framework.h"
+#include "meshpool.h"
+#include "rendertarget.h"
+
+// GL 4.3, or next to the extensions of the indirect draws those of compute shaders and buffer clears, and the
+// texture storage and image stores of the depth pyramid (GL 4.2)
+bool gpuCullingSupported();
+
+struct CullObject {		// static part of an object, std430 layout of ObjectInfo of the culling program
+	vec4 sphere;						// center and radius of the bounding sphere in modeling space
+	vec4 kd, ks, ka;					// of the per-draw data, the shininess is ks.w
+	unsigned int count, firstIndex;		// the mesh in the pool
+	int baseVertex;
+	unsigned int batch, first;			// the batch and its first command
+	unsigned int padding[3];
+};
+
+//---------------------------
+class GpuCulling {
+//---------------------------
+public:
+	struct Transform {	// of an object in the frame, row major like mat4
+		mat4 M, Minv;
+	};
+private:
+	enum { OBJECTS, TRANSFORMS, DRAWS, COMMANDS, COUNTS, BUFFER_COUNT };
+	unsigned int buffers[BUFFER_COUNT] = {};
+	size_t bufferBytes[BUFFER_COUNT] = {};
+	GPUProgram cullProgram, reduceProgram;
+	std::vector<unsigned int> batchFirst, batchSize;	// commands of the batches
+	unsigned int nObjects = 0;
+	bool countedDraws = false;			// glMultiDrawElementsIndirectCount reads the counts of the batches
+
+	// Counts of the benchmark are copied into slots of frames in flight, read back when the slot is reused
+	static const int nSlots = 3;
+	unsigned int readback = 0;
+	std::vector<unsigned int> readCounts;
+	bool pending[nSlots] = {}, measured[nSlots] = {};
+	int slot = 0;
+
+	// Depth pyramid of the last frame, each texel the farthest depth of the pixels it covers
+	RenderTarget depthCopy;
+	Texture hiZ;
+	int hiZLevels = 0;
+	size_t hiZBytes = 0;
+	mat4 hiZV, hiZP;					// camera of the pyramid
+	bool hiZValid = false;
+
+	void allocate(int buffer, size_t bytes, const void * data, unsigned int usage);
+	void collect(int slot);				// adds the visible objects of the slot to the benchmark counters
+public:
+	std::vector<Transform> transforms;	// filled by the caller every frame, in the order of the objects
+
+	// Objects sorted by batch, each batch a consecutive range of commands. With hiZ the pyramid has
+	// the size of the frame.
+	void Create(const std::vector<CullObject>& objects, unsigned int nBatches, bool hiZ, int width, int height);
+	bool Created() const { return nObjects > 0; }
+	bool HiZ() const { return hiZLevels > 0; }
+
+	// Uploads the transforms and compacts the visible objects, planes are those of Camera::FrustumPlanes
+	void Cull(const mat4& V, const mat4& P, const vec4 planes[6], float fp);
+	// One multi-draw of the commands of the batch, their data is bound to binding of the storage buffers
+	void Draw(unsigned int batch, unsigned int binding);
+	// Reduces the depth of the frame into the pyramid tested by the next Cull
+	void UpdateHiZ(const mat4& V, const mat4& P);
+	~GpuCulling();
+};
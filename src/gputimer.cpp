@@ -0,0 +1,79 @@
+//=============================================================================================
+// GPU timer: named scopes measured with GL_TIMESTAMP queries, read back when their slot is reused
+// three frames later, so that the measurement does not stall the pipeline
+//=============================================================================================
+#include "framework.h"
+#include "gputimer.h"
+#include "bench.h"
+
+GPUTimer gpuTimer;
+
+void GPUTimer::Start() {
+	for (Slot& slot : slots) glGenQueries(2 * maxScopes, slot.queries);
+	active = true;
+#if defined(PROFILING_ENABLED)
+	GLint64 gpuNow;
+	glGetInteger64v(GL_TIMESTAMP, &gpuNow);		// both clocks at the same moment
+	gpuToProfiler = (long long)profilerNow() - (long long)gpuNow;
+#endif
+	BeginFrame();
+}
+
+void GPUTimer::BeginFrame() {
+	if (!active) return;
+	Slot& slot = slots[current];
+	if (slot.pending) collect(slot);
+	slot.nScopes = 0;
+	frameScope = Begin("frame");
+}
+
+void GPUTimer::EndFrame() {
+	if (!active) return;
+	End(frameScope);
+	Slot& slot = slots[current];
+	slot.pending = slot.nScopes > 0;
+	slot.measured = benchmark.IsMeasuring();
+	current = (current + 1) % nSlots;
+}
+
+void GPUTimer::Finish() {
+	if (!active) return;
+	for (int i = 0; i < nSlots; i++) {
+		Slot& slot = slots[(current + i) % nSlots];	// oldest first
+		if (slot.pending) collect(slot);
+	}
+	for (Slot& slot : slots) glDeleteQueries(2 * maxScopes, slot.queries);
+	active = false;
+}
+
+int GPUTimer::Begin(const char * name) {
+	if (!active) return -1;
+	Slot& slot = slots[current];
+	if (slot.nScopes >= maxScopes) return -1;
+	int scope = slot.nScopes++;
+	slot.names[scope] = name;
+	glQueryCounter(slot.queries[2 * scope], GL_TIMESTAMP);
+	return scope;
+}
+
+void GPUTimer::End(int scope) {
+	if (!active || scope < 0) return;
+	glQueryCounter(slots[current].queries[2 * scope + 1], GL_TIMESTAMP);
+}
+
+void GPUTimer::collect(Slot& slot) {
+	GLint available = 0;
+	// the frame is the first scope of the slot, its end is the last query issued by the frame
+	glGetQueryObjectiv(slot.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) nStalls++;
+	for (int i = 0; i < slot.nScopes; i++) {
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(slot.queries[2 * i], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(slot.queries[2 * i + 1], GL_QUERY_RESULT, &end);
+		if (benchmark.IsActive()) benchmark.AddGPUTime(slot.names[i], (end - begin) / 1.0e6, slot.measured);
+#if defined(PROFILING_ENABLED)
+		profilerRecordGPU(slot.names[i], begin + gpuToProfiler, end + gpuToProfiler);
+#endif
+	}
+	slot.pending = false;
+}
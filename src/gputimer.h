@@ -0,0 +1,50 @@
+//=============================================================================================
+// GPU timer: named scopes measured with GL_TIMESTAMP queries, read back when their slot is reused
+// three frames later, so that the measurement does not stall the pipeline
+//=============================================================================================
+#pragma once
+#include "profiler.h"
+
+//---------------------------
+class GPUTimer {
+//---------------------------
+	static const int nSlots = 3;		// frames in flight
+	static const int maxScopes = 64;	// scopes per frame, the ones above are not measured
+
+	struct Slot {
+		unsigned int queries[2 * maxScopes];	// begin and end timestamp of each scope
+		const char * names[maxScopes];
+		int nScopes = 0;
+		bool pending = false, measured = false;
+	};
+	Slot slots[nSlots];
+	int current = 0, frameScope = -1;
+	bool active = false;
+	long long gpuToProfiler = 0;		// added to GPU timestamps to get profiler time
+
+	void collect(Slot& slot);
+public:
+	int nStalls = 0;		// readbacks that had to wait for the GPU
+
+	void Start();			// creates the queries and opens the first frame
+	void BeginFrame();
+	void EndFrame();
+	void Finish();			// reads back the frames still in flight
+	bool IsActive() const { return active; }
+
+	int Begin(const char * name);	// returns the scope index to be closed, -1 if not measured
+	void End(int scope);
+};
+
+extern GPUTimer gpuTimer;
+
+//---------------------------
+class GPUScope {
+//---------------------------
+	int scope;
+public:
+	GPUScope(const char * name) : scope(gpuTimer.Begin(name)) { }
+	~GPUScope() { gpuTimer.End(scope); }
+};
+
+#define GPU_SCOPE(name) GPUScope PROFILE_CONCAT(gpuScope, __LINE__)(name)
@@ -0,0 +1,139 @@
+//=============================================================================================
+// Headless backend: GL 3.3 core context without a window, rendering into an offscreen FBO
+//=============================================================================================
+#include "framework.h"
+#include "headless.h"
+
+#if defined(__linux__) && !defined(SOFTWARE_ONLY)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static unsigned int fbo = 0, colorBuffer = 0, depthBuffer = 0;
+static unsigned int resolveFbo = 0, resolveBuffer = 0;	// single sampled copy of a multisampled frame
+static int fboWidth = 0, fboHeight = 0;
+
+static EGLDisplay openDisplay() {
+	// prefer the surfaceless platform of Mesa, it needs neither X11 nor a GPU
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay) {
+		EGLDisplay surfaceless = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+		if (surfaceless != EGL_NO_DISPLAY) return surfaceless;
+	}
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+bool createHeadlessContext(int width, int height, int samples) {
+	display = openDisplay();
+	EGLint major, minor;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+		printf("Error in EGL initialization\n");
+		return false;
+	}
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		printf("EGL cannot bind the desktop OpenGL API\n");
+		return false;
+	}
+
+	// no surface is ever created, so the config only matters for drivers without configless contexts
+	const EGLint configAttribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config = nullptr;
+	EGLint nConfigs = 0;
+	eglChooseConfig(display, configAttribs, &config, 1, &nConfigs);
+
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	context = eglCreateContext(display, nConfigs > 0 ? config : nullptr, EGL_NO_CONTEXT, contextAttribs);
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		printf("Error in EGL context creation: 0x%x\n", eglGetError());
+		return false;
+	}
+
+	glewExperimental = true;	// magic
+	unsigned int glewError = glewInit();
+	// a GLX build of GLEW loads the GL entry points and only then misses the X display
+	if (glewError != GLEW_OK && glewError != GLEW_ERROR_NO_GLX_DISPLAY) {
+		printf("Error in GLEW initialization: %s\n", glewGetErrorString(glewError));
+		return false;
+	}
+
+	// the offscreen render target replaces the back buffer of the window
+	int maxSamples = 1;
+	glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+	if (samples > maxSamples) {
+		printf("%d samples are not supported, using %d\n", samples, maxSamples);
+		samples = maxSamples;
+	}
+	if (samples < 2) samples = 0;
+	fboWidth = width; fboHeight = height;
+	glGenRenderbuffers(1, &colorBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+	glGenRenderbuffers(1, &depthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+
+	if (samples > 0) {
+		glGenRenderbuffers(1, &resolveBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, resolveBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glGenFramebuffers(1, &resolveFbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, resolveFbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, resolveBuffer);
+	}
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("Offscreen framebuffer is incomplete\n");
+		return false;
+	}
+	return true;
+}
+
+unsigned int headlessFramebuffer() { return fbo; }
+
+void resolveHeadlessFramebuffer() {
+	if (resolveFbo == 0) return;
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFbo);
+	glBlitFramebuffer(0, 0, fboWidth, fboHeight, 0, 0, fboWidth, fboHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, resolveFbo);
+}
+
+void destroyHeadlessContext() {
+	if (fbo > 0) glDeleteFramebuffers(1, &fbo);
+	if (colorBuffer > 0) glDeleteRenderbuffers(1, &colorBuffer);
+	if (depthBuffer > 0) glDeleteRenderbuffers(1, &depthBuffer);
+	if (resolveFbo > 0) glDeleteFramebuffers(1, &resolveFbo);
+	if (resolveBuffer > 0) glDeleteRenderbuffers(1, &resolveBuffer);
+	fbo = colorBuffer = depthBuffer = resolveFbo = resolveBuffer = 0;
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+	eglTerminate(display);
+	context = EGL_NO_CONTEXT;
+	display = EGL_NO_DISPLAY;
+}
+
+#else
+
+bool createHeadlessContext(int, int, int) {
+	printf("The headless backend needs EGL, which is not available in this build\n");
+	return false;
+}
+
+unsigned int headlessFramebuffer() { return 0; }
+
+void resolveHeadlessFramebuffer() { }
+
+void destroyHeadlessContext() { }
+
+#endif
@@ -0,0 +1,16 @@
+//=============================================================================================
+// Headless backend: GL 3.3 core context without a window, rendering into an offscreen FBO
+//=============================================================================================
+#pragma once
+
+// Creates the context through EGL surfaceless (works on Mesa llvmpipe) and binds an FBO of the given size,
+// multisampled if more than one sample is asked for
+bool createHeadlessContext(int width, int height, int samples = 1);
+
+// Framebuffer object that replaces the window's back buffer
+unsigned int headlessFramebuffer();
+
+// Resolves a multisampled framebuffer and binds the result for reading, so that glReadPixels sees the frame
+void resolveHeadlessFramebuffer();
+
+void destroyHeadlessContext();
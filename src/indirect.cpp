@@ -0,0 +1,78 @@
+//=============================================================================================
+// Indirect draws: command and per-draw data buffers of the frame, multi-draw submission
+//=============================================================================================
+#include "indirect.h"
+#include <string.h>
+
+bool indirectDrawsSupported() {
+	return GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance && GLEW_ARB_shader_storage_buffer_object);
+}
+
+void IndirectDraws::Create(size_t _maxDraws, size_t _dataBytes) {
+	PROFILE_ZONE("IndirectDraws::Create");
+	AllocScope allocScope(ALLOC_SCENE);
+	maxDraws = _maxDraws;
+	dataBytes = _dataBytes;
+	commands.reserve(maxDraws);
+	data.resize(maxDraws * dataBytes);
+	glGenBuffers(frameCount, commandBuffers);
+	glGenBuffers(frameCount, dataBuffers);
+
+	std::vector<unsigned int> drawIndices(maxDraws);
+	for (size_t i = 0; i < maxDraws; i++) drawIndices[i] = (unsigned int)i;
+	glGenBuffers(1, &drawIndexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, drawIndexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, maxDraws * sizeof(unsigned int), drawIndices.data(), GL_STATIC_DRAW);
+	glStats.vboMemory += maxDraws * sizeof(unsigned int);
+	glStats.Upload(maxDraws * sizeof(unsigned int));
+	meshPool.SetDrawIndices(drawIndexBuffer);
+}
+
+void IndirectDraws::Begin() {
+	commands.clear();
+	frame = (frame + 1) % frameCount;
+}
+
+int IndirectDraws::Add(const MeshRange& range, const void * drawData) {
+	if (commands.size() >= maxDraws) return -1;
+	unsigned int index = (unsigned int)commands.size();
+	commands.push_back(DrawElementsIndirectCommand{ range.indexCount, 1, range.firstIndex, (int)range.firstVertex, index });
+	memcpy(&data[index * dataBytes], drawData, dataBytes);
+	return (int)index;
+}
+
+void IndirectDraws::End() {
+	PROFILE_ZONE("IndirectDraws::End");
+	const size_t bytes[2] = { commands.size() * sizeof(DrawElementsIndirectCommand), commands.size() * dataBytes };
+	const unsigned int targets[2] = { GL_DRAW_INDIRECT_BUFFER, GL_SHADER_STORAGE_BUFFER };
+	const unsigned int names[2] = { commandBuffers[frame], dataBuffers[frame] };
+	const void * sources[2] = { commands.data(), data.data() };
+	for (int i = 0; i < 2; i++) {
+		glBindBuffer(targets[i], names[i]);
+		glBufferData(targets[i], bytes[i], sources[i], GL_STREAM_DRAW);
+		glStats.vboMemory += bytes[i] - bufferBytes[frame][i];
+		bufferBytes[frame][i] = bytes[i];
+		glStats.Upload(bytes[i]);
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, dataBinding, dataBuffers[frame]);
+}
+
+void IndirectDraws::Draw(unsigned int first, unsigned int count) {
+	if (count == 0) return;
+	meshPool.Bind();
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffers[frame]);
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(first * sizeof(DrawElementsIndirectCommand)), count, 0);
+	unsigned int drawVertices = 0;
+	for (unsigned int i = first; i < first + count; i++) drawVertices += commands[i].count;
+	glStats.Draw(drawVertices, drawVertices / 3);
+}
+
+IndirectDraws::~IndirectDraws() {
+	if (Created()) {
+		glDeleteBuffers(frameCount, commandBuffers);
+		glDeleteBuffers(frameCount, dataBuffers);
+		glDeleteBuffers(1, &drawIndexBuffer);
+		glStats.vboMemory -= maxDraws * sizeof(unsigned int);
+	}
+	for (int f = 0; f < frameCount; f++) glStats.vboMemory -= bufferBytes[f][0] + bufferBytes[f][1];
+}
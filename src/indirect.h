@@ -0,0 +1,44 @@
+//=============================================================================================
+// Indirect draws: the pooled meshes of a frame as DrawElementsIndirectCommand records with a
+// shader storage buffer of per-draw data, drawn by glMultiDrawElementsIndirect (GL 4.3)
+//=============================================================================================
+#pragma once
+#include "framework.h"
+#include "meshpool.h"
+
+struct DrawElementsIndirectCommand {	// the layout read by glMultiDrawElementsIndirect
+	unsigned int count, instanceCount, firstIndex;
+	int baseVertex;
+	unsigned int baseInstance;			// the index of the per-draw data, read by the draw index attribute
+};
+
+// GL 4.3 or the multi-draw indirect, base instance and shader storage extensions
+bool indirectDrawsSupported();
+
+//---------------------------
+class IndirectDraws {
+//---------------------------
+	// Frames alternate between sets of buffers, the upload does not wait for the draws of the last frame
+	static const int frameCount = 2;
+	unsigned int commandBuffers[frameCount] = {}, dataBuffers[frameCount] = {}, drawIndexBuffer = 0;
+	size_t bufferBytes[frameCount][2] = {};		// of the commands and of the data, allocated by the last uploads
+	int frame = 0;
+	size_t maxDraws = 0, dataBytes = 0;
+	std::vector<DrawElementsIndirectCommand> commands;
+	std::vector<unsigned char> data;	// dataBytes per draw
+public:
+	static const unsigned int dataBinding = 0;	// shader storage binding of the per-draw data
+
+	// The draw index attribute goes into the vertex arrays of the mesh pool
+	void Create(size_t maxDraws, size_t dataBytes);
+	bool Created() const { return commandBuffers[0] != 0; }
+
+	void Begin();
+	// A draw of the mesh with its data, the index of the command
+	int Add(const MeshRange& range, const void * drawData);
+	unsigned int Count() const { return (unsigned int)commands.size(); }
+	void End();		// uploads the commands and the data of the frame
+	// One call draws the commands first .. first + count - 1 with the vertex array of the pool
+	void Draw(unsigned int first, unsigned int count);
+	~IndirectDraws();
+};
@@ -0,0 +1,162 @@
+//=============================================================================================
+// Light grid of clustered forward shading: per-light cluster bounds, per-slice binning on the
+// worker pool and the texture buffers of the shaders
+//=============================================================================================
+#include "lightgrid.h"
+#include "workers.h"
+#include <string.h>
+#include <algorithm>
+
+bool sphereScreenRect(vec4 wCenter, float radius, const mat4& V, const mat4& P, float fp, vec4& rect) {
+	vec4 center = wCenter * V;
+	rect = vec4(-1, -1, 1, 1);
+	if (-center.z + radius < fp) return false;
+	if (-center.z - radius < fp) return true;
+	vec4 bounds(1, 1, -1, -1);
+	for (int i = 0; i < 8; i++) {
+		vec4 corner = vec4(center.x + (i & 1 ? radius : -radius), center.y + (i & 2 ? radius : -radius),
+						   center.z + (i & 4 ? radius : -radius), 1) * P;
+		float x = corner.x / corner.w, y = corner.y / corner.w;
+		bounds = vec4(fmin(bounds.x, x), fmin(bounds.y, y), fmax(bounds.z, x), fmax(bounds.w, y));
+	}
+	rect = vec4(fmax(bounds.x, -1.0f), fmax(bounds.y, -1.0f), fmin(bounds.z, 1.0f), fmin(bounds.w, 1.0f));
+	return rect.x < rect.z && rect.y < rect.w;
+}
+
+static bool unbounded(vec4 wLightPos, float range) { return range <= 0 || wLightPos.w == 0; }
+
+void LightGrid::Create(size_t maxLights) {
+	PROFILE_ZONE("LightGrid::Create");
+	AllocScope allocScope(ALLOC_SCENE);
+	lights.reserve(maxLights);
+	bounds.reserve(maxLights);
+	clusters.resize(2 * clusterCount);
+	// lists grow past this only if the average cluster sees more than 64 lights
+	indices.reserve(maxLights + clusterCount * std::min(maxLights, (size_t)64));
+
+	const unsigned int formats[BUFFER_COUNT] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+	glGenBuffers(frameCount * BUFFER_COUNT, &buffers[0][0]);
+	glGenTextures(frameCount * BUFFER_COUNT, &textures[0][0]);
+	for (int f = 0; f < frameCount; f++) for (int i = 0; i < BUFFER_COUNT; i++) {
+		glBindBuffer(GL_TEXTURE_BUFFER, buffers[f][i]);
+		glBufferData(GL_TEXTURE_BUFFER, 0, nullptr, GL_STREAM_DRAW);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[f][i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[f][i]);
+	}
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void LightGrid::Begin(int _width, int _height, const mat4& _V, const mat4& _P, float _fp, float _bp) {
+	width = _width; height = _height;
+	V = _V; P = _P;
+	fp = _fp; bp = _bp;
+	sliceScale = slices / logf(bp / fp);
+	lights.clear();
+	frame = (frame + 1) % frameCount;
+}
+
+void LightGrid::AddLight(vec4 wLightPos, vec3 Le, float range) { lights.push_back(GPULight{ wLightPos, Le, range }); }
+
+int LightGrid::slice(float z) const {
+	if (z <= fp) return 0;
+	int s = (int)(logf(z / fp) * sliceScale);
+	return s < slices ? s : slices - 1;
+}
+
+void LightGrid::bound(int light) {
+	const GPULight& l = lights[light];
+	Bounds& b = bounds[light];
+	b = Bounds{ 1, 0, 1, 0, 1, 0 };		// empty
+	if (unbounded(l.wLightPos, l.range)) return;	// in the global list instead
+	vec4 wCenter = l.wLightPos / l.wLightPos.w;
+	float z = -(wCenter * V).z;
+	vec4 rect;
+	if (z - l.range > bp || !sphereScreenRect(wCenter, l.range, V, P, fp, rect)) return;
+	auto tile = [](float ndc, int n) {
+		int t = (int)floorf((ndc + 1) / 2 * n);
+		return t < 0 ? 0 : t < n ? t : n - 1;
+	};
+	b = Bounds{ tile(rect.x, tilesX), tile(rect.z, tilesX), tile(rect.y, tilesY), tile(rect.w, tilesY),
+				slice(z - l.range), slice(z + l.range) };
+}
+
+void LightGrid::fillSlice(int z, bool count) {
+	for (size_t i = 0; i < lights.size(); i++) {
+		const Bounds& b = bounds[i];
+		if (b.x0 > b.x1 || z < b.z0 || z > b.z1) continue;
+		for (int y = b.y0; y <= b.y1; y++) {
+			unsigned int * cluster = &clusters[2 * ((z * tilesY + y) * tilesX + b.x0)];
+			for (int x = b.x0; x <= b.x1; x++, cluster += 2) {
+				if (count) cluster[1]++;
+				else indices[cluster[0] + cluster[1]++] = (unsigned int)i;
+			}
+		}
+	}
+}
+
+void LightGrid::End() {
+	PROFILE_ZONE("LightGrid::End");
+	int nLights = (int)lights.size();
+	bounds.resize(lights.size());
+	auto boundJob = [this](int light, int) { bound(light); };
+	workerPool.ParallelFor(nLights, boundJob);
+
+	// each slice is owned by one thread, the clusters of different slices do not overlap
+	memset(&clusters[0], 0, clusters.size() * sizeof(unsigned int));
+	auto countJob = [this](int z, int) { fillSlice(z, true); };
+	workerPool.ParallelFor(slices, countJob);
+
+	indices.clear();
+	for (int i = 0; i < nLights; i++) if (unbounded(lights[i].wLightPos, lights[i].range)) indices.push_back(i);
+	nGlobal = (unsigned int)indices.size();
+	unsigned int offset = nGlobal;
+	for (int c = 0; c < clusterCount; c++) {
+		unsigned int n = clusters[2 * c + 1];
+		clusters[2 * c] = offset;
+		clusters[2 * c + 1] = 0;	// counted again while the list is written
+		offset += n;
+	}
+	indices.resize(offset);
+	auto fillJob = [this](int z, int) { fillSlice(z, false); };
+	workerPool.ParallelFor(slices, fillJob);
+
+	upload(LIGHTS, lights.data(), lights.size() * sizeof(GPULight));
+	upload(CLUSTERS, clusters.data(), clusters.size() * sizeof(unsigned int));
+	upload(INDICES, indices.data(), indices.size() * sizeof(unsigned int));
+}
+
+void LightGrid::upload(int buffer, const void * data, size_t bytes) {
+	PROFILE_ZONE("LightGrid::upload");
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[frame][buffer]);
+	glBufferData(GL_TEXTURE_BUFFER, bytes, data, GL_STREAM_DRAW);
+	glStats.vboMemory += bytes - bufferBytes[frame][buffer];
+	bufferBytes[frame][buffer] = bytes;
+	glStats.Upload(bytes);
+}
+
+void LightGrid::Bind(GPUProgram& program, unsigned int firstUnit) const {
+	const char * samplers[BUFFER_COUNT] = { "lightData", "clusters", "lightIndices" };
+	for (int i = 0; i < BUFFER_COUNT; i++) {
+		glActiveTexture(GL_TEXTURE0 + firstUnit + i);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[frame][i]);
+		glStats.BindTexture();
+		program.setUniform((int)firstUnit + i, samplers[i]);
+	}
+	program.setUniform((int)nGlobal, "nGlobalLights");
+	program.setUniform(vec2((float)tilesX / width, (float)tilesY / height), "tileScale");
+	program.setUniform(tilesX, "tilesX");
+	program.setUniform(tilesY, "tilesY");
+	program.setUniform(slices, "slices");
+	program.setUniform(fp, "fp");
+	program.setUniform(bp, "bp");
+	program.setUniform(sliceScale, "sliceScale");
+}
+
+LightGrid::~LightGrid() {
+	if (Created()) {
+		glDeleteTextures(frameCount * BUFFER_COUNT, &textures[0][0]);
+		glDeleteBuffers(frameCount * BUFFER_COUNT, &buffers[0][0]);
+	}
+	for (int f = 0; f < frameCount; f++) for (size_t bytes : bufferBytes[f]) glStats.vboMemory -= bytes;
+}
@@ -0,0 +1,62 @@
+//=============================================================================================
+// Light grid of clustered forward shading: the lights of the scene are binned into the froxels
+// (view frustum cells, screen tiles times exponential depth slices) on the CPU in parallel, the
+// per-cluster light index lists are read by the shaders from texture buffers
+//=============================================================================================
+#pragma once
+#include "framework.h"
+
+// Screen rectangle (min x, min y, max x, max y in NDC) of the bounding box of a sphere in world space.
+// False if the sphere is behind the near plane or off screen, a sphere reaching the near plane covers the screen.
+bool sphereScreenRect(vec4 wCenter, float radius, const mat4& V, const mat4& P, float fp, vec4& rect);
+
+//---------------------------
+class LightGrid {
+//---------------------------
+public:
+	static const int tilesX = 16, tilesY = 16, slices = 24;
+	static const int clusterCount = tilesX * tilesY * slices;
+private:
+	struct GPULight {			// two texels of the light buffer
+		vec4 wLightPos;
+		vec3 Le;
+		float range;
+	};
+	struct Bounds {				// clusters touched by a light, inclusive; empty if x0 > x1
+		int x0, x1, y0, y1, z0, z1;
+	};
+
+	int width = 0, height = 0;
+	mat4 V, P;
+	float fp = 1, bp = 100, sliceScale = 1;	// slice of view depth z is log(z / fp) * sliceScale
+	std::vector<GPULight> lights;
+	std::vector<Bounds> bounds;
+	std::vector<unsigned int> clusters;		// offset and count of the index list of each cluster
+	std::vector<unsigned int> indices;		// the unbounded lights first, then the lists of the clusters
+	unsigned int nGlobal = 0;				// lights without a range, every cluster has them
+	enum { LIGHTS, CLUSTERS, INDICES, BUFFER_COUNT };
+	// Frames alternate between sets of texture buffers, the upload does not wait for the draws of the last frame
+	static const int frameCount = 2;
+	unsigned int buffers[frameCount][BUFFER_COUNT] = {}, textures[frameCount][BUFFER_COUNT] = {};
+	size_t bufferBytes[frameCount][BUFFER_COUNT] = {};
+	int frame = 0;
+
+	int slice(float z) const;
+	void bound(int light);					// fills bounds[light]
+	void fillSlice(int z, bool count);		// counts or writes the index lists of the clusters of slice z
+	void upload(int buffer, const void * data, size_t bytes);
+public:
+	void Create(size_t maxLights);			// GL objects and CPU storage of the lights of the scene
+	bool Created() const { return buffers[0][LIGHTS] != 0; }
+
+	void Begin(int width, int height, const mat4& V, const mat4& P, float fp, float bp);
+	void AddLight(vec4 wLightPos, vec3 Le, float range);	// a zero range reaches everywhere
+	void End();		// bins the lights on the worker pool and uploads the lists
+
+	// Binds the texture buffers to units firstUnit .. firstUnit + 2 and sets the grid uniforms of the program.
+	// The texture buffers are not recorded by the command recorder.
+	void Bind(GPUProgram& program, unsigned int firstUnit) const;
+
+	unsigned int IndexCount() const { return (unsigned int)indices.size(); }	// of the last frame
+	~LightGrid();
+};
@@ -0,0 +1,170 @@
+//=============================================================================================
+// Mesh pool: first fit sub-allocation from free lists, the buffers double when a mesh does not fit
+//=============================================================================================
+#include "meshpool.h"
+#include <algorithm>
+
+MeshPool meshPool;
+
+static const size_t initialVertices = 1 << 16, initialIndices = 1 << 18;
+
+void MeshPool::create() {
+	glGenVertexArrays(1, &vao);
+	vertices.elementBytes = sizeof(SoftVertex);
+	indices.elementBytes = sizeof(unsigned int);
+	grow(vertices, initialVertices);
+	grow(indices, initialIndices);
+	setVertexArrays();
+}
+
+bool MeshPool::take(Buffer& buffer, unsigned int count, unsigned int& first) {
+	for (size_t i = 0; i < buffer.free.size(); i++) {
+		Block& block = buffer.free[i];
+		if (block.count < count) continue;
+		first = block.first;
+		block.first += count;
+		block.count -= count;
+		if (block.count == 0) buffer.free.erase(buffer.free.begin() + i);
+		return true;
+	}
+	return false;
+}
+
+// The block is merged with its free neighbors
+void MeshPool::give(Buffer& buffer, Block block) {
+	std::vector<Block>& free = buffer.free;
+	auto it = std::lower_bound(free.begin(), free.end(), block.first,
+							   [](const Block& b, unsigned int first) { return b.first < first; });
+	it = free.insert(it, block);
+	if (it + 1 != free.end() && it->first + it->count == (it + 1)->first) {
+		it->count += (it + 1)->count;
+		free.erase(it + 1);
+	}
+	if (it != free.begin() && (it - 1)->first + (it - 1)->count == it->first) {
+		(it - 1)->count += it->count;
+		free.erase(it);
+	}
+}
+
+// A larger buffer gets a copy of the old one, the new elements are free. The positions have no free list
+// of their own, they follow the vertices.
+void MeshPool::grow(Buffer& buffer, size_t capacity) {
+	unsigned int name;
+	glGenBuffers(1, &name);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+	glBufferData(GL_COPY_WRITE_BUFFER, capacity * buffer.elementBytes, nullptr, GL_STATIC_DRAW);
+	if (buffer.name != 0) {
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer.name);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, buffer.capacity * buffer.elementBytes);
+		glDeleteBuffers(1, &buffer.name);
+	}
+	glStats.vboMemory += (capacity - buffer.capacity) * buffer.elementBytes;
+	if (&buffer != &positions) give(buffer, Block{ (unsigned int)buffer.capacity, (unsigned int)(capacity - buffer.capacity) });
+	buffer.name = name;
+	buffer.capacity = capacity;
+}
+
+void MeshPool::setVertexArrays() {
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, vertices.name);
+	glEnableVertexAttribArray(0);  // attribute array 0 = POSITION
+	glEnableVertexAttribArray(1);  // attribute array 1 = NORMAL
+	glEnableVertexAttribArray(2);  // attribute array 2 = TEXCOORD0
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SoftVertex), (void*)offsetof(SoftVertex, position));
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(SoftVertex), (void*)offsetof(SoftVertex, normal));
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(SoftVertex), (void*)offsetof(SoftVertex, texcoord));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices.name);
+	if (drawIndexBuffer != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, drawIndexBuffer);
+		glEnableVertexAttribArray(3);  // attribute array 3 = draw index of the instance
+		glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(unsigned int), (void*)0);
+		glVertexAttribDivisor(3, 1);
+	}
+	if (positionVao != 0) {
+		glBindVertexArray(positionVao);
+		glBindBuffer(GL_ARRAY_BUFFER, positions.name);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), (void*)0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices.name);
+	}
+	glBindVertexArray(0);
+}
+
+MeshRange MeshPool::Allocate(const SoftVertex * vertexData, unsigned int vertexCount,
+							 const unsigned int * indexData, unsigned int indexCount, bool withPositions) {
+	PROFILE_ZONE("MeshPool::Allocate");
+	AllocScope allocScope(ALLOC_GEOMETRY);
+	if (vao == 0) create();
+	if (withPositions && positionVao == 0) {	// parallel to the vertices, their free list is used for both
+		glGenVertexArrays(1, &positionVao);
+		positions.elementBytes = sizeof(vec3);
+		grow(positions, vertices.capacity);
+		setVertexArrays();
+	}
+	MeshRange range;
+	range.vertexCount = vertexCount;
+	range.indexCount = indexCount;
+	bool grown = false;
+	while (!take(vertices, vertexCount, range.firstVertex)) {
+		if (positionVao != 0) grow(positions, vertices.capacity * 2);
+		grow(vertices, vertices.capacity * 2);
+		grown = true;
+	}
+	while (!take(indices, indexCount, range.firstIndex)) {
+		grow(indices, indices.capacity * 2);
+		grown = true;
+	}
+	if (grown) setVertexArrays();
+
+	// uploads through the copy target, the element array binding belongs to the bound vertex array
+	glBindBuffer(GL_COPY_WRITE_BUFFER, vertices.name);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, range.firstVertex * sizeof(SoftVertex), vertexCount * sizeof(SoftVertex), vertexData);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, indices.name);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, range.firstIndex * sizeof(unsigned int), indexCount * sizeof(unsigned int), indexData);
+	glStats.Upload(vertexCount * sizeof(SoftVertex) + indexCount * sizeof(unsigned int));
+	if (withPositions) {
+		std::vector<vec3> positionData(vertexCount);
+		for (unsigned int i = 0; i < vertexCount; i++) positionData[i] = vertexData[i].position;
+		glBindBuffer(GL_COPY_WRITE_BUFFER, positions.name);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, range.firstVertex * sizeof(vec3), vertexCount * sizeof(vec3), &positionData[0]);
+		glStats.Upload(vertexCount * sizeof(vec3));
+	}
+	meshes++;
+	return range;
+}
+
+void MeshPool::Free(const MeshRange& range) {
+	if (range.vertexCount > 0) give(vertices, Block{ range.firstVertex, range.vertexCount });
+	if (range.indexCount > 0) give(indices, Block{ range.firstIndex, range.indexCount });
+	meshes--;
+}
+
+void MeshPool::Draw(const MeshRange& range, bool positionsOnly) {
+	unsigned int vertexArray = positionsOnly && positionVao != 0 ? positionVao : vao;
+	glBindVertexArray(vertexArray);
+	glStats.BindVertexArray();
+	commandRecorder.VertexArray(vertexArray);
+	glDrawElementsBaseVertex(GL_TRIANGLES, range.indexCount, GL_UNSIGNED_INT,
+							 (void*)(range.firstIndex * sizeof(unsigned int)), range.firstVertex);
+	glStats.Draw(range.indexCount, range.indexCount / 3);
+	commandRecorder.DrawElements(GL_TRIANGLES, range.indexCount, range.firstIndex, range.firstVertex);
+}
+
+void MeshPool::Bind() {
+	glBindVertexArray(vao);
+	glStats.BindVertexArray();
+}
+
+void MeshPool::SetDrawIndices(unsigned int buffer) {
+	drawIndexBuffer = buffer;
+	if (vao != 0) setVertexArrays();
+}
+
+MeshPool::~MeshPool() {
+	for (Buffer * buffer : { &vertices, &positions, &indices }) {
+		if (buffer->name != 0) glDeleteBuffers(1, &buffer->name);
+		glStats.vboMemory -= buffer->capacity * buffer->elementBytes;
+	}
+	if (vao != 0) glDeleteVertexArrays(1, &vao);
+	if (positionVao != 0) glDeleteVertexArrays(1, &positionVao);
+}
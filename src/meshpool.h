@@ -0,0 +1,51 @@
+//=============================================================================================
+// Mesh pool: the indexed meshes of the parametric surfaces sub-allocated from one vertex buffer
+// and one index buffer, so every mesh is drawn with the same vertex array
+//=============================================================================================
+#pragma once
+#include "framework.h"
+#include "softraster.h"
+
+struct MeshRange {	// vertices and indices of a mesh in the pool, the indices are relative to firstVertex
+	unsigned int firstVertex = 0, vertexCount = 0;
+	unsigned int firstIndex = 0, indexCount = 0;
+};
+
+//---------------------------
+class MeshPool {
+//---------------------------
+	struct Block {		// free elements first .. first + count - 1
+		unsigned int first, count;
+	};
+	struct Buffer {		// a growing buffer with the free blocks of its elements, sorted by first, none for the positions
+		unsigned int name = 0;
+		size_t elementBytes = 0, capacity = 0;
+		std::vector<Block> free;
+	};
+
+	unsigned int vao = 0;			// vertices and indices of every mesh
+	unsigned int positionVao = 0;	// the position stream with the same indices, of the depth pre-pass
+	Buffer vertices, positions, indices;
+	unsigned int drawIndexBuffer = 0;	// per-instance attribute 3 of the vertex arrays, the draw index of indirect draws
+	unsigned int meshes = 0;
+
+	void create();
+	bool take(Buffer& buffer, unsigned int count, unsigned int& first);
+	void give(Buffer& buffer, Block block);
+	void grow(Buffer& buffer, size_t capacity);
+	void setVertexArrays();
+public:
+	// The vertices are copied into the pool, the indices of the triangles count from the first of them.
+	// Positions only get a copy in the stream of the depth pre-pass if withPositions.
+	MeshRange Allocate(const SoftVertex * vertexData, unsigned int vertexCount,
+					   const unsigned int * indexData, unsigned int indexCount, bool withPositions);
+	void Free(const MeshRange& range);		// the elements are reused by the next meshes
+
+	void Draw(const MeshRange& range, bool positionsOnly);	// indexed triangles with the vertex array of the pool
+	void Bind();						// the vertex array of the pool for the indirect draws
+	void SetDrawIndices(unsigned int buffer);	// an unsigned int per instance, the base instance picks one
+	unsigned int MeshCount() const { return meshes; }
+	~MeshPool();
+};
+
+extern MeshPool meshPool;
@@ -0,0 +1,10 @@
+//=============================================================================================
+// GL-free build (SOFTWARE_ONLY): the entry points of nogl.h, none of them is ever called
+//=============================================================================================
+#if defined(SOFTWARE_ONLY)
+#include "nogl.h"
+
+#define NOGL_DEFINE(name, type) type name = nullptr;
+NOGL_FUNCTIONS(NOGL_DEFINE)
+#undef NOGL_DEFINE
+#endif
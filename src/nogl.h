@@ -0,0 +1,87 @@
+//=============================================================================================
+// GL-free build (SOFTWARE_ONLY): the types and constants of the core profile header without any GL
+// library, for the software rasterizer and the ray tracer on machines without a GPU or Mesa
+//=============================================================================================
+#pragma once
+#include <GL/glcorearb.h>	// declares no entry points without GL_GLEXT_PROTOTYPES
+
+// Every GL call of the tree is a null function pointer, hasGLContext() is false so none of them is made
+#define NOGL_FUNCTIONS(F) \
+	F(glActiveTexture, PFNGLACTIVETEXTUREPROC) F(glAttachShader, PFNGLATTACHSHADERPROC) \
+	F(glBeginQuery, PFNGLBEGINQUERYPROC) F(glBindBuffer, PFNGLBINDBUFFERPROC) \
+	F(glBindBufferBase, PFNGLBINDBUFFERBASEPROC) F(glBindBufferRange, PFNGLBINDBUFFERRANGEPROC) \
+	F(glBindFragDataLocation, PFNGLBINDFRAGDATALOCATIONPROC) F(glBindFramebuffer, PFNGLBINDFRAMEBUFFERPROC) \
+	F(glBindImageTexture, PFNGLBINDIMAGETEXTUREPROC) F(glBindRenderbuffer, PFNGLBINDRENDERBUFFERPROC) \
+	F(glBindTexture, PFNGLBINDTEXTUREPROC) F(glBindVertexArray, PFNGLBINDVERTEXARRAYPROC) \
+	F(glBlendFunc, PFNGLBLENDFUNCPROC) F(glBlendFuncSeparate, PFNGLBLENDFUNCSEPARATEPROC) \
+	F(glBlitFramebuffer, PFNGLBLITFRAMEBUFFERPROC) F(glBufferData, PFNGLBUFFERDATAPROC) \
+	F(glBufferStorage, PFNGLBUFFERSTORAGEPROC) F(glBufferSubData, PFNGLBUFFERSUBDATAPROC) \
+	F(glCheckFramebufferStatus, PFNGLCHECKFRAMEBUFFERSTATUSPROC) F(glClear, PFNGLCLEARPROC) \
+	F(glClearBufferData, PFNGLCLEARBUFFERDATAPROC) F(glClearBufferfv, PFNGLCLEARBUFFERFVPROC) \
+	F(glClearColor, PFNGLCLEARCOLORPROC) F(glClearDepth, PFNGLCLEARDEPTHPROC) \
+	F(glClientWaitSync, PFNGLCLIENTWAITSYNCPROC) F(glColorMask, PFNGLCOLORMASKPROC) \
+	F(glCompileShader, PFNGLCOMPILESHADERPROC) F(glCopyBufferSubData, PFNGLCOPYBUFFERSUBDATAPROC) \
+	F(glCreateProgram, PFNGLCREATEPROGRAMPROC) F(glCreateShader, PFNGLCREATESHADERPROC) \
+	F(glDeleteBuffers, PFNGLDELETEBUFFERSPROC) F(glDeleteFramebuffers, PFNGLDELETEFRAMEBUFFERSPROC) \
+	F(glDeleteProgram, PFNGLDELETEPROGRAMPROC) F(glDeleteQueries, PFNGLDELETEQUERIESPROC) \
+	F(glDeleteRenderbuffers, PFNGLDELETERENDERBUFFERSPROC) F(glDeleteSync, PFNGLDELETESYNCPROC) \
+	F(glDeleteTextures, PFNGLDELETETEXTURESPROC) F(glDeleteVertexArrays, PFNGLDELETEVERTEXARRAYSPROC) \
+	F(glDepthFunc, PFNGLDEPTHFUNCPROC) F(glDepthMask, PFNGLDEPTHMASKPROC) F(glDisable, PFNGLDISABLEPROC) \
+	F(glDispatchCompute, PFNGLDISPATCHCOMPUTEPROC) F(glDrawArrays, PFNGLDRAWARRAYSPROC) \
+	F(glDrawBuffer, PFNGLDRAWBUFFERPROC) F(glDrawBuffers, PFNGLDRAWBUFFERSPROC) \
+	F(glDrawElementsBaseVertex, PFNGLDRAWELEMENTSBASEVERTEXPROC) F(glEnable, PFNGLENABLEPROC) \
+	F(glEnableVertexAttribArray, PFNGLENABLEVERTEXATTRIBARRAYPROC) F(glEndQuery, PFNGLENDQUERYPROC) \
+	F(glFenceSync, PFNGLFENCESYNCPROC) F(glFinish, PFNGLFINISHPROC) \
+	F(glFramebufferRenderbuffer, PFNGLFRAMEBUFFERRENDERBUFFERPROC) \
+	F(glFramebufferTexture2D, PFNGLFRAMEBUFFERTEXTURE2DPROC) F(glGenBuffers, PFNGLGENBUFFERSPROC) \
+	F(glGenFramebuffers, PFNGLGENFRAMEBUFFERSPROC) F(glGenQueries, PFNGLGENQUERIESPROC) \
+	F(glGenRenderbuffers, PFNGLGENRENDERBUFFERSPROC) F(glGenTextures, PFNGLGENTEXTURESPROC) \
+	F(glGenVertexArrays, PFNGLGENVERTEXARRAYSPROC) F(glGetBufferSubData, PFNGLGETBUFFERSUBDATAPROC) \
+	F(glGetInteger64v, PFNGLGETINTEGER64VPROC) F(glGetIntegerv, PFNGLGETINTEGERVPROC) \
+	F(glGetProgramiv, PFNGLGETPROGRAMIVPROC) F(glGetProgramResourceIndex, PFNGLGETPROGRAMRESOURCEINDEXPROC) \
+	F(glGetQueryObjectiv, PFNGLGETQUERYOBJECTIVPROC) \
+	F(glGetQueryObjectui64v, PFNGLGETQUERYOBJECTUI64VPROC) \
+	F(glGetQueryObjectuiv, PFNGLGETQUERYOBJECTUIVPROC) F(glGetShaderInfoLog, PFNGLGETSHADERINFOLOGPROC) \
+	F(glGetShaderiv, PFNGLGETSHADERIVPROC) F(glGetString, PFNGLGETSTRINGPROC) \
+	F(glGetUniformBlockIndex, PFNGLGETUNIFORMBLOCKINDEXPROC) \
+	F(glGetUniformLocation, PFNGLGETUNIFORMLOCATIONPROC) F(glIsEnabled, PFNGLISENABLEDPROC) \
+	F(glIsProgram, PFNGLISPROGRAMPROC) F(glIsTexture, PFNGLISTEXTUREPROC) \
+	F(glIsVertexArray, PFNGLISVERTEXARRAYPROC) F(glLinkProgram, PFNGLLINKPROGRAMPROC) \
+	F(glMapBuffer, PFNGLMAPBUFFERPROC) F(glMapBufferRange, PFNGLMAPBUFFERRANGEPROC) \
+	F(glMemoryBarrier, PFNGLMEMORYBARRIERPROC) \
+	F(glMultiDrawElementsIndirect, PFNGLMULTIDRAWELEMENTSINDIRECTPROC) \
+	F(glMultiDrawElementsIndirectCountARB, PFNGLMULTIDRAWELEMENTSINDIRECTCOUNTARBPROC) \
+	F(glQueryCounter, PFNGLQUERYCOUNTERPROC) F(glReadBuffer, PFNGLREADBUFFERPROC) \
+	F(glReadPixels, PFNGLREADPIXELSPROC) F(glRenderbufferStorage, PFNGLRENDERBUFFERSTORAGEPROC) \
+	F(glRenderbufferStorageMultisample, PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC) \
+	F(glShaderSource, PFNGLSHADERSOURCEPROC) F(glShaderStorageBlockBinding, PFNGLSHADERSTORAGEBLOCKBINDINGPROC) \
+	F(glTexBuffer, PFNGLTEXBUFFERPROC) \
+	F(glTexImage2D, PFNGLTEXIMAGE2DPROC) F(glTexParameteri, PFNGLTEXPARAMETERIPROC) \
+	F(glTexStorage2D, PFNGLTEXSTORAGE2DPROC) F(glUniform1f, PFNGLUNIFORM1FPROC) \
+	F(glUniform1fv, PFNGLUNIFORM1FVPROC) F(glUniform1i, PFNGLUNIFORM1IPROC) \
+	F(glUniform1iv, PFNGLUNIFORM1IVPROC) F(glUniform2fv, PFNGLUNIFORM2FVPROC) \
+	F(glUniform3fv, PFNGLUNIFORM3FVPROC) F(glUniform4fv, PFNGLUNIFORM4FVPROC) \
+	F(glUniformBlockBinding, PFNGLUNIFORMBLOCKBINDINGPROC) F(glUniformMatrix4fv, PFNGLUNIFORMMATRIX4FVPROC) \
+	F(glUnmapBuffer, PFNGLUNMAPBUFFERPROC) F(glUseProgram, PFNGLUSEPROGRAMPROC) \
+	F(glVertexAttribDivisor, PFNGLVERTEXATTRIBDIVISORPROC) \
+	F(glVertexAttribIPointer, PFNGLVERTEXATTRIBIPOINTERPROC) \
+	F(glVertexAttribPointer, PFNGLVERTEXATTRIBPOINTERPROC) F(glViewport, PFNGLVIEWPORTPROC)
+
+#define NOGL_DECLARE(name, type) extern type name;
+NOGL_FUNCTIONS(NOGL_DECLARE)
+#undef NOGL_DECLARE
+
+// No extension is ever available
+#define GLEW_VERSION_4_2 false
+#define GLEW_VERSION_4_3 false
+#define GLEW_VERSION_4_4 false
+#define GLEW_VERSION_4_6 false
+#define GLEW_ARB_base_instance false
+#define GLEW_ARB_buffer_storage false
+#define GLEW_ARB_clear_buffer_object false
+#define GLEW_ARB_compute_shader false
+#define GLEW_ARB_indirect_parameters false
+#define GLEW_ARB_multi_draw_indirect false
+#define GLEW_ARB_shader_image_load_store false
+#define GLEW_ARB_shader_storage_buffer_object false
+#define GLEW_ARB_texture_storage false
@@ -0,0 +1,172 @@
+//=============================================================================================
+// Command line and config file options of the framework
+//=============================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include "options.h"
+
+Options options;
+
+// Matches "--name=value" and "--name value" forms, value is set to the text after the name
+static bool matchValue(int argc, char * argv[], int& i, const char * name, const char *& value) {
+	size_t len = strlen(name);
+	if (strncmp(argv[i], name, len) != 0) return false;
+	if (argv[i][len] == '=') { value = argv[i] + len + 1; return true; }
+	if (argv[i][len] == '\0' && i + 1 < argc) { value = argv[++i]; return true; }
+	return false;
+}
+
+// Comma separated positive integers, e.g. "8,20,40"
+static void parseIntList(const char * value, std::vector<int>& list) {
+	list.clear();
+	for (const char * p = value; *p; ) {
+		int v = atoi(p);
+		if (v > 0) list.push_back(v);
+		p = strchr(p, ',');
+		if (!p) break;
+		p++;
+	}
+}
+
+static void parseConfig(const char * path);
+
+static void parseArguments(int argc, char * argv[]) {
+	for (int i = 1; i < argc; i++) {
+		const char * value = nullptr;
+		if (strcmp(argv[i], "--headless") == 0) options.headless = true;
+		else if (strcmp(argv[i], "--software") == 0) options.software = options.headless = true;
+		else if (strcmp(argv[i], "--raytrace") == 0) options.raytrace = options.software = options.headless = true;
+		else if (strcmp(argv[i], "--analytic") == 0) options.analytic = options.raytrace = options.software = options.headless = true;
+		else if (matchValue(argc, argv, i, "--samples", value)) options.samples = atoi(value) > 0 ? atoi(value) : 1;
+		else if (matchValue(argc, argv, i, "--packet", value)) options.packet = atoi(value);
+		else if (matchValue(argc, argv, i, "--bounces", value)) options.bounces = atoi(value) > 0 ? atoi(value) : 0;
+		else if (matchValue(argc, argv, i, "--config", value)) parseConfig(value);
+		else if (matchValue(argc, argv, i, "--width", value)) options.width = (unsigned int)atoi(value);
+		else if (matchValue(argc, argv, i, "--height", value)) options.height = (unsigned int)atoi(value);
+		else if (matchValue(argc, argv, i, "--resolution", value)) sscanf(value, "%ux%u", &options.width, &options.height);
+		else if (matchValue(argc, argv, i, "--msaa", value)) options.msaa = atoi(value) > 1 ? atoi(value) : 1;
+		else if (matchValue(argc, argv, i, "--vsync", value)) options.vsync = atoi(value);
+		else if (matchValue(argc, argv, i, "--threads", value)) options.threads = atoi(value);
+		else if (matchValue(argc, argv, i, "--tessellation", value)) options.tessellation = atoi(value) > 0 ? atoi(value) : 20;
+		else if (matchValue(argc, argv, i, "--shader", value)) options.shader = value;
+		else if (matchValue(argc, argv, i, "--shading-rate", value)) options.shadingRate = atoi(value) > 1 ? atoi(value) : 1;
+		else if (strcmp(argv[i], "--deferred") == 0) options.deferred = true;
+		else if (strcmp(argv[i], "--clustered") == 0) options.clustered = true;
+		else if (strcmp(argv[i], "--depth-prepass") == 0) options.depthPrepass = true;
+		else if (strcmp(argv[i], "--overdraw") == 0) options.overdraw = true;
+		else if (matchValue(argc, argv, i, "--shadows", value)) options.shadows = atoi(value);
+		else if (matchValue(argc, argv, i, "--shadow-size", value)) options.shadowSize = atoi(value) > 0 ? atoi(value) : 512;
+		else if (strcmp(argv[i], "--transparent") == 0) options.transparent = true;
+		else if (strcmp(argv[i], "--stream-buffer") == 0) options.streamBuffer = true;
+		else if (strcmp(argv[i], "--mesh-pool") == 0) options.meshPool = true;
+		else if (strcmp(argv[i], "--indirect") == 0) options.indirect = options.meshPool = true;
+		else if (strcmp(argv[i], "--gpu-cull") == 0) options.gpuCull = options.indirect = options.meshPool = true;
+		else if (strcmp(argv[i], "--hiz") == 0) options.hiZ = options.gpuCull = options.indirect = options.meshPool = true;
+		else if (strcmp(argv[i], "--parallel-record") == 0) options.parallelRecord = true;
+		else if (strcmp(argv[i], "--bench") == 0) options.bench = options.headless = options.fixedClock = true;
+		else if (strcmp(argv[i], "--fixed-clock") == 0) options.fixedClock = true;
+		else if (matchValue(argc, argv, i, "--frames", value)) options.frames = atoi(value);
+		else if (matchValue(argc, argv, i, "--warmup", value)) options.warmupFrames = atoi(value);
+		else if (matchValue(argc, argv, i, "--timestep", value)) options.timestep = (float)atof(value);
+		else if (matchValue(argc, argv, i, "--bench-json", value)) options.benchJson = value;
+		else if (matchValue(argc, argv, i, "--trace", value)) options.tracePath = value;
+		else if (strcmp(argv[i], "--overlay") == 0) options.overlay = true;
+		else if (matchValue(argc, argv, i, "--stats", value)) options.statsPath = value;
+		else if (matchValue(argc, argv, i, "--capture-every", value)) options.captureEvery = atoi(value) > 0 ? atoi(value) : 1;
+		else if (matchValue(argc, argv, i, "--capture", value)) options.captureDir = value, options.fixedClock = true;
+		else if (matchValue(argc, argv, i, "--golden", value)) options.goldenDir = value, options.fixedClock = true;
+		else if (matchValue(argc, argv, i, "--tolerance", value)) options.tolerance = (float)atof(value);
+		else if (matchValue(argc, argv, i, "--pixel-threshold", value)) options.pixelThreshold = atoi(value);
+		else if (matchValue(argc, argv, i, "--lamps", value)) options.lamps = atoi(value);
+		else if (matchValue(argc, argv, i, "--lights", value)) options.lights = atoi(value);
+		else if (matchValue(argc, argv, i, "--light-range", value)) options.lightRange = (float)atof(value);
+		else if (matchValue(argc, argv, i, "--textures", value)) options.textures = atoi(value);
+		else if (matchValue(argc, argv, i, "--lod", value)) parseIntList(value, options.lodLevels);
+		else if (matchValue(argc, argv, i, "--seed", value)) options.seed = (unsigned int)strtoul(value, nullptr, 10);
+		else if (matchValue(argc, argv, i, "--record", value)) options.recordPath = value;
+		else if (matchValue(argc, argv, i, "--replay", value)) options.replayPath = value, options.headless = true;
+		else printf("Unknown option %s is ignored\n", argv[i]);
+	}
+}
+
+// Each line becomes "--name=value" or "--name" and goes through the command line parser
+static void parseConfig(const char * path) {
+	static std::vector<const char *> reading;	// files being read, each includes the next
+	static const size_t maxNesting = 16;		// also stops cycles through different spellings of a path
+	bool cycle = reading.size() >= maxNesting;
+	for (const char * including : reading) cycle = cycle || strcmp(including, path) == 0;
+	if (cycle) {
+		printf("Config file %s includes itself, it is not read again\n", path);
+		return;
+	}
+	FILE * file = fopen(path, "r");
+	if (!file) {
+		printf("Config file %s cannot be read\n", path);
+		return;
+	}
+	reading.push_back(path);
+	char line[1024];
+	while (fgets(line, sizeof(line), file)) {
+		char * comment = strchr(line, '#');
+		if (comment) *comment = '\0';
+		char * equals = strchr(line, '=');
+		if (equals) *equals = ' ';
+		char name[256] = "", value[768] = "";
+		if (sscanf(line, " %255s %767[^\r\n]", name, value) < 1) continue;
+		for (size_t len = strlen(value); len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'); len--) value[len - 1] = '\0';
+		char argument[1100];
+		snprintf(argument, sizeof(argument), value[0] ? "--%s=%s" : "--%s", name, value);
+		char * args[2] = { nullptr, strdup(argument) };	// options point into the argument, it lives until exit
+		parseArguments(2, args);
+	}
+	fclose(file);
+	reading.pop_back();
+}
+
+void parseOptions(int argc, char * argv[]) {
+	parseArguments(argc, argv);
+	if (options.width == 0 || options.height == 0) options.width = options.height = 600;
+	if (options.threads <= 0) options.threads = std::thread::hardware_concurrency() > 0 ? (int)std::thread::hardware_concurrency() : 1;
+	if (options.packet != 1 && options.packet != 4 && options.packet != 8 && options.packet != 16) {
+		printf("Packets of %d rays are not supported, using 16\n", options.packet);
+		options.packet = 16;
+	}
+	if (options.recordPath && options.streamBuffer) {	// the recorder sees no uniform blocks, the log would replay stale per-draw data
+		printf("--stream-buffer cannot be recorded, drawing with plain uniforms\n");
+		options.streamBuffer = false;
+	}
+	if (options.recordPath && options.indirect) {	// indirect draws and the culling dispatches are not recorded either
+		printf("--indirect cannot be recorded, drawing the pooled meshes one by one\n");
+		options.indirect = options.gpuCull = options.hiZ = false;
+	}
+	// modes below keep GL state the command log does not hold, replaying turns them off as well so that
+	// both runs create the same programs, textures and vertex arrays
+	bool logged = options.recordPath || options.replayPath;
+	if (logged && options.depthPrepass) {	// the depth function and the depth and colour masks of the passes are not recorded
+		printf("--depth-prepass cannot be recorded or replayed, shading without the depth pre-pass\n");
+		options.depthPrepass = false;
+	}
+	if (logged && options.shadows > 0) {	// neither the cube map passes nor the shadow samplers are recorded
+		printf("--shadows cannot be recorded or replayed, lighting without shadows\n");
+		options.shadows = 0;
+	}
+	if (logged && options.shadingRate > 1) {	// the lighting target and the resolve pass are not recorded
+		printf("--shading-rate cannot be recorded or replayed, lighting at full rate\n");
+		options.shadingRate = 1;
+	}
+	if (logged && options.clustered) {	// the light grid uploads and its texture buffer binds are not recorded
+		printf("--clustered cannot be recorded or replayed, shading the forward lights\n");
+		options.clustered = false;
+	}
+	if (logged && options.deferred) {	// the G-buffer and the lighting pass are not recorded
+		printf("--deferred cannot be recorded or replayed, shading forward\n");
+		options.deferred = false;
+	}
+	if (logged && options.transparent) {	// the accumulation target, the blend state and the depth copy are not recorded
+		printf("--transparent cannot be recorded or replayed, lamp heads stay opaque\n");
+		options.transparent = false;
+	}
+	if (options.lodLevels.empty()) options.lodLevels.push_back(options.tessellation);
+}
@@ -0,0 +1,66 @@
+//=============================================================================================
+// Command line and config file options of the framework
+//=============================================================================================
+#pragma once
+#include <vector>
+
+//---------------------------
+struct Options {
+//---------------------------
+	bool headless = false;	// render offscreen into an FBO instead of a GLUT window
+	bool software = false;	// headless run without any GL context, the CPU rasterizes the frames
+	unsigned int width = 600, height = 600;	// resolution of the window or of the offscreen framebuffer
+	int  msaa = 1;			// samples per pixel, 1 turns multisampling off
+	int  vsync = -1;		// swap interval of the window, -1 keeps the driver default
+	bool raytrace = false;	// headless run without any GL context, the CPU path traces the frames
+	int  samples = 1;		// paths per pixel added by each ray traced frame, a still scene is refined progressively
+	bool analytic = false;	// the ray tracer intersects the closed form surfaces, they are not tessellated
+	int  bounces = 1;		// diffuse bounces of the paths, 0 is direct light with shadows only
+	int  packet = 16;		// primary rays intersected together by the ray tracer: 1 (single rays), 4, 8 or 16
+	int  threads = 0;		// worker threads of the CPU side renderers, 0 uses every hardware thread
+	int  tessellation = 20;	// of the parametric surfaces
+	const char * shader = "phong";	// phong, gouraud or npr, used by every object of the scene
+	int  shadingRate = 1;	// pixels per Phong lighting texel along each axis, above 1 the lights are upsampled
+	bool deferred = false;	// Phong and Gouraud objects fill a G-buffer, every light is accumulated over its screen rectangle
+	bool clustered = false;	// Phong objects shade the lights binned into their froxel of the view frustum, without a light limit
+	bool depthPrepass = false;	// positions only pass fills the depth, the opaque pass shades the visible fragments only
+	bool overdraw = false;	// fragments shaded by the opaque pass are counted and reported per pixel
+	int  shadows = 0;		// the first point lights casting shadows into cube maps, at most 4
+	int  shadowSize = 512;	// texels along the edge of a cube map face
+	bool streamBuffer = false;	// per-draw data of the Phong program is written into a persistently mapped ring of uniform blocks
+	bool meshPool = false;	// the meshes are indexed triangles sub-allocated from one vertex and one index buffer
+	bool indirect = false;	// pooled Phong objects are drawn by one multi-draw indirect call per texture, implies meshPool
+	bool gpuCull = false;	// a compute shader culls the pooled forward objects into the indirect commands, implies indirect
+	bool hiZ = false;		// the GPU culling also tests the depth pyramid of the last frame, implies gpuCull
+	bool parallelRecord = false;	// worker threads cull and record the objects into draw packets, the GL thread submits them
+	bool transparent = false;	// lamp heads get a see-through texture, drawn by the order independent transparent pass
+	int  frames = 100;		// number of frames rendered by the headless backend before exiting
+	bool bench = false;		// headless run with a fixed simulated clock, frame times are measured and reported
+	bool fixedClock = false;	// animation time advances by timestep per frame instead of wall time
+	int  warmupFrames = 10;	// frames rendered before the measurement starts
+	float timestep = 1.0f / 60.0f;	// simulated seconds per frame in bench mode
+	const char * benchJson = nullptr;	// file the benchmark results are written to as JSON
+	const char * tracePath = nullptr;	// Chrome trace of the profiler zones is written here at exit
+	bool overlay = false;				// GL call and memory statistics drawn over the frame
+	const char * statsPath = nullptr;	// per-frame GL statistics, CSV for *.csv, JSON lines otherwise
+	const char * captureDir = nullptr;	// frames are read back and written here as frame_NNNN.bmp
+	const char * goldenDir = nullptr;	// captured frames are compared to the images of the same name here
+	int captureEvery = 1;				// capture every n-th frame
+	float tolerance = 1.0f;				// largest accepted RMSE against the golden image, in 0..255 units
+	int pixelThreshold = 8;				// channel difference above which a pixel counts as changed
+	int lamps = 0;						// synthetic scene of this many lamps instead of the single lamp scene
+	int lights = 3;						// light sources of the scene
+	float lightRange = 0;				// range of the additional point lights, 0 reaches everywhere
+	int textures = 2;					// checkerboard textures of the synthetic scene
+	std::vector<int> lodLevels;			// tessellation levels the lamps of the synthetic scene choose from, empty is the tessellation
+	unsigned int seed = 1;				// random seed of the synthetic scene
+	const char * recordPath = nullptr;	// draw commands of every frame are recorded into this binary log
+	const char * replayPath = nullptr;	// headless run replaying the draw commands of this log instead of the scene
+};
+
+extern Options options;
+
+// Fills the global options from the command line, unknown arguments are reported and ignored.
+// "--config file" reads options from a file in place, one "name = value" or "name" per line,
+// '#' starts a comment; later options override earlier ones
+void parseOptions(int argc, char * argv[]);
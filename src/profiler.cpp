@@ -0,0 +1,89 @@
+//=============================================================================================
+// Scoped-zone profiler: per-thread ring buffers of timed zones, exported as Chrome trace JSON
+//=============================================================================================
+#include <stdio.h>
+#include "profiler.h"
+
+#if defined(PROFILING_ENABLED)
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+static const uint64_t ringCapacity = 1 << 16;	// zones kept per thread
+
+//---------------------------
+struct ProfileRing {
+//---------------------------
+	ProfileEvent events[ringCapacity];
+	uint64_t count = 0;		// zones recorded so far, the ring holds the last ringCapacity of them
+	unsigned int threadId;
+};
+
+static std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+static std::mutex ringsMutex;				// guards only the registration of new threads
+static std::vector<ProfileRing *> rings;	// rings outlive their threads so they can still be exported
+static thread_local ProfileRing * threadRing = nullptr;
+static ProfileRing * gpuRing = nullptr;		// written by the GL thread only
+static const unsigned int gpuTrackId = 1000;
+
+uint64_t profilerNow() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void profilerRecord(const char * name, uint64_t start, uint64_t end) {
+	if (!threadRing) {
+		threadRing = new ProfileRing;
+		std::lock_guard<std::mutex> lock(ringsMutex);
+		threadRing->threadId = (unsigned int)rings.size();
+		rings.push_back(threadRing);
+	}
+	ProfileEvent& event = threadRing->events[threadRing->count++ & (ringCapacity - 1)];
+	event.name = name;
+	event.start = start;
+	event.end = end;
+}
+
+void profilerRecordGPU(const char * name, uint64_t start, uint64_t end) {
+	if (!gpuRing) {
+		gpuRing = new ProfileRing;
+		gpuRing->threadId = gpuTrackId;
+		std::lock_guard<std::mutex> lock(ringsMutex);
+		rings.push_back(gpuRing);
+	}
+	ProfileEvent& event = gpuRing->events[gpuRing->count++ & (ringCapacity - 1)];
+	event.name = name;
+	event.start = start;
+	event.end = end;
+}
+
+bool profilerExport(const char * path) {
+	FILE * file = fopen(path, "w");
+	if (!file) {
+		printf("%s cannot be written\n", path);
+		return false;
+	}
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}", gpuTrackId);
+	std::lock_guard<std::mutex> lock(ringsMutex);
+	for (ProfileRing * ring : rings) {
+		uint64_t begin = ring->count > ringCapacity ? ring->count - ringCapacity : 0;
+		for (uint64_t i = begin; i < ring->count; i++) {
+			const ProfileEvent& event = ring->events[i & (ringCapacity - 1)];
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+				event.name, ring->threadId, event.start / 1000.0, (event.end - event.start) / 1000.0);
+		}
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	printf("Profiler trace written to %s\n", path);
+	return true;
+}
+
+#else
+
+bool profilerExport(const char * path) {
+	printf("The profiler is compiled out of this build, %s is not written\n", path);
+	return false;
+}
+
+#endif
@@ -0,0 +1,48 @@
+//=============================================================================================
+// Scoped-zone profiler: per-thread ring buffers of timed zones, exported as Chrome trace JSON
+// The zones compile to nothing unless PROFILING_ENABLED is defined (never in Release builds).
+//=============================================================================================
+#pragma once
+#include <stdint.h>
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#if defined(PROFILING_ENABLED)
+
+//---------------------------
+struct ProfileEvent {
+//---------------------------
+	const char * name;		// string literal, only the pointer is stored
+	uint64_t start, end;	// nanoseconds since the start of the profiler
+};
+
+uint64_t profilerNow();
+
+// Appends a finished zone to the ring buffer of the calling thread, the oldest zones are overwritten
+void profilerRecord(const char * name, uint64_t start, uint64_t end);
+
+// Zones measured on the GPU, already converted to profiler time, shown on a separate track
+void profilerRecordGPU(const char * name, uint64_t start, uint64_t end);
+
+//---------------------------
+class ProfileZone {
+//---------------------------
+	const char * name;
+	uint64_t start;
+public:
+	ProfileZone(const char * _name) : name(_name), start(profilerNow()) { }
+	~ProfileZone() { profilerRecord(name, start, profilerNow()); }
+};
+
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+
+#else
+
+#define PROFILE_ZONE(name)
+
+#endif
+
+// Writes the zones of all threads in Chrome trace format (chrome://tracing, ui.perfetto.dev),
+// should be called when the other threads are not recording
+bool profilerExport(const char * path);
@@ -0,0 +1,657 @@
+//=============================================================================================
+// Ray tracer: binned SAH build of 4-wide BVHs, two level traversal of the instanced shapes, closed
+// form intersection of the analytic surfaces and path tracing with the Phong-Blinn materials and point lights of the scene
+//=============================================================================================
+#include "raytracer.h"
+#include "options.h"
+#include "bench.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+RayTracer rayTracer;
+
+static float axis(const vec3& v, int a) { return a == 0 ? v.x : a == 1 ? v.y : v.z; }
+
+void BVH4::Build(const AABB * boxes, int count) {
+	nodes.clear();
+	buildNodes.clear();
+	primitives.resize(count);
+	centers.resize(count);
+	bounds = AABB();
+	if (count == 0) return;
+	for (int i = 0; i < count; i++) {
+		primitives[i] = i;
+		centers[i] = boxes[i].Center();
+	}
+	int root = build(boxes, 0, count, 0);
+	bounds = buildNodes[root].box;
+	if (buildNodes[root].left >= 0) {
+		collapse(root);
+		return;
+	}
+	BVH4Node node;		// a single leaf below the root
+	for (int i = 0; i < 4; i++) {
+		node.minX[i] = bounds.min.x; node.minY[i] = bounds.min.y; node.minZ[i] = bounds.min.z;
+		node.maxX[i] = bounds.max.x; node.maxY[i] = bounds.max.y; node.maxZ[i] = bounds.max.z;
+		node.child[i] = 0;
+		node.count[i] = i == 0 ? count : -1;
+	}
+	nodes.push_back(node);
+}
+
+int BVH4::build(const AABB * boxes, int first, int count, int depth) {
+	BuildNode node;
+	node.left = node.right = -1;
+	node.first = first;
+	node.count = count;
+	AABB centerBox;
+	for (int i = first; i < first + count; i++) {
+		node.box.Grow(boxes[primitives[i]]);
+		centerBox.Grow(centers[primitives[i]]);
+	}
+	int index = (int)buildNodes.size();
+	buildNodes.push_back(node);
+	if (count <= maxLeafSize || depth >= maxDepth) return index;
+
+	vec3 extent = centerBox.max - centerBox.min;
+	int a = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	float lo = axis(centerBox.min, a), size = axis(extent, a);
+	int mid = first + count / 2;
+	if (size > 0) {
+		// surface area heuristic over the bins of the centers along the longest axis
+		AABB binBoxes[nBins];
+		int binCounts[nBins] = { 0 };
+		float scale = nBins / size;
+		auto binOf = [&](int primitive) { return std::min(nBins - 1, (int)((axis(centers[primitive], a) - lo) * scale)); };
+		for (int i = first; i < first + count; i++) {
+			int b = binOf(primitives[i]);
+			binCounts[b]++;
+			binBoxes[b].Grow(boxes[primitives[i]]);
+		}
+		float rightCost[nBins];
+		AABB box;
+		for (int b = nBins - 1, n = 0; b > 0; b--) {
+			box.Grow(binBoxes[b]);
+			n += binCounts[b];
+			rightCost[b] = n * box.Area();
+		}
+		box = AABB();
+		float bestCost = FLT_MAX;
+		int bestBin = -1;
+		for (int b = 0, n = 0; b < nBins - 1; b++) {
+			box.Grow(binBoxes[b]);
+			n += binCounts[b];
+			float cost = n * box.Area() + rightCost[b + 1];
+			if (n > 0 && n < count && cost < bestCost) { bestCost = cost; bestBin = b; }
+		}
+		if (bestBin >= 0)
+			mid = (int)(std::partition(&primitives[first], &primitives[first] + count,
+				[&](int primitive) { return binOf(primitive) <= bestBin; }) - &primitives[0]);
+	}
+	if (mid == first || mid == first + count) {	// equal centers, the range is halved
+		mid = first + count / 2;
+		std::nth_element(&primitives[first], &primitives[mid], &primitives[first] + count,
+			[&](int p0, int p1) { return axis(centers[p0], a) < axis(centers[p1], a); });
+	}
+	int left = build(boxes, first, mid - first, depth + 1);
+	int right = build(boxes, mid, first + count - mid, depth + 1);
+	buildNodes[index].left = left;
+	buildNodes[index].right = right;
+	return index;
+}
+
+// The two children of the binary node are opened up, always the largest inner one, until there are four
+int BVH4::collapse(int buildNode) {
+	int children[4] = { buildNodes[buildNode].left, buildNodes[buildNode].right };
+	int n = 2;
+	while (n < 4) {
+		int largest = -1;
+		for (int i = 0; i < n; i++) {
+			const BuildNode& child = buildNodes[children[i]];
+			if (child.left >= 0 && (largest < 0 || child.box.Area() > buildNodes[children[largest]].box.Area())) largest = i;
+		}
+		if (largest < 0) break;
+		int opened = children[largest];
+		children[largest] = buildNodes[opened].left;
+		children[n++] = buildNodes[opened].right;
+	}
+	int index = (int)nodes.size();
+	nodes.push_back(BVH4Node());
+	for (int i = 0; i < 4; i++) {
+		int child = 0, count = -1;
+		AABB box;
+		if (i < n) {
+			const BuildNode& buildChild = buildNodes[children[i]];
+			box = buildChild.box;
+			if (buildChild.left < 0) { child = buildChild.first; count = buildChild.count; }
+			else { child = collapse(children[i]); count = 0; }
+		}
+		BVH4Node& node = nodes[index];		// the recursion may have moved the nodes
+		node.minX[i] = box.min.x; node.minY[i] = box.min.y; node.minZ[i] = box.min.z;
+		node.maxX[i] = box.max.x; node.maxY[i] = box.max.y; node.maxZ[i] = box.max.z;
+		node.child[i] = child;
+		node.count[i] = count;
+	}
+	return index;
+}
+
+void RayMesh::Build(const SoftVertex * _vertices, int nVtxPerStrip, int nStrips) {
+	PROFILE_ZONE("RayMesh::Build");
+	vertices = _vertices;
+	std::vector<Triangle> stripTriangles;
+	std::vector<AABB> boxes;
+	for (int s = 0; s < nStrips; s++) {
+		for (int k = 0; k + 2 < nVtxPerStrip; k++) {
+			Triangle tri;
+			for (int i = 0; i < 3; i++) tri.vertex[i] = s * nVtxPerStrip + k + i;
+			vec3 p0 = vertices[tri.vertex[0]].position, p1 = vertices[tri.vertex[1]].position, p2 = vertices[tri.vertex[2]].position;
+			tri.v0 = p0; tri.e1 = p1 - p0; tri.e2 = p2 - p0;
+			if (dot(cross(tri.e1, tri.e2), cross(tri.e1, tri.e2)) == 0) continue;	// the poles of the sphere
+			AABB box;
+			box.Grow(p0); box.Grow(p1); box.Grow(p2);
+			stripTriangles.push_back(tri);
+			boxes.push_back(box);
+		}
+	}
+	bvh.Build(boxes.empty() ? nullptr : &boxes[0], (int)boxes.size());
+	triangles.resize(stripTriangles.size());
+	for (size_t i = 0; i < triangles.size(); i++) triangles[i] = stripTriangles[bvh.primitives[i]];
+}
+
+// Moller-Trumbore
+static inline bool intersectTriangle(const Ray& ray, vec3 v0, vec3 e1, vec3 e2, float tmax, float& t, float& u, float& v) {
+	vec3 p = cross(ray.dir, e2);
+	float det = dot(e1, p);
+	if (det == 0) return false;
+	float invDet = 1 / det;
+	vec3 s = ray.origin - v0;
+	u = dot(s, p) * invDet;
+	if (u < 0 || u > 1) return false;
+	vec3 q = cross(s, e1);
+	v = dot(ray.dir, q) * invDet;
+	if (v < 0 || u + v > 1) return false;
+	t = dot(e2, q) * invDet;
+	return t >= ray.tmin && t <= tmax;
+}
+
+bool RayMesh::intersectTriangles(const Ray& ray, int first, int count, float& tmax, RayHit& hit) const {
+	bool found = false;
+	for (int i = first; i < first + count; i++) {
+		const Triangle& tri = triangles[i];
+		float t, u, v;
+		if (!intersectTriangle(ray, tri.v0, tri.e1, tri.e2, tmax, t, u, v)) continue;
+		tmax = t;
+		hit.t = t; hit.triangle = i; hit.u = u; hit.v = v;
+		found = true;
+	}
+	return found;
+}
+
+bool RayMesh::Intersect(const Ray& ray, float& tmax, RayHit& hit) const {
+	auto leaf = [&](int first, int count, float& tLeafMax) { return intersectTriangles(ray, first, count, tLeafMax, hit); };
+	return bvh.Traverse<false>(ray, tmax, leaf);
+}
+
+// Moller-Trumbore of four rays of the common origin against one triangle: the terms of the origin are shared
+void RayMesh::IntersectPacket(RayPacket& packet, int mask) const {
+	auto leaf = [&](int first, int count, int rays) {
+		for (int i = first; i < first + count; i++) {
+			const Triangle& tri = triangles[i];
+			vec3 s = packet.origin - tri.v0, q = cross(s, tri.e1);
+			float tq = dot(tri.e2, q);
+			for (int g = 0; g < packet.size; g += 4) {
+				int active = (rays >> g) & 15;
+				if (!active) continue;
+				float4 dx = float4::Load(packet.dirX + g), dy = float4::Load(packet.dirY + g), dz = float4::Load(packet.dirZ + g);
+				float4 px = dy * tri.e2.z - dz * tri.e2.y, py = dz * tri.e2.x - dx * tri.e2.z, pz = dx * tri.e2.y - dy * tri.e2.x;
+				float4 invDet = float4(1) / (px * tri.e1.x + py * tri.e1.y + pz * tri.e1.z);
+				float4 u = (px * s.x + py * s.y + pz * s.z) * invDet;
+				float4 v = (dx * q.x + dy * q.y + dz * q.z) * invDet;
+				float4 t = invDet * tq;
+				active &= lessEqual(0, u) & lessEqual(0, v) & lessEqual(u + v, 1) & lessEqual(packet.tmin, t) & lessEqual(t, float4::Load(packet.tmax + g));
+				if (!active) continue;
+				float ts[4], us[4], vs[4];
+				t.Store(ts); u.Store(us); v.Store(vs);
+				for (int k = 0; k < 4; k++) {
+					if (!(active & (1 << k))) continue;
+					packet.tmax[g + k] = ts[k];
+					RayHit& hit = packet.hits[g + k];
+					hit.t = ts[k]; hit.triangle = i; hit.u = us[k]; hit.v = vs[k];
+				}
+			}
+		}
+	};
+	auto single = [&](int ray, int child, int count) {
+		Ray r = packet.Single(ray);
+		auto singleLeaf = [&](int first, int n, float& tmax) { return intersectTriangles(r, first, n, tmax, packet.hits[ray]); };
+		bvh.Traverse<false>(r, packet.tmax[ray], singleLeaf, child, count);
+	};
+	bvh.TraversePacket(packet, mask, leaf, single);
+}
+
+bool RayMesh::Occluded(const Ray& ray) const {
+	auto leaf = [&](int first, int count, float& tLeafMax) {
+		for (int i = first; i < first + count; i++) {
+			float t, u, v;
+			if (intersectTriangle(ray, triangles[i].v0, triangles[i].e1, triangles[i].e2, tLeafMax, t, u, v)) return true;
+		}
+		return false;
+	};
+	float tmax = ray.tmax;
+	return bvh.Traverse<true>(ray, tmax, leaf);
+}
+
+void RayMesh::Surface(const RayHit& hit, vec3& position, vec3& normal, vec2& texcoord) const {
+	const Triangle& tri = triangles[hit.triangle];
+	const SoftVertex& a = vertices[tri.vertex[0]], & b = vertices[tri.vertex[1]], & c = vertices[tri.vertex[2]];
+	float w = 1 - hit.u - hit.v;
+	position = tri.v0 + tri.e1 * hit.u + tri.e2 * hit.v;
+	normal = a.normal * w + b.normal * hit.u + c.normal * hit.v;
+	texcoord = a.texcoord * w + b.texcoord * hit.u + c.texcoord * hit.v;
+}
+
+// Smallest root of a t^2 + b t + c = 0 in [tmin, tmax] for which inside(t) holds
+template<class Inside> static bool solveQuadratic(float a, float b, float c, float tmin, float tmax, Inside inside, float& t) {
+	float roots[2];
+	int n = 0;
+	if (fabsf(a) < 1e-12f) {		// the ray is parallel to the axis of the paraboloid
+		if (b == 0) return false;
+		roots[n++] = -c / b;
+	}
+	else {
+		float discr = b * b - 4 * a * c;
+		if (discr < 0) return false;
+		float q = -0.5f * (b + copysignf(sqrtf(discr), b));	// no cancellation
+		float t0 = q / a, t1 = q != 0 ? c / q : t0;
+		roots[n++] = fminf(t0, t1);
+		roots[n++] = fmaxf(t0, t1);
+	}
+	for (int i = 0; i < n; i++) {
+		if (roots[i] >= tmin && roots[i] <= tmax && inside(roots[i])) {
+			t = roots[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+static float angleParameter(float x, float y) { // the angle of the point in [0, 1), 1 is a full turn
+	float phi = atan2f(y, x) / (2 * (float)M_PI);
+	return phi < 0 ? phi + 1 : phi;
+}
+
+// The surfaces are those of the eval functions of the Sphere, Cylinder, Plane, Paraboloid and CylinderTop
+bool RayAnalytic::Intersect(const Ray& ray, float& tmax, RayHit& hit) const {
+	vec3 o = ray.origin, d = ray.dir;
+	auto at = [&](float t) { return o + d * t; };
+	float t;
+	switch (kind) {
+	case SHAPE_SPHERE:			// x^2 + y^2 + z^2 = 1
+		if (!solveQuadratic(dot(d, d), 2 * dot(o, d), dot(o, o) - 1, ray.tmin, tmax, [](float) { return true; }, t)) return false;
+		{
+			vec3 p = at(t);
+			hit.u = angleParameter(p.x, p.y);
+			hit.v = acosf(fmaxf(-1, fminf(1, p.z))) / (float)M_PI;
+		}
+		break;
+	case SHAPE_CYLINDER:		// x^2 + z^2 = 1, 0 <= y <= 1
+		if (!solveQuadratic(d.x * d.x + d.z * d.z, 2 * (o.x * d.x + o.z * d.z), o.x * o.x + o.z * o.z - 1, ray.tmin, tmax,
+			[&](float s) { float y = o.y + d.y * s; return y >= 0 && y <= 1; }, t)) return false;
+		{
+			vec3 p = at(t);
+			hit.u = angleParameter(p.x, p.z);
+			hit.v = p.y;
+		}
+		break;
+	case SHAPE_PARABOLOID:		// y = x^2 + z^2, y <= 1
+		if (!solveQuadratic(d.x * d.x + d.z * d.z, 2 * (o.x * d.x + o.z * d.z) - d.y, o.x * o.x + o.z * o.z - o.y, ray.tmin, tmax,
+			[&](float s) { return o.y + d.y * s <= 1; }, t)) return false;
+		{
+			vec3 p = at(t);
+			hit.u = angleParameter(p.x, p.z);
+			hit.v = sqrtf(fmaxf(0, p.x * p.x + p.z * p.z));
+		}
+		break;
+	case SHAPE_PLANE:			// y = 0, -1 <= x, z <= 1
+	case SHAPE_DISK:			// y = 0, x^2 + z^2 <= 1
+		{
+			if (d.y == 0) return false;
+			t = -o.y / d.y;
+			if (t < ray.tmin || t > tmax) return false;
+			vec3 p = at(t);
+			if (kind == SHAPE_PLANE) {
+				if (fabsf(p.x) > 1 || fabsf(p.z) > 1) return false;
+				hit.u = (p.x + 1) / 2;
+				hit.v = (p.z + 1) / 2;
+			}
+			else {
+				float r2 = p.x * p.x + p.z * p.z;
+				if (r2 > 1) return false;
+				hit.u = angleParameter(p.x, p.z);
+				hit.v = sqrtf(r2);
+			}
+		}
+		break;
+	default:
+		return false;
+	}
+	tmax = t;
+	hit.t = t;
+	hit.triangle = -1;
+	return true;
+}
+
+void RayAnalytic::Surface(const RayHit& hit, vec3& position, vec3& normal, vec2& texcoord) const {
+	float phi = hit.u * 2 * (float)M_PI, r = hit.v;
+	texcoord = vec2(hit.u, hit.v);
+	switch (kind) {
+	case SHAPE_SPHERE: {
+		float theta = hit.v * (float)M_PI;
+		position = vec3(cosf(phi) * sinf(theta), sinf(phi) * sinf(theta), cosf(theta));
+		normal = position;
+		break;
+	}
+	case SHAPE_CYLINDER:
+		position = vec3(cosf(phi), hit.v, sinf(phi));
+		normal = vec3(position.x, 0, position.z);
+		break;
+	case SHAPE_PARABOLOID:
+		position = vec3(cosf(phi) * r, r * r, sinf(phi) * r);
+		normal = vec3(2 * position.x, -1, 2 * position.z);
+		break;
+	case SHAPE_PLANE:
+		position = vec3(hit.u * 2 - 1, 0, hit.v * 2 - 1);
+		normal = vec3(0, 1, 0);
+		break;
+	case SHAPE_DISK:
+		position = vec3(cosf(phi) * r, 0, sinf(phi) * r);
+		normal = vec3(0, 1, 0);
+		break;
+	}
+}
+
+AABB RayAnalytic::Bounds() const {
+	AABB box;
+	box.Grow(vec3(-1, kind == SHAPE_SPHERE ? -1 : 0, -1));
+	box.Grow(vec3(1, kind == SHAPE_PLANE || kind == SHAPE_DISK ? 0 : 1, 1));
+	return box;
+}
+
+void RayTracer::Begin(int _width, int _height, vec4 _background, vec3 _wEye, vec3 _forward, vec3 _right, vec3 _up,
+	float _tNear, float _tFar, bool restart) {
+	if (_width != width || _height != height) {
+		width = _width; height = _height;
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+		accumulation.resize((size_t)width * height);
+		pixels.resize((size_t)width * height * 4);
+		restart = true;
+	}
+	if (restart) {
+		std::fill(accumulation.begin(), accumulation.end(), vec3(0, 0, 0));
+		nSamples = 0;
+	}
+	background = vec3(_background.x, _background.y, _background.z);
+	wEye = _wEye; forward = _forward; right = _right; up = _up;
+	tNear = _tNear; tFar = _tFar;
+	lights.clear();
+	instances.clear();
+	instanceBoxes.clear();
+}
+
+void RayTracer::AddLight(vec3 La, vec3 Le, vec4 wLightPos, float range) {
+	lights.push_back(RayLight{ La, Le, wLightPos, range });
+}
+
+void RayTracer::AddInstance(const SoftDraw& draw, const RayShape * shape) {
+	AABB bounds = shape->Bounds();
+	if (bounds.min.x > bounds.max.x) return;	// empty mesh
+	instances.push_back(Instance{ draw, shape });
+	AABB box;		// world space box of the transformed corners
+	for (int corner = 0; corner < 8; corner++) {
+		vec4 p(corner & 1 ? bounds.max.x : bounds.min.x, corner & 2 ? bounds.max.y : bounds.min.y, corner & 4 ? bounds.max.z : bounds.min.z, 1);
+		p = p * draw.M;
+		box.Grow(vec3(p.x, p.y, p.z));
+	}
+	instanceBoxes.push_back(box);
+}
+
+// The world space ray is taken into the modeling space of the instances in the leaves of the top level
+bool RayTracer::intersectInstances(const Ray& ray, int first, int count, float& tmax, RayHit& hit) const {
+	bool found = false;
+	for (int i = first; i < first + count; i++) {
+		int instance = tlas.primitives[i];
+		const mat4& Minv = instances[instance].draw.Minv;
+		vec4 origin = vec4(ray.origin.x, ray.origin.y, ray.origin.z, 1) * Minv, dir = vec4(ray.dir.x, ray.dir.y, ray.dir.z, 0) * Minv;
+		Ray modelRay{ vec3(origin.x, origin.y, origin.z), vec3(dir.x, dir.y, dir.z), ray.tmin, tmax };
+		if (instances[instance].shape->Intersect(modelRay, tmax, hit)) {
+			hit.instance = instance;
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool RayTracer::intersect(const Ray& ray, RayHit& hit) const {
+	auto leaf = [&](int first, int count, float& tmax) { return intersectInstances(ray, first, count, tmax, hit); };
+	float tmax = ray.tmax;
+	return tlas.Traverse<false>(ray, tmax, leaf);
+}
+
+// The rays of the packet stay coherent in modeling space, the transformation is affine
+void RayTracer::intersectPacket(RayPacket& packet) const {
+	auto leaf = [&](int first, int count, int rays) {
+		for (int i = first; i < first + count; i++) {
+			int instance = tlas.primitives[i];
+			const mat4& Minv = instances[instance].draw.Minv;
+			RayPacket model;
+			model.size = packet.size;
+			vec4 origin = vec4(packet.origin.x, packet.origin.y, packet.origin.z, 1) * Minv;
+			model.origin = vec3(origin.x, origin.y, origin.z);
+			model.tmin = packet.tmin;
+			for (int g = 0; g < packet.size; g += 4) {
+				float4 dx = float4::Load(packet.dirX + g), dy = float4::Load(packet.dirY + g), dz = float4::Load(packet.dirZ + g);
+				(dx * Minv[0][0] + dy * Minv[1][0] + dz * Minv[2][0]).Store(model.dirX + g);
+				(dx * Minv[0][1] + dy * Minv[1][1] + dz * Minv[2][1]).Store(model.dirY + g);
+				(dx * Minv[0][2] + dy * Minv[1][2] + dz * Minv[2][2]).Store(model.dirZ + g);
+			}
+			for (int k = 0; k < packet.size; k++) model.tmax[k] = packet.tmax[k];
+			model.Finalize();
+			instances[instance].shape->IntersectPacket(model, rays);
+			for (int k = 0; k < packet.size; k++) {
+				if (!(rays & (1 << k)) || model.tmax[k] >= packet.tmax[k]) continue;
+				packet.tmax[k] = model.tmax[k];
+				packet.hits[k] = model.hits[k];
+				packet.hits[k].instance = instance;
+			}
+		}
+	};
+	auto single = [&](int ray, int child, int count) {
+		Ray r = packet.Single(ray);
+		auto singleLeaf = [&](int first, int n, float& tmax) { return intersectInstances(r, first, n, tmax, packet.hits[ray]); };
+		tlas.Traverse<false>(r, packet.tmax[ray], singleLeaf, child, count);
+	};
+	tlas.TraversePacket(packet, (1 << packet.size) - 1, leaf, single);
+}
+
+bool RayTracer::occluded(const Ray& ray) const {
+	auto leaf = [&](int first, int count, float& tmax) {
+		for (int i = first; i < first + count; i++) {
+			const mat4& Minv = instances[tlas.primitives[i]].draw.Minv;
+			vec4 origin = vec4(ray.origin.x, ray.origin.y, ray.origin.z, 1) * Minv, dir = vec4(ray.dir.x, ray.dir.y, ray.dir.z, 0) * Minv;
+			Ray modelRay{ vec3(origin.x, origin.y, origin.z), vec3(dir.x, dir.y, dir.z), ray.tmin, tmax };
+			if (instances[tlas.primitives[i]].shape->Occluded(modelRay)) return true;
+		}
+		return false;
+	};
+	float tmax = ray.tmax;
+	return tlas.Traverse<true>(ray, tmax, leaf);
+}
+
+// PCG hash, the random numbers of a pixel depend only on the pixel and the sample index, not on the thread
+static inline unsigned int hash(unsigned int x) {
+	unsigned int state = x * 747796405u + 2891336453u;
+	unsigned int word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+	return (word >> 22) ^ word;
+}
+
+static inline float random(unsigned int& seed) {
+	seed = hash(seed);
+	return (seed >> 8) * (1.0f / 16777216.0f);
+}
+
+// The light of the point lights is reflected like in the Phong shader, with shadow rays, and the diffuse
+// bounces gather indirect light. Rays leaving the scene after a bounce bring no light.
+vec3 RayTracer::trace(Ray ray, const RayHit * primaryHit, unsigned int seed, size_t& rays) const {
+	const float epsilon = 1e-3f;	// shadow and bounce rays start this far above the surface
+	vec3 radiance(0, 0, 0), throughput(1, 1, 1);
+	for (int bounce = 0; ; bounce++) {
+		RayHit hit;
+		rays++;
+		if (bounce == 0 && primaryHit) hit = *primaryHit;
+		else if (!intersect(ray, hit)) hit.instance = -1;
+		if (hit.instance < 0) {
+			if (bounce == 0) radiance = background;
+			break;
+		}
+		const SoftDraw& draw = instances[hit.instance].draw;
+		vec3 position, normal;
+		vec2 texcoord;
+		instances[hit.instance].shape->Surface(hit, position, normal, texcoord);
+		vec4 wPos4 = vec4(position.x, position.y, position.z, 1) * draw.M;
+		vec3 wPos(wPos4.x, wPos4.y, wPos4.z);
+		vec3 N = normalize(transformNormal(draw.Minv, normal));
+		vec3 V = normalize(-ray.dir);
+		if (dot(N, V) < 0) N = -N;
+		vec3 texColor = sampleTexture(draw.texture, texcoord.x, texcoord.y);
+		vec3 ka = draw.ka * texColor, kd = draw.kd * texColor * texColor;	// modulated twice as in the GLSL code
+		vec3 origin = wPos + N * epsilon;
+
+		for (const RayLight& light : lights) {
+			radiance = radiance + throughput * ka * light.La;
+			vec3 toLight = vec3(light.wLightPos.x, light.wLightPos.y, light.wLightPos.z) - wPos * light.wLightPos.w;
+			vec3 L = normalize(toLight);
+			float cost = dot(N, L), attenuation = lightAttenuation(light.range, length(toLight));
+			if (cost <= 0 || attenuation <= 0) continue;
+			rays++;
+			if (occluded(Ray{ origin, toLight, 0, light.wLightPos.w > 0 ? 1 / light.wLightPos.w : FLT_MAX })) continue;
+			float cosd = fmaxf(dot(N, normalize(L + V)), 0);
+			radiance = radiance + throughput * (kd * cost + draw.ks * powf(cosd, draw.shininess)) * light.Le * attenuation;
+		}
+		if (bounce >= options.bounces) break;
+
+		// cosine weighted direction around the normal, the weight of the diffuse bounce is then the albedo
+		float r = sqrtf(random(seed)), phi = 2 * (float)M_PI * random(seed);
+		vec3 T = normalize(cross(fabsf(N.x) > 0.5f ? vec3(0, 1, 0) : vec3(1, 0, 0), N)), B = cross(N, T);
+		vec3 dir = T * (r * cosf(phi)) + B * (r * sinf(phi)) + N * sqrtf(fmaxf(0, 1 - r * r));
+		ray = Ray{ origin, dir, 0, FLT_MAX };
+		throughput = throughput * kd;
+		if (fmaxf(throughput.x, fmaxf(throughput.y, throughput.z)) < 1e-3f) break;
+	}
+	return radiance;
+}
+
+// For each sample the primary rays of the tile are intersected first, in packets of 2x2, 4x2 or 4x4 pixels,
+// then the paths are continued pixel by pixel
+void RayTracer::renderTile(int tile, int thread) {
+	int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+	int x1 = std::min(x0 + tileSize, width), y1 = std::min(y0 + tileSize, height);
+	int nTotal = nSamples + options.samples;
+	int packetSize = options.packet;
+	int blockWidth = packetSize == 1 ? 1 : packetSize == 4 ? 2 : 4, blockHeight = packetSize / blockWidth;
+	Ray primaryRays[tileSize * tileSize];
+	RayHit primaryHits[tileSize * tileSize];
+	unsigned int seeds[tileSize * tileSize];
+	RayCounter& counter = rayCounters[thread];
+	size_t rays = 0;
+	for (int sample = nSamples; sample < nTotal; sample++) {
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				int local = (y - y0) * tileSize + (x - x0);
+				unsigned int seed = hash((unsigned int)((size_t)y * width + x) ^ hash((unsigned int)sample));
+				// the first sample goes through the pixel center, the others are jittered for antialiasing
+				float jx = sample == 0 ? 0.5f : random(seed), jy = sample == 0 ? 0.5f : random(seed);
+				float sx = (x + jx) / width * 2 - 1, sy = (y + jy) / height * 2 - 1;
+				primaryRays[local] = Ray{ wEye, forward + right * sx + up * sy, tNear, tFar };
+				seeds[local] = seed;
+			}
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		for (int by = y0; by < y1; by += blockHeight) {
+			for (int bx = x0; bx < x1; bx += blockWidth) {
+				if (packetSize == 1) {
+					int local = (by - y0) * tileSize + (bx - x0);
+					if (!intersect(primaryRays[local], primaryHits[local])) primaryHits[local].instance = -1;
+					continue;
+				}
+				RayPacket packet;
+				packet.size = packetSize;
+				packet.origin = wEye;
+				packet.tmin = tNear;
+				int locals[RayPacket::maxSize];
+				for (int i = 0; i < packetSize; i++) {	// pixels outside of the image repeat the last ones
+					int x = std::min(bx + i % blockWidth, x1 - 1), y = std::min(by + i / blockWidth, y1 - 1);
+					locals[i] = (y - y0) * tileSize + (x - x0);
+					const Ray& ray = primaryRays[locals[i]];
+					packet.dirX[i] = ray.dir.x; packet.dirY[i] = ray.dir.y; packet.dirZ[i] = ray.dir.z;
+					packet.tmax[i] = tFar;
+					packet.hits[i].instance = -1;
+				}
+				packet.Finalize();
+				intersectPacket(packet);
+				for (int i = 0; i < packetSize; i++) primaryHits[locals[i]] = packet.hits[i];
+			}
+		}
+		counter.primarySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counter.primaryRays += (x1 - x0) * (y1 - y0);
+
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				int local = (y - y0) * tileSize + (x - x0);
+				vec3& sum = accumulation[(size_t)y * width + x];
+				sum = sum + trace(primaryRays[local], &primaryHits[local], seeds[local], rays);
+			}
+		}
+	}
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			size_t pixel = (size_t)y * width + x;
+			unsigned int color = packColor(accumulation[pixel] / (float)nTotal);
+			memcpy(&pixels[pixel * 4], &color, 4);
+		}
+	}
+	counter.rays += rays;
+}
+
+void RayTracer::End() {
+	PROFILE_ZONE("RayTracer::End");
+	auto start = std::chrono::steady_clock::now();
+	tlas.Build(instanceBoxes.empty() ? nullptr : &instanceBoxes[0], (int)instanceBoxes.size());
+	for (RayCounter& counter : rayCounters) counter.rays = counter.primaryRays = 0, counter.primarySeconds = 0;
+	auto job = [this](int tile, int thread) {
+		PROFILE_ZONE("RayTracer::tile");
+		renderTile(tile, thread);
+	};
+	workerPool.ParallelForStealing(tilesX * tilesY, job);
+	nSamples += options.samples;
+
+	frameRays = 0;
+	size_t primaryRays = 0;
+	double primarySeconds = 0;
+	for (const RayCounter& counter : rayCounters) {
+		frameRays += counter.rays;
+		primaryRays += counter.primaryRays;
+		primarySeconds += counter.primarySeconds;
+	}
+	frameSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	totalRays += frameRays;
+	totalSeconds += frameSeconds;
+	totalPrimaryRays += primaryRays;
+	totalPrimarySeconds += primarySeconds;
+	if (benchmark.IsActive()) {
+		benchmark.AddCounter("Mrays/s", frameRays / frameSeconds / 1e6);
+		benchmark.AddCounter("primary Mrays/s/thread", primaryRays / primarySeconds / 1e6);
+	}
+}
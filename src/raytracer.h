@@ -0,0 +1,375 @@
+//=============================================================================================
+// Ray tracer: path traces the scene on the CPU over 4-wide bounding volume hierarchies of the
+// tessellated or analytic surfaces, still frames are refined progressively
+//=============================================================================================
+#pragma once
+#include "softraster.h"
+#include "workers.h"
+#include <float.h>
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define RAY_SSE2
+#endif
+
+//---------------------------
+struct Ray {
+//---------------------------
+	vec3 origin, dir;		// dir is not normalized, t is the same in world and in modeling space
+	float tmin, tmax;
+};
+
+//---------------------------
+struct RayHit {
+//---------------------------
+	float t;
+	int instance, triangle;
+	float u, v;				// barycentric coordinates of the second and third vertex, or surface parameters
+};
+
+//---------------------------
+struct AABB {
+//---------------------------
+	vec3 min, max;
+
+	AABB() : min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX) { }
+	void Grow(vec3 p) {
+		min = vec3(fminf(min.x, p.x), fminf(min.y, p.y), fminf(min.z, p.z));
+		max = vec3(fmaxf(max.x, p.x), fmaxf(max.y, p.y), fmaxf(max.z, p.z));
+	}
+	void Grow(const AABB& box) { Grow(box.min); Grow(box.max); }
+	vec3 Center() const { return (min + max) * 0.5f; }
+	float Area() const {
+		vec3 d = max - min;
+		return d.x < 0 ? 0 : 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+};
+
+//---------------------------
+struct float4 { // four SIMD lanes, SSE2 or a scalar fallback; comparisons return the bit mask of the lanes
+//---------------------------
+#ifdef RAY_SSE2
+	__m128 m;
+	float4() { }
+	float4(__m128 _m) : m(_m) { }
+	float4(float f) : m(_mm_set1_ps(f)) { }
+	static float4 Load(const float * p) { return _mm_loadu_ps(p); }
+	void Store(float * p) const { _mm_storeu_ps(p, m); }
+	float4 operator+(float4 b) const { return _mm_add_ps(m, b.m); }
+	float4 operator-(float4 b) const { return _mm_sub_ps(m, b.m); }
+	float4 operator*(float4 b) const { return _mm_mul_ps(m, b.m); }
+	float4 operator/(float4 b) const { return _mm_div_ps(m, b.m); }
+	friend float4 min4(float4 a, float4 b) { return _mm_min_ps(a.m, b.m); }
+	friend float4 max4(float4 a, float4 b) { return _mm_max_ps(a.m, b.m); }
+	friend int lessEqual(float4 a, float4 b) { return _mm_movemask_ps(_mm_cmple_ps(a.m, b.m)); }
+#else
+	float f[4];
+	float4() { }
+	float4(float s) { f[0] = f[1] = f[2] = f[3] = s; }
+	static float4 Load(const float * p) { float4 r; for (int i = 0; i < 4; i++) r.f[i] = p[i]; return r; }
+	void Store(float * p) const { for (int i = 0; i < 4; i++) p[i] = f[i]; }
+	template<class Op> float4 apply(float4 b, Op op) const { float4 r; for (int i = 0; i < 4; i++) r.f[i] = op(f[i], b.f[i]); return r; }
+	float4 operator+(float4 b) const { return apply(b, [](float x, float y) { return x + y; }); }
+	float4 operator-(float4 b) const { return apply(b, [](float x, float y) { return x - y; }); }
+	float4 operator*(float4 b) const { return apply(b, [](float x, float y) { return x * y; }); }
+	float4 operator/(float4 b) const { return apply(b, [](float x, float y) { return x / y; }); }
+	friend float4 min4(float4 a, float4 b) { return a.apply(b, [](float x, float y) { return y < x ? y : x; }); }
+	friend float4 max4(float4 a, float4 b) { return a.apply(b, [](float x, float y) { return y > x ? y : x; }); }
+	friend int lessEqual(float4 a, float4 b) { int r = 0; for (int i = 0; i < 4; i++) r |= (a.f[i] <= b.f[i]) << i; return r; }
+#endif
+};
+
+//---------------------------
+struct RayPacket { // coherent rays of a common origin, like the primary rays of a block of pixels, in SoA layout
+//---------------------------
+	static const int maxSize = 16;
+	int size;					// 4, 8 or 16
+	vec3 origin;
+	float tmin;
+	float dirX[maxSize], dirY[maxSize], dirZ[maxSize];
+	float invX[maxSize], invY[maxSize], invZ[maxSize];
+	float tmax[maxSize];		// shrinks to the closest hit
+	RayHit hits[maxSize];		// instance is -1 while nothing was hit
+	vec3 invMin, invMax;		// bounds of the inverse directions for the frustum test of the whole packet
+	int frustumAxes;			// bit of the axes along which the directions of every ray have the same sign
+
+	void Finalize() {			// computes the inverse directions and the frustum from the directions
+		invMin = vec3(FLT_MAX, FLT_MAX, FLT_MAX); invMax = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (int i = 0; i < size; i++) {
+			invX[i] = 1 / dirX[i]; invY[i] = 1 / dirY[i]; invZ[i] = 1 / dirZ[i];
+			invMin = vec3(fminf(invMin.x, invX[i]), fminf(invMin.y, invY[i]), fminf(invMin.z, invZ[i]));
+			invMax = vec3(fmaxf(invMax.x, invX[i]), fmaxf(invMax.y, invY[i]), fmaxf(invMax.z, invZ[i]));
+		}
+		frustumAxes = ((invMin.x > 0) == (invMax.x > 0)) | ((invMin.y > 0) == (invMax.y > 0)) << 1 | ((invMin.z > 0) == (invMax.z > 0)) << 2;
+	}
+	Ray Single(int i) const { return Ray{ origin, vec3(dirX[i], dirY[i], dirZ[i]), tmin, tmax[i] }; }
+	float MaxT(int mask) const {
+		float t = -FLT_MAX;
+		for (int i = 0; i < size; i++) if (mask & (1 << i)) t = fmaxf(t, tmax[i]);
+		return t;
+	}
+};
+
+//---------------------------
+struct BVH4Node { // boxes of the four children in SoA layout for 4-wide slab tests
+//---------------------------
+	float minX[4], minY[4], minZ[4], maxX[4], maxY[4], maxZ[4];
+	int child[4];			// index of an inner node, or the first primitive of a leaf
+	int count[4];			// primitives of a leaf, 0 for an inner node, -1 for an empty slot
+
+	// Returns the mask of the children whose box the ray enters in [tmin, tmax], tNear is the entry distance
+	int Intersect(vec3 origin, vec3 invDir, float tmin, float tmax, float tNear[4]) const {
+		float4 t0x = (float4::Load(minX) - origin.x) * invDir.x, t1x = (float4::Load(maxX) - origin.x) * invDir.x;
+		float4 t0y = (float4::Load(minY) - origin.y) * invDir.y, t1y = (float4::Load(maxY) - origin.y) * invDir.y;
+		float4 t0z = (float4::Load(minZ) - origin.z) * invDir.z, t1z = (float4::Load(maxZ) - origin.z) * invDir.z;
+		float4 enter = max4(max4(min4(t0x, t1x), min4(t0y, t1y)), max4(min4(t0z, t1z), tmin));
+		float4 exit = min4(min4(max4(t0x, t1x), max4(t0y, t1y)), min4(max4(t0z, t1z), tmax));
+		enter.Store(tNear);
+		return lessEqual(enter, exit);
+	}
+
+	// Conservative test of the whole packet against the four children: interval bounds of the slab distances
+	// over the rays. A cleared bit means that no ray of the packet hits the child.
+	int IntersectFrustum(const RayPacket& packet, float tmax, float tNear[4]) const {
+		float4 enter = packet.tmin, exit = tmax;
+		auto axis = [&](int a, const float * lo, const float * hi, float o, float invMin, float invMax) {
+			if (!(packet.frustumAxes & (1 << a))) return;
+			bool positive = invMin > 0;
+			float4 dNear = float4::Load(positive ? lo : hi) - o, dFar = float4::Load(positive ? hi : lo) - o;
+			enter = max4(enter, min4(dNear * invMin, dNear * invMax));
+			exit = min4(exit, max4(dFar * invMin, dFar * invMax));
+		};
+		axis(0, minX, maxX, packet.origin.x, packet.invMin.x, packet.invMax.x);
+		axis(1, minY, maxY, packet.origin.y, packet.invMin.y, packet.invMax.y);
+		axis(2, minZ, maxZ, packet.origin.z, packet.invMin.z, packet.invMax.z);
+		enter.Store(tNear);
+		return lessEqual(enter, exit);
+	}
+
+	// Mask of the rays of the packet hitting child c, four rays at a time
+	int IntersectRays(int c, const RayPacket& packet, int mask) const {
+		int hit = 0;
+		for (int g = 0; g < packet.size; g += 4) {
+			if (!((mask >> g) & 15)) continue;
+			float4 ix = float4::Load(packet.invX + g), iy = float4::Load(packet.invY + g), iz = float4::Load(packet.invZ + g);
+			float4 t0x = ix * (minX[c] - packet.origin.x), t1x = ix * (maxX[c] - packet.origin.x);
+			float4 t0y = iy * (minY[c] - packet.origin.y), t1y = iy * (maxY[c] - packet.origin.y);
+			float4 t0z = iz * (minZ[c] - packet.origin.z), t1z = iz * (maxZ[c] - packet.origin.z);
+			float4 enter = max4(max4(min4(t0x, t1x), min4(t0y, t1y)), max4(min4(t0z, t1z), packet.tmin));
+			float4 exit = min4(min4(max4(t0x, t1x), max4(t0y, t1y)), min4(max4(t0z, t1z), float4::Load(packet.tmax + g)));
+			hit |= lessEqual(enter, exit) << g;
+		}
+		return hit & mask;
+	}
+};
+
+//---------------------------
+class BVH4 { // built with binned SAH as a binary tree, then collapsed into 4-wide nodes
+//---------------------------
+	struct BuildNode {
+		AABB box;
+		int left, right;	// -1 for a leaf
+		int first, count;	// primitives of a leaf
+	};
+	std::vector<BuildNode> buildNodes;
+	std::vector<vec3> centers;
+
+	int build(const AABB * boxes, int first, int count, int depth);
+	int collapse(int buildNode);
+public:
+	static const int maxLeafSize = 4, nBins = 16;
+	static const int maxDepth = 64;	// of the binary tree, deeper ranges become larger leaves
+
+	std::vector<BVH4Node> nodes;	// nodes[0] is the root
+	std::vector<int> primitives;	// the leaves refer to ranges of this permutation of the primitives
+	AABB bounds;
+
+	// Scratch arrays are kept, a rebuild of the same number of primitives does not allocate
+	void Build(const AABB * boxes, int count);
+
+	// Calls leaf(first, count, tmax) for the leaves along the ray front to back, leaf returns true on a hit and
+	// may shrink tmax. With anyHit the traversal stops at the first hit. The traversal may start in the
+	// subtree of a child (child and count as in BVH4Node) instead of the root.
+	template<bool anyHit, class Leaf> bool Traverse(const Ray& ray, float& tmax, Leaf& leaf, int child = 0, int count = 0) const {
+		if (nodes.empty()) return false;
+		vec3 invDir(1 / ray.dir.x, 1 / ray.dir.y, 1 / ray.dir.z);
+		struct Entry { int child, count; float tNear; } stack[maxDepth * 3 + 1];
+		int sp = 0;
+		stack[sp++] = Entry{ child, count, ray.tmin };
+		bool hit = false;
+		while (sp > 0) {
+			Entry entry = stack[--sp];
+			if (entry.tNear > tmax) continue;	// a closer hit was found since the push
+			if (entry.count > 0) {
+				if (leaf(entry.child, entry.count, tmax)) {
+					hit = true;
+					if (anyHit) return true;
+				}
+				continue;
+			}
+			const BVH4Node& node = nodes[entry.child];
+			float tNear[4];
+			int mask = node.Intersect(ray.origin, invDir, ray.tmin, tmax, tNear);
+			// the hit children are pushed far to near, so the nearest one is popped first
+			int order[4], n = 0;
+			for (int i = 0; i < 4; i++) {
+				if (!(mask & (1 << i)) || node.count[i] < 0) continue;
+				int k = n++;
+				for (; k > 0 && tNear[order[k - 1]] < tNear[i]; k--) order[k] = order[k - 1];
+				order[k] = i;
+			}
+			for (int k = 0; k < n; k++) stack[sp++] = Entry{ node.child[order[k]], node.count[order[k]], tNear[order[k]] };
+		}
+		return hit;
+	}
+
+	// Closest hits of the rays of the mask. Children missed by the frustum of the packet are skipped without
+	// testing the rays, leaf(first, count, mask) intersects the active rays of the packet with a leaf. When only
+	// one ray of a packet is left, single(ray, child, count) continues it alone in the subtree.
+	template<class Leaf, class Single> void TraversePacket(RayPacket& packet, int mask, Leaf& leaf, Single& single) const {
+		if (nodes.empty()) return;
+		struct Entry { int child, count, mask; } stack[maxDepth * 3 + 1];
+		int sp = 0;
+		stack[sp++] = Entry{ 0, 0, mask };
+		while (sp > 0) {
+			Entry entry = stack[--sp];
+			if (entry.count > 0) {
+				leaf(entry.child, entry.count, entry.mask);
+				continue;
+			}
+			const BVH4Node& node = nodes[entry.child];
+			float tNear[4];
+			int childMask = node.IntersectFrustum(packet, packet.MaxT(entry.mask), tNear);
+			int order[4], masks[4], n = 0;
+			for (int i = 0; i < 4; i++) {
+				if (!(childMask & (1 << i)) || node.count[i] < 0) continue;
+				int rays = node.IntersectRays(i, packet, entry.mask);
+				if (rays == 0) continue;
+				if ((rays & (rays - 1)) == 0) {		// diverged
+					int ray = 0;
+					while (!(rays & (1 << ray))) ray++;
+					single(ray, node.child[i], node.count[i]);
+					continue;
+				}
+				int k = n++;
+				for (; k > 0 && tNear[order[k - 1]] < tNear[i]; k--) { order[k] = order[k - 1]; masks[k] = masks[k - 1]; }
+				order[k] = i;
+				masks[k] = rays;
+			}
+			for (int k = 0; k < n; k++) stack[sp++] = Entry{ node.child[order[k]], node.count[order[k]], masks[k] };
+		}
+	}
+};
+
+//---------------------------
+class RayShape { // a surface in modeling space the rays can hit
+//---------------------------
+public:
+	virtual bool Intersect(const Ray& ray, float& tmax, RayHit& hit) const = 0;	// closest hit, tmax is shrunk
+	virtual bool Occluded(const Ray& ray) const {								// any hit in [tmin, tmax]
+		float tmax = ray.tmax;
+		RayHit hit;
+		return Intersect(ray, tmax, hit);
+	}
+	virtual void Surface(const RayHit& hit, vec3& position, vec3& normal, vec2& texcoord) const = 0;
+	virtual AABB Bounds() const = 0;
+	virtual void IntersectPacket(RayPacket& packet, int mask) const {			// closest hits of the rays of the mask
+		for (int i = 0; i < packet.size; i++) {
+			if (!(mask & (1 << i))) continue;
+			RayHit hit;
+			if (Intersect(packet.Single(i), packet.tmax[i], hit)) packet.hits[i] = hit;
+		}
+	}
+};
+
+//---------------------------
+class RayMesh : public RayShape { // triangles of a tessellated surface in modeling space
+//---------------------------
+	struct Triangle {
+		vec3 v0, e1, e2;	// first vertex and the edges from it
+		int vertex[3];		// indices of the vertices for the interpolation of the attributes
+	};
+	const SoftVertex * vertices = nullptr;
+	std::vector<Triangle> triangles;	// in the order of the primitives of the BVH
+	BVH4 bvh;
+
+	bool intersectTriangles(const Ray& ray, int first, int count, float& tmax, RayHit& hit) const;
+public:
+	// The vertex array of the triangle strips must outlive the mesh
+	void Build(const SoftVertex * _vertices, int nVtxPerStrip, int nStrips);
+	bool Intersect(const Ray& ray, float& tmax, RayHit& hit) const;	// closest hit, tmax is shrunk
+	bool Occluded(const Ray& ray) const;							// any hit in [tmin, tmax]
+	void IntersectPacket(RayPacket& packet, int mask) const;		// SIMD over the rays of the packet
+	void Surface(const RayHit& hit, vec3& position, vec3& normal, vec2& texcoord) const;
+	AABB Bounds() const { return bvh.bounds; }
+	size_t TriangleCount() const { return triangles.size(); }
+};
+
+enum RayShapeKind { SHAPE_SPHERE, SHAPE_CYLINDER, SHAPE_PLANE, SHAPE_PARABOLOID, SHAPE_DISK };
+
+//---------------------------
+class RayAnalytic : public RayShape { // closed form surfaces of the parametric surfaces, nothing is tessellated
+//---------------------------
+	RayShapeKind kind;
+public:
+	RayAnalytic(RayShapeKind _kind) : kind(_kind) { }
+	// u, v of the hit are the parameters of the surface, the same as the texture coordinates of the tessellation
+	bool Intersect(const Ray& ray, float& tmax, RayHit& hit) const;
+	void Surface(const RayHit& hit, vec3& position, vec3& normal, vec2& texcoord) const;
+	AABB Bounds() const;
+};
+
+//---------------------------
+class RayTracer {
+//---------------------------
+	struct Instance {
+		SoftDraw draw;		// transformation and material, the same uniforms as for the rasterizer
+		const RayShape * shape;
+	};
+	struct RayLight { vec3 La, Le; vec4 wLightPos; float range; };
+	struct RayCounter {		// rays traced by one thread, on its own cache line
+		size_t rays, primaryRays;
+		double primarySeconds;	// spent on the intersection of the primary rays
+		char padding[40];
+	};
+
+	int width = 0, height = 0, tilesX = 0, tilesY = 0;
+	vec3 background, wEye, forward, right, up;
+	float tNear = 0, tFar = FLT_MAX;
+	std::vector<RayLight> lights;
+	std::vector<Instance> instances;
+	std::vector<AABB> instanceBoxes;
+	BVH4 tlas;							// over the world space boxes of the instances, rebuilt every frame
+	std::vector<vec3> accumulation;		// sum of the samples of every pixel since the last restart
+	std::vector<unsigned char> pixels;	// BGRA, bottom row first like glReadPixels
+	int nSamples = 0;					// samples per pixel in the accumulation
+	RayCounter rayCounters[WorkerPool::maxThreads];
+	size_t frameRays = 0, totalRays = 0, totalPrimaryRays = 0;
+	double frameSeconds = 0, totalSeconds = 0, totalPrimarySeconds = 0;
+
+	bool intersectInstances(const Ray& ray, int first, int count, float& tmax, RayHit& hit) const;
+	bool intersect(const Ray& ray, RayHit& hit) const;
+	void intersectPacket(RayPacket& packet) const;
+	bool occluded(const Ray& ray) const;
+	vec3 trace(Ray ray, const RayHit * primaryHit, unsigned int seed, size_t& rays) const;
+	void renderTile(int tile, int thread);
+public:
+	static const int tileSize = 16;
+
+	// Starts a frame, the camera ray of the pixel center (x, y) in [-1, 1]^2 is forward + right * x + up * y,
+	// its parameter is the view depth that is clipped to [_tNear, _tFar]. Restart drops the accumulated samples.
+	void Begin(int _width, int _height, vec4 _background, vec3 _wEye, vec3 _forward, vec3 _right, vec3 _up,
+		float _tNear, float _tFar, bool restart);
+	void AddLight(vec3 La, vec3 Le, vec4 wLightPos, float range = 0);
+	void AddInstance(const SoftDraw& draw, const RayShape * shape);
+	// Builds the instance hierarchy and adds options.samples paths per pixel in tiles on the worker pool.
+	// The primary rays of each tile are intersected first, in packets of options.packet rays.
+	void End();
+
+	const unsigned char * Pixels() const { return &pixels[0]; }
+	int SampleCount() const { return nSamples; }
+	size_t TotalRays() const { return totalRays; }
+	double TotalSeconds() const { return totalSeconds; }
+	double PrimaryRate() const { return totalPrimaryRays / totalPrimarySeconds; }	// primary rays per second of one thread
+};
+
+extern RayTracer rayTracer;
@@ -0,0 +1,86 @@
+//=============================================================================================
+// Render targets: framebuffer objects with texture attachments that later passes sample
+//=============================================================================================
+#include "rendertarget.h"
+#include "headless.h"
+#include "options.h"
+
+// Pixel transfer format and size of a sized internal format, textures are created without data
+static void formatOf(unsigned int internalFormat, unsigned int& format, unsigned int& type, int& bytes) {
+	switch (internalFormat) {
+	case GL_RGBA8: format = GL_RGBA; type = GL_UNSIGNED_BYTE; bytes = 4; break;
+	case GL_RGBA16F: format = GL_RGBA; type = GL_FLOAT; bytes = 8; break;
+	case GL_RGBA32F: format = GL_RGBA; type = GL_FLOAT; bytes = 16; break;
+	case GL_RG16F: format = GL_RG; type = GL_FLOAT; bytes = 4; break;
+	case GL_RG32F: format = GL_RG; type = GL_FLOAT; bytes = 8; break;
+	case GL_R16F: format = GL_RED; type = GL_FLOAT; bytes = 2; break;
+	case GL_R32F: format = GL_RED; type = GL_FLOAT; bytes = 4; break;
+	case GL_DEPTH_COMPONENT32F: format = GL_DEPTH_COMPONENT; type = GL_FLOAT; bytes = 4; break;
+	default: format = GL_DEPTH_COMPONENT; type = GL_UNSIGNED_INT; bytes = 4; break;	// GL_DEPTH_COMPONENT24
+	}
+}
+
+static size_t createAttachment(Texture& texture, int width, int height, unsigned int internalFormat) {
+	unsigned int format, type;
+	int bytes;
+	formatOf(internalFormat, format, type, bytes);
+	if (texture.textureId == 0) glGenTextures(1, &texture.textureId);
+	glBindTexture(GL_TEXTURE_2D, texture.textureId);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	// texelFetch of the passes ignores it
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	return (size_t)width * height * bytes;
+}
+
+bool RenderTarget::Create(int _width, int _height, int _nColors, const unsigned int colorFormats[], unsigned int depthFormat) {
+	PROFILE_ZONE("RenderTarget::Create");
+	AllocScope allocScope(ALLOC_TEXTURES);
+	if (!hasGLContext()) return false;
+	width = _width; height = _height;
+	nColors = _nColors < maxColors ? _nColors : maxColors;
+	glStats.textureMemory -= gpuBytes;
+	gpuBytes = 0;
+	if (fbo == 0) glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	unsigned int drawBuffers[maxColors];
+	for (int i = 0; i < nColors; i++) {
+		gpuBytes += createAttachment(colors[i], width, height, colorFormats[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, colors[i].textureId, 0);
+		drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
+	}
+	if (nColors > 0) glDrawBuffers(nColors, drawBuffers);
+	else glDrawBuffer(GL_NONE);
+	if (depthFormat != 0) {
+		gpuBytes += createAttachment(depth, width, height, depthFormat);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth.textureId, 0);
+	}
+	glStats.textureMemory += gpuBytes;
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	if (!complete) printf("Render target of %dx%d is incomplete\n", width, height);
+	bindDefaultFramebuffer();
+	return complete;
+}
+
+void RenderTarget::Bind() {
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(0, 0, width, height);
+}
+
+void RenderTarget::CopyDefaultDepth() {
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, options.headless ? headlessFramebuffer() : 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	Bind();
+}
+
+RenderTarget::~RenderTarget() {
+	if (fbo > 0) glDeleteFramebuffers(1, &fbo);
+	glStats.textureMemory -= gpuBytes;
+}
+
+void bindDefaultFramebuffer() {
+	glBindFramebuffer(GL_FRAMEBUFFER, options.headless ? headlessFramebuffer() : 0);
+	glViewport(0, 0, windowWidth, windowHeight);
+}
@@ -0,0 +1,33 @@
+//=============================================================================================
+// Render targets: framebuffer objects with texture attachments that later passes sample
+//=============================================================================================
+#pragma once
+#include "framework.h"
+
+//---------------------------
+class RenderTarget {
+//---------------------------
+public:
+	static const int maxColors = 4;
+private:
+	unsigned int fbo = 0;
+	int width = 0, height = 0, nColors = 0;
+	size_t gpuBytes = 0;	// of all attachments, the textures themselves are not accounted
+public:
+	Texture colors[maxColors];	// attachment i is written by the output of location i
+	Texture depth;				// empty without a depth attachment
+
+	// Color formats are sized internal formats like GL_RGBA16F, a zero depth format leaves the depth out
+	bool Create(int width, int height, int nColors, const unsigned int colorFormats[], unsigned int depthFormat = GL_DEPTH_COMPONENT24);
+	void Bind();				// draws go into the attachments, the viewport covers them
+	// Blits the depth of the default framebuffer into the depth attachment and binds the target. The formats must
+	// match (24 bit depth of the headless backend), a multisampled default framebuffer is resolved.
+	void CopyDefaultDepth();
+	int Width() const { return width; }
+	int Height() const { return height; }
+	bool Created() const { return fbo != 0; }
+	~RenderTarget();
+};
+
+// Binds the window's back buffer or the offscreen framebuffer of the headless backend with the full viewport
+void bindDefaultFramebuffer();
@@ -0,0 +1,319 @@
+//=============================================================================================
+// Software rasterizer: tile binning, SIMD edge functions, tile-local depth buffer and CPU versions
+// of the Gouraud, Phong and NPR shaders
+//=============================================================================================
+#include "softraster.h"
+#include "workers.h"
+#include <string.h>
+#include <algorithm>
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define SOFT_SSE2
+#endif
+
+SoftRasterizer softRasterizer;
+
+unsigned int packColor(vec3 c) { // BGRA bytes in memory, like the readback of GL_BGRA
+	auto channel = [](float f) { return (unsigned int)((f < 0 ? 0 : f > 1 ? 1 : f) * 255 + 0.5f); };
+	return channel(c.z) | channel(c.y) << 8 | channel(c.x) << 16 | 0xFF000000u;
+}
+
+// Minv * v of the GLSL code, the matrix is applied from the left
+vec3 transformNormal(const mat4& Minv, vec3 n) {
+	vec4 n4(n.x, n.y, n.z, 0);
+	return vec3(dot(Minv[0], n4), dot(Minv[1], n4), dot(Minv[2], n4));
+}
+
+// Texture lookup with GL_REPEAT wrapping and the filter of the texture
+vec3 sampleTexture(const Texture * texture, float u, float v) {
+	if (!texture || texture->cpuImage.empty()) return vec3(1, 1, 1);
+	int w = texture->cpuWidth, h = texture->cpuHeight;
+	auto wrap = [](int i, int n) { i %= n; return i < 0 ? i + n : i; };
+	const vec4 * image = &texture->cpuImage[0];
+	if (texture->cpuSampling == GL_NEAREST) {
+		const vec4& t = image[wrap((int)floorf(v * h), h) * w + wrap((int)floorf(u * w), w)];
+		return vec3(t.x, t.y, t.z);
+	}
+	float x = u * w - 0.5f, y = v * h - 0.5f;
+	float x0 = floorf(x), y0 = floorf(y), fx = x - x0, fy = y - y0;
+	int ix0 = wrap((int)x0, w), ix1 = wrap((int)x0 + 1, w), iy0 = wrap((int)y0, h), iy1 = wrap((int)y0 + 1, h);
+	vec4 t = (image[iy0 * w + ix0] * (1 - fx) + image[iy0 * w + ix1] * fx) * (1 - fy)
+	       + (image[iy1 * w + ix0] * (1 - fx) + image[iy1 * w + ix1] * fx) * fy;
+	return vec3(t.x, t.y, t.z);
+}
+
+// Smooth window of point lights with a range, like the attenuation function of the GLSL code
+float lightAttenuation(float range, float distance) {
+	if (range <= 0) return 1;
+	float x = 1 - distance * distance / (range * range);
+	return x > 0 ? x * x : 0;
+}
+
+void SoftRasterizer::Begin(int _width, int _height, vec4 background, vec3 _wEye) {
+	if (_width != width || _height != height) {
+		width = _width; height = _height;
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+		pixels.resize((size_t)width * height * 4);
+		binStart.resize(tilesX * tilesY + 1);
+	}
+	draws.clear();
+	triangles.clear();
+	clearColor = packColor(vec3(background.x, background.y, background.z));
+	wEye = _wEye;
+	nLights = 0;
+	nTriangles = 0;
+}
+
+void SoftRasterizer::AddLight(vec3 _La, vec3 _Le, vec4 _wLightPos, float _range) {
+	if (nLights >= maxLights) return;
+	La[nLights] = _La; Le[nLights] = _Le; wLightPos[nLights] = _wLightPos; range[nLights] = _range;
+	nLights++;
+}
+
+void SoftRasterizer::DrawStrips(const SoftDraw& draw, const SoftVertex * vertices, int nVtxPerStrip, int nStrips) {
+	PROFILE_ZONE("SoftRasterizer::DrawStrips");
+	int drawIndex = (int)draws.size();
+	draws.push_back(draw);
+	int nVertices = nVtxPerStrip * nStrips;
+	if ((int)clipVertices.size() < nVertices) clipVertices.resize(nVertices);
+
+	// vertex shader
+	for (int i = 0; i < nVertices; i++) {
+		const SoftVertex& vtx = vertices[i];
+		ClipVertex& out = clipVertices[i];
+		vec4 pos(vtx.position.x, vtx.position.y, vtx.position.z, 1);
+		out.position = pos * draw.MVP;
+		vec4 wPos = pos * draw.M;
+		vec3 wNormal = transformNormal(draw.Minv, vtx.normal);
+		if (draw.shading == SOFT_GOURAUD) {	// radiance per vertex
+			vec3 V = normalize(wEye * wPos.w - vec3(wPos.x, wPos.y, wPos.z));
+			vec3 N = normalize(wNormal);
+			if (dot(N, V) < 0) N = -N;
+			vec3 radiance(0, 0, 0);
+			for (int l = 0; l < nLights; l++) {
+				vec3 toLight = vec3(wLightPos[l].x, wLightPos[l].y, wLightPos[l].z) * wPos.w - vec3(wPos.x, wPos.y, wPos.z) * wLightPos[l].w;
+				vec3 L = normalize(toLight);
+				vec3 H = normalize(L + V);
+				float cost = fmaxf(dot(N, L), 0), cosd = fmaxf(dot(N, H), 0);
+				radiance = radiance + draw.ka * La[l] + (draw.kd * cost + draw.ks * powf(cosd, draw.shininess)) * Le[l] * lightAttenuation(range[l], length(toLight));
+			}
+			out.varyings[0] = radiance.x; out.varyings[1] = radiance.y; out.varyings[2] = radiance.z;
+		}
+		else {								// the fragment shader lights
+			out.varyings[0] = wPos.x; out.varyings[1] = wPos.y; out.varyings[2] = wPos.z;
+			out.varyings[3] = wNormal.x; out.varyings[4] = wNormal.y; out.varyings[5] = wNormal.z;
+			out.varyings[6] = vtx.texcoord.x; out.varyings[7] = vtx.texcoord.y;
+		}
+	}
+
+	// primitive assembly of the strips
+	for (int s = 0; s < nStrips; s++) {
+		const ClipVertex * strip = &clipVertices[s * nVtxPerStrip];
+		for (int k = 0; k + 2 < nVtxPerStrip; k++) clipAndSetup(strip[k], strip[k + 1], strip[k + 2], drawIndex);
+	}
+}
+
+void SoftRasterizer::clipAndSetup(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c, int draw) {
+	const ClipVertex * v[3] = { &a, &b, &c };
+	// trivial reject against the six clip planes
+	for (int axis = 0; axis < 3; axis++) {
+		bool allBelow = true, allAbove = true;
+		for (int i = 0; i < 3; i++) {
+			allBelow = allBelow && v[i]->position[axis] < -v[i]->position.w;
+			allAbove = allAbove && v[i]->position[axis] > v[i]->position.w;
+		}
+		if (allBelow || allAbove) return;
+	}
+	float d[3];		// signed distance from the near plane, z + w >= 0 is in front of it
+	bool inside = true;
+	for (int i = 0; i < 3; i++) {
+		d[i] = v[i]->position.z + v[i]->position.w;
+		inside = inside && d[i] >= 0;
+	}
+	if (inside) {
+		setup(a, b, c, draw);
+		return;
+	}
+	// Sutherland-Hodgman against the near plane, a triangle becomes at most a quad
+	ClipVertex polygon[4];
+	int n = 0;
+	for (int i = 0; i < 3; i++) {
+		int j = (i + 1) % 3;
+		if (d[i] >= 0) polygon[n++] = *v[i];
+		if ((d[i] >= 0) != (d[j] >= 0)) {
+			float t = d[i] / (d[i] - d[j]);
+			ClipVertex& p = polygon[n++];
+			p.position = v[i]->position * (1 - t) + v[j]->position * t;
+			for (int k = 0; k < nVaryings; k++) p.varyings[k] = v[i]->varyings[k] * (1 - t) + v[j]->varyings[k] * t;
+		}
+	}
+	for (int i = 1; i + 1 < n; i++) setup(polygon[0], polygon[i], polygon[i + 1], draw);
+}
+
+void SoftRasterizer::setup(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c, int draw) {
+	Triangle tri;
+	const ClipVertex * v[3] = { &a, &b, &c };
+	for (int i = 0; i < 3; i++) {
+		float invW = 1 / v[i]->position.w;
+		tri.x[i] = (v[i]->position.x * invW * 0.5f + 0.5f) * width;
+		tri.y[i] = (v[i]->position.y * invW * 0.5f + 0.5f) * height;
+		tri.z[i] = v[i]->position.z * invW * 0.5f + 0.5f;
+		tri.invW[i] = invW;
+		for (int k = 0; k < nVaryings; k++) tri.varyings[i][k] = v[i]->varyings[k] * invW;
+	}
+	float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+	if (area == 0 || area != area) return;
+	if (area < 0) {		// no face culling, the rasterizer works on counterclockwise triangles
+		std::swap(tri.x[1], tri.x[2]); std::swap(tri.y[1], tri.y[2]);
+		std::swap(tri.z[1], tri.z[2]); std::swap(tri.invW[1], tri.invW[2]);
+		for (int k = 0; k < nVaryings; k++) std::swap(tri.varyings[1][k], tri.varyings[2][k]);
+	}
+	// pixels whose centers may be covered
+	tri.minX = (int)fmaxf(floorf(fminf(tri.x[0], fminf(tri.x[1], tri.x[2]))), 0);
+	tri.minY = (int)fmaxf(floorf(fminf(tri.y[0], fminf(tri.y[1], tri.y[2]))), 0);
+	tri.maxX = (int)fminf(ceilf(fmaxf(tri.x[0], fmaxf(tri.x[1], tri.x[2]))), (float)(width - 1));
+	tri.maxY = (int)fminf(ceilf(fmaxf(tri.y[0], fmaxf(tri.y[1], tri.y[2]))), (float)(height - 1));
+	if (tri.minX > tri.maxX || tri.minY > tri.maxY) return;
+	tri.draw = draw;
+
+	triangles.push_back(tri);
+	nTriangles++;
+}
+
+void SoftRasterizer::bin() {
+	PROFILE_ZONE("SoftRasterizer::bin");
+	// counting sort of the triangle indices by tile, the order of submission is kept within a tile
+	std::fill(binStart.begin(), binStart.end(), 0);
+	for (const Triangle& tri : triangles)
+		for (int ty = tri.minY / tileSize; ty <= tri.maxY / tileSize; ty++)
+			for (int tx = tri.minX / tileSize; tx <= tri.maxX / tileSize; tx++) binStart[ty * tilesX + tx + 1]++;
+	for (size_t tile = 1; tile < binStart.size(); tile++) binStart[tile] += binStart[tile - 1];
+	size_t nEntries = binStart.back();
+	if (binTriangles.capacity() < nEntries) binTriangles.reserve(nEntries + nEntries / 2);	// headroom for the moving camera
+	binTriangles.resize(nEntries);
+	for (int index = 0; index < (int)triangles.size(); index++) {
+		const Triangle& tri = triangles[index];
+		for (int ty = tri.minY / tileSize; ty <= tri.maxY / tileSize; ty++)
+			for (int tx = tri.minX / tileSize; tx <= tri.maxX / tileSize; tx++) binTriangles[binStart[ty * tilesX + tx]++] = index;
+	}
+	for (size_t tile = binStart.size() - 1; tile > 0; tile--) binStart[tile] = binStart[tile - 1];	// undo the shift of the fill
+	binStart[0] = 0;
+}
+
+void SoftRasterizer::End() {
+	PROFILE_ZONE("SoftRasterizer::End");
+	bin();
+	auto job = [this](int tile, int) {
+		PROFILE_ZONE("SoftRasterizer::tile");
+		float depth[tileSize * tileSize + 4];	// SIMD loads may read three floats past the last row
+		unsigned int color[tileSize * tileSize];
+		rasterizeTile(tile, depth, color);
+	};
+	workerPool.ParallelFor(tilesX * tilesY, job);
+}
+
+void SoftRasterizer::rasterizeTile(int tile, float * depth, unsigned int * color) {
+	int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+	int x1 = std::min(x0 + tileSize, width) - 1, y1 = std::min(y0 + tileSize, height) - 1;
+	for (int i = 0; i < tileSize * tileSize + 4; i++) depth[i] = 1;
+	for (int i = 0; i < tileSize * tileSize; i++) color[i] = clearColor;
+
+	for (int entry = binStart[tile]; entry < binStart[tile + 1]; entry++) {
+		const Triangle& tri = triangles[binTriangles[entry]];
+		// edge functions w_i(x, y) = A_i x + B_i y + C_i, w_i is the area of the subtriangle opposite vertex i
+		double A[3], B[3], C[3];
+		bool topLeft[3];
+		for (int i = 0; i < 3; i++) {
+			int a = (i + 1) % 3, b = (i + 2) % 3;
+			A[i] = (double)tri.y[a] - tri.y[b];
+			B[i] = (double)tri.x[b] - tri.x[a];
+			C[i] = -(A[i] * tri.x[a] + B[i] * tri.y[a]);
+			float dx = tri.x[b] - tri.x[a], dy = tri.y[b] - tri.y[a];
+			topLeft[i] = dy < 0 || (dy == 0 && dx < 0);	// pixels on a shared edge belong to one triangle only
+		}
+		double area = A[0] * tri.x[0] + B[0] * tri.y[0] + C[0];
+		if (area <= 0) continue;
+		float invArea = (float)(1 / area);
+		int minX = std::max(tri.minX, x0), maxX = std::min(tri.maxX, x1);
+		int minY = std::max(tri.minY, y0), maxY = std::min(tri.maxY, y1);
+
+		for (int y = minY; y <= maxY; y++) {
+			float * depthRow = &depth[(y - y0) * tileSize];
+			unsigned int * colorRow = &color[(y - y0) * tileSize];
+			float wRow[3];	// at the center of pixel (minX, y), in double to survive far off-screen vertices
+			for (int i = 0; i < 3; i++) wRow[i] = (float)(A[i] * (minX + 0.5) + B[i] * (y + 0.5) + C[i]);
+			for (int x = minX; x <= maxX; x += 4) {
+				float w[3][4], z[4];
+				int mask = 0;
+#if defined(SOFT_SSE2)
+				__m128 offset = _mm_add_ps(_mm_set1_ps((float)(x - minX)), _mm_set_ps(3, 2, 1, 0));
+				__m128 inside = _mm_cmplt_ps(_mm_add_ps(_mm_set1_ps((float)x), _mm_set_ps(3, 2, 1, 0)), _mm_set1_ps(maxX + 1.0f));
+				__m128 wv[3];
+				for (int i = 0; i < 3; i++) {
+					wv[i] = _mm_add_ps(_mm_set1_ps(wRow[i]), _mm_mul_ps(_mm_set1_ps((float)A[i]), offset));
+					__m128 edge = topLeft[i] ? _mm_cmpge_ps(wv[i], _mm_setzero_ps()) : _mm_cmpgt_ps(wv[i], _mm_setzero_ps());
+					inside = _mm_and_ps(inside, edge);
+					_mm_storeu_ps(w[i], wv[i]);
+				}
+				__m128 zv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(wv[0], _mm_set1_ps(tri.z[0])),
+					_mm_mul_ps(wv[1], _mm_set1_ps(tri.z[1]))), _mm_mul_ps(wv[2], _mm_set1_ps(tri.z[2]))), _mm_set1_ps(invArea));
+				inside = _mm_and_ps(inside, _mm_cmplt_ps(zv, _mm_loadu_ps(&depthRow[x - x0])));	// GL_LESS
+				_mm_storeu_ps(z, zv);
+				mask = _mm_movemask_ps(inside);
+#else
+				for (int lane = 0; lane < 4; lane++) {
+					bool in = x + lane <= maxX;
+					for (int i = 0; i < 3; i++) {
+						w[i][lane] = wRow[i] + (float)A[i] * (x - minX + lane);
+						in = in && (topLeft[i] ? w[i][lane] >= 0 : w[i][lane] > 0);
+					}
+					z[lane] = (w[0][lane] * tri.z[0] + w[1][lane] * tri.z[1] + w[2][lane] * tri.z[2]) * invArea;
+					if (in && z[lane] < depthRow[x - x0 + lane]) mask |= 1 << lane;
+				}
+#endif
+				for (int lane = 0; mask; lane++, mask >>= 1) {
+					if (!(mask & 1)) continue;
+					depthRow[x - x0 + lane] = z[lane];
+					colorRow[x - x0 + lane] = shade(tri, w[0][lane] * invArea, w[1][lane] * invArea, w[2][lane] * invArea);
+				}
+			}
+		}
+	}
+	for (int y = y0; y <= y1; y++)
+		memcpy(&pixels[((size_t)y * width + x0) * 4], &color[(y - y0) * tileSize], (x1 - x0 + 1) * 4);
+}
+
+// Fragment shaders; b0, b1, b2 are the screen space barycentric coordinates of the pixel center
+unsigned int SoftRasterizer::shade(const Triangle& tri, float b0, float b1, float b2) {
+	float w = 1 / (b0 * tri.invW[0] + b1 * tri.invW[1] + b2 * tri.invW[2]);
+	float v[nVaryings];
+	for (int k = 0; k < nVaryings; k++) v[k] = (b0 * tri.varyings[0][k] + b1 * tri.varyings[1][k] + b2 * tri.varyings[2][k]) * w;
+	const SoftDraw& draw = draws[tri.draw];
+	if (draw.shading == SOFT_GOURAUD) return packColor(vec3(v[0], v[1], v[2]));
+
+	vec3 wPos(v[0], v[1], v[2]);
+	vec3 N = normalize(vec3(v[3], v[4], v[5]));
+	vec3 V = normalize(wEye - wPos);
+	if (dot(N, V) < 0) N = -N;	// one-sided surfaces like Mobius or Klein
+	vec3 texColor = sampleTexture(draw.texture, v[6], v[7]);
+	auto toLight = [&](int l) { return vec3(wLightPos[l].x, wLightPos[l].y, wLightPos[l].z) - wPos * wLightPos[l].w; };
+	auto lightDir = [&](int l) { return normalize(toLight(l)); };
+
+	if (draw.shading == SOFT_NPR) {
+		if (nLights == 0 || fabsf(dot(N, V)) < 0.2f) return packColor(vec3(0, 0, 0));
+		float y = dot(N, lightDir(0)) > 0.5f ? 1 : 0.5f;
+		return packColor(texColor * y);
+	}
+
+	vec3 ka = draw.ka * texColor, kd = draw.kd * texColor;
+	vec3 radiance(0, 0, 0);
+	for (int l = 0; l < nLights; l++) {
+		vec3 L = lightDir(l);
+		vec3 H = normalize(L + V);
+		float cost = fmaxf(dot(N, L), 0), cosd = fmaxf(dot(N, H), 0);
+		// kd is modulated by the texture twice, as in the GLSL code
+		radiance = radiance + ka * La[l] + (kd * texColor * cost + draw.ks * powf(cosd, draw.shininess)) * Le[l] * lightAttenuation(range[l], length(toLight(l)));
+	}
+	return packColor(radiance);
+}
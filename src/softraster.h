@@ -0,0 +1,87 @@
+//=============================================================================================
+// Software rasterizer: renders the scene on the CPU when there is no GL context. Triangles are
+// binned into screen tiles, the tiles are rasterized in parallel with SIMD edge functions and
+// shaded like the Gouraud, Phong and NPR programs
+//=============================================================================================
+#pragma once
+#include "framework.h"
+
+// Shared with the ray tracer
+unsigned int packColor(vec3 c);								// BGRA bytes in memory, like the readback of GL_BGRA
+vec3 transformNormal(const mat4& Minv, vec3 n);				// Minv * n of the GLSL code
+vec3 sampleTexture(const Texture * texture, float u, float v);	// GL_REPEAT wrapping and the filter of the texture
+float lightAttenuation(float range, float distance);			// 1 without a range, fades to 0 at the range
+
+enum SoftShading { SOFT_GOURAUD, SOFT_PHONG, SOFT_NPR };
+
+//---------------------------
+struct SoftVertex { // layout of the vertex buffers of the parametric surfaces
+//---------------------------
+	vec3 position, normal;
+	vec2 texcoord;
+};
+
+//---------------------------
+struct SoftDraw { // uniforms of one draw, the counterpart of the RenderState of the shaders
+//---------------------------
+	mat4 M, Minv, MVP;
+	vec3 kd, ks, ka;
+	float shininess;
+	const Texture * texture;
+	SoftShading shading;
+};
+
+//---------------------------
+class SoftRasterizer {
+//---------------------------
+public:
+	static const int tileSize = 32, maxLights = 8;
+	static const int nVaryings = 8;		// world position, world normal, texcoord; radiance for Gouraud
+
+	struct Triangle {
+		float x[3], y[3];				// window coordinates, y grows upwards as in GL
+		float z[3], invW[3];			// depth in [0, 1] and 1/w for perspective correct interpolation
+		float varyings[3][nVaryings];	// already multiplied by 1/w
+		int draw;						// index of the SoftDraw
+		int minX, minY, maxX, maxY;		// pixel bounding box
+	};
+	struct ClipVertex {
+		vec4 position;					// clip space
+		float varyings[nVaryings];
+	};
+private:
+	int width = 0, height = 0, tilesX = 0, tilesY = 0;
+	unsigned int clearColor = 0;
+	vec3 wEye;
+	vec3 La[maxLights], Le[maxLights];
+	vec4 wLightPos[maxLights];
+	float range[maxLights];
+	int nLights = 0;
+
+	std::vector<SoftDraw> draws;
+	std::vector<Triangle> triangles;
+	std::vector<int> binStart;			// first entry of each tile in binTriangles, one extra at the end
+	std::vector<int> binTriangles;		// triangle indices grouped by tile, in submission order within a tile
+	std::vector<ClipVertex> clipVertices;
+	std::vector<unsigned char> pixels;	// BGRA, bottom row first like glReadPixels
+	size_t nTriangles = 0;
+
+	void setup(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c, int draw);
+	void clipAndSetup(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c, int draw);
+	void bin();
+	void rasterizeTile(int tile, float * depth, unsigned int * color);
+	unsigned int shade(const Triangle& tri, float b0, float b1, float b2);
+public:
+	// Starts a frame: clears the color and depth and takes the per-frame uniforms
+	void Begin(int _width, int _height, vec4 background, vec3 _wEye);
+	void AddLight(vec3 _La, vec3 _Le, vec4 _wLightPos, float _range = 0);
+	// Transforms and shades the vertices of triangle strips, clips the triangles at the near plane and bins them
+	void DrawStrips(const SoftDraw& draw, const SoftVertex * vertices, int nVtxPerStrip, int nStrips);
+	// Rasterizes every tile on the worker pool
+	void End();
+
+	const unsigned char * Pixels() const { return &pixels[0]; }
+	size_t TriangleCount() const { return nTriangles; }
+};
+
+extern SoftRasterizer softRasterizer;
@@ -0,0 +1,83 @@
+//=============================================================================================
+// Stream buffer: persistently mapped regions of frames in flight or an orphaned buffer on GL 3.3
+//=============================================================================================
+#include "streambuffer.h"
+#include <string.h>
+
+void StreamBuffer::Create(size_t bytesPerFrame, size_t maxWrites) {
+	PROFILE_ZONE("StreamBuffer::Create");
+	GLint offsetAlignment = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offsetAlignment);
+	if (offsetAlignment > 0) alignment = (size_t)offsetAlignment;
+	regionBytes = (bytesPerFrame + maxWrites * (alignment - 1) + alignment - 1) / alignment * alignment;
+
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_UNIFORM_BUFFER, regionBytes * frameCount, nullptr, flags);
+		mapped = (unsigned char *)glMapBufferRange(GL_UNIFORM_BUFFER, 0, regionBytes * frameCount, flags);
+		if (!mapped) {	// the storage is immutable, the fallback needs a new buffer
+			printf("Stream buffer cannot be mapped, it is written with glBufferSubData\n");
+			glDeleteBuffers(1, &buffer);
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		}
+	}
+	gpuBytes = mapped ? regionBytes * frameCount : regionBytes;
+	if (!mapped) glBufferData(GL_UNIFORM_BUFFER, regionBytes, nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glStats.vboMemory += gpuBytes;
+}
+
+void StreamBuffer::Begin() {
+	PROFILE_ZONE("StreamBuffer::Begin");
+	head = 0;
+	waited = false;
+	if (!mapped) {	// the draws of the last frame keep the old storage
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferData(GL_UNIFORM_BUFFER, regionBytes, nullptr, GL_STREAM_DRAW);
+		return;
+	}
+	frame = (frame + 1) % frameCount;
+	if (fences[frame] == 0) return;
+	if (glClientWaitSync(fences[frame], 0, 0) == GL_TIMEOUT_EXPIRED) {
+		waited = true;
+		while (glClientWaitSync(fences[frame], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) { }
+	}
+	glDeleteSync(fences[frame]);
+	fences[frame] = 0;
+}
+
+long StreamBuffer::Write(const void * data, size_t bytes) {
+	if (head + bytes > regionBytes) {
+		if (!overflowReported) printf("Stream buffer region of %d bytes is full\n", (int)regionBytes);
+		overflowReported = true;
+		return -1;
+	}
+	size_t offset = head;
+	head = (head + bytes + alignment - 1) / alignment * alignment;
+	if (mapped) {
+		offset += frame * regionBytes;
+		memcpy(mapped + offset, data, bytes);
+	} else {
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, offset, bytes, data);
+	}
+	glStats.Upload(bytes);
+	return (long)offset;
+}
+
+void StreamBuffer::BindUniforms(unsigned int binding, long offset, size_t bytes) {
+	if (offset >= 0) glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, bytes);
+}
+
+void StreamBuffer::End() {
+	if (mapped) fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+StreamBuffer::~StreamBuffer() {
+	for (GLsync fence : fences) if (fence) glDeleteSync(fence);
+	if (buffer > 0) glDeleteBuffers(1, &buffer);
+	glStats.vboMemory -= gpuBytes;
+}
@@ -0,0 +1,36 @@
+//=============================================================================================
+// Stream buffer: per-frame uniform data written linearly into one buffer and bound by offset.
+// With buffer storage (GL 4.4) the buffer is mapped persistently and split into regions of
+// frames in flight guarded by fences, on GL 3.3 it is orphaned every frame and written with
+// glBufferSubData.
+//=============================================================================================
+#pragma once
+#include "framework.h"
+
+//---------------------------
+class StreamBuffer {
+//---------------------------
+	static const int frameCount = 3;	// regions of the persistent buffer, the GPU reads the last two
+	unsigned int buffer = 0;
+	unsigned char * mapped = nullptr;	// all regions, null without buffer storage
+	GLsync fences[frameCount] = {};		// signaled when the GPU finished the draws of the region
+	size_t regionBytes = 0, head = 0;	// head is the next free byte of the current region
+	size_t alignment = 256;				// of the offsets of uniform block bindings
+	size_t gpuBytes = 0;
+	int frame = 0;
+	bool overflowReported = false;
+public:
+	bool waited = false;	// the region of the current frame was still read by the GPU at Begin
+
+	// Room for bytesPerFrame of data in at most maxWrites blocks per frame, each aligned for binding
+	void Create(size_t bytesPerFrame, size_t maxWrites);
+	bool Created() const { return buffer != 0; }
+	bool Persistent() const { return mapped != nullptr; }
+
+	void Begin();		// waits until the region of the frame is free, or orphans the buffer
+	// Copies the data to the head of the region, the offset of the block or -1 if the region is full
+	long Write(const void * data, size_t bytes);
+	void BindUniforms(unsigned int binding, long offset, size_t bytes);	// block at offset to the binding point
+	void End();			// fences the region of the frame
+	~StreamBuffer();
+};
@@ -0,0 +1,58 @@
+//=============================================================================================
+// Worker pool: persistent threads running the iterations of a parallel loop
+//=============================================================================================
+#include "workers.h"
+#include "alloc.h"
+
+WorkerPool workerPool;
+
+void WorkerPool::Start(int nThreads) {
+	Stop();
+	quit = false;
+	if (nThreads > maxThreads) nThreads = maxThreads;
+	for (int t = 1; t < nThreads; t++) threads.push_back(std::thread(&WorkerPool::work, this, t));
+}
+
+void WorkerPool::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (std::thread& thread : threads) thread.join();
+	threads.clear();
+}
+
+void WorkerPool::work(int thread) {
+	allocSetTag(ALLOC_RENDER_LOOP);		// workers only run frame work
+	unsigned int seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return quit || generation != seen; });
+			if (quit) return;
+			seen = generation;
+		}
+		for (int i; (i = next.fetch_add(1)) < count; ) job(context, i, thread);
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--running == 0) done.notify_one();
+	}
+}
+
+void WorkerPool::run(Job _job, void * _context, int _count) {
+	if (threads.empty()) {		// single threaded, no synchronization
+		for (int i = 0; i < _count; i++) _job(_context, i, 0);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = _job; context = _context; count = _count;
+		next = 0;
+		running = (int)threads.size();
+		generation++;
+	}
+	wake.notify_all();
+	for (int i; (i = next.fetch_add(1)) < count; ) job(context, i, 0);
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&] { return running == 0; });
+}
@@ -0,0 +1,68 @@
+//=============================================================================================
+// Worker pool: persistent threads running the iterations of a parallel loop
+//=============================================================================================
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//---------------------------
+class WorkerPool {
+//---------------------------
+public:
+	static const int maxThreads = 64;
+private:
+	typedef void (*Job)(void * context, int index, int thread);
+
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	Job job = nullptr;
+	void * context = nullptr;
+	int count = 0;
+	std::atomic<int> next{ 0 };		// next loop index to take
+	int running = 0;				// participants still working on the current loop
+	unsigned int generation = 0;	// incremented by each loop, wakes the workers
+	bool quit = false;
+	struct Range {						// loop indices owned by one participant of ParallelForStealing
+		std::atomic<int> next{ 0 };
+		int end = 0;
+		char padding[56];				// ranges of different threads are on different cache lines
+	} ranges[maxThreads];
+
+	void work(int thread);
+	void run(Job _job, void * _context, int _count);
+
+	template<class F> static void call(void * f, int index, int thread) { (*(F *)f)(index, thread); }
+public:
+	void Start(int nThreads);	// the calling thread is one of the nThreads, at most maxThreads
+	void Stop();
+	int ThreadCount() const { return (int)threads.size() + 1; }
+
+	// Calls f(index, thread) for index in [0, count), indices are taken dynamically so uneven work balances out.
+	// thread is in [0, ThreadCount()), 0 is the caller. Returns when every call returned, nothing is allocated.
+	template<class F> void ParallelFor(int _count, F& f) { run(&call<F>, &f, _count); }
+
+	// Like ParallelFor, but each thread starts on its own contiguous part of [0, count), so neighboring indices
+	// stay on one core, and steals indices from the parts of the others when its own part is done
+	template<class F> void ParallelForStealing(int _count, F& f) {
+		int n = ThreadCount();
+		for (int r = 0; r < n; r++) {
+			ranges[r].next = (int)((long long)_count * r / n);
+			ranges[r].end = (int)((long long)_count * (r + 1) / n);
+		}
+		auto part = [this, n, &f](int first, int thread) {
+			for (int r = 0; r < n; r++) {
+				Range& range = ranges[(first + r) % n];
+				for (int i; (i = range.next.fetch_add(1)) < range.end; ) f(i, thread);
+			}
+		};
+		ParallelFor(n, part);
+	}
+
+	~WorkerPool() { Stop(); }
+};
+
+extern WorkerPool workerPool;